@@ -0,0 +1,220 @@
+#include "redismodule.h"
+#include "value.h"
+#include "tape.h"
+#include "config.h"
+#include "jsonDiff.h"
+#include "jsonToValue.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A document that serializes to more than `chunkSize` bytes is
+ * rewritten as JSON.SET of an empty root followed by JSON.PATCH
+ * commands that add its members back in order, each one batching
+ * "add" operations up to about `chunkSize` bytes. Members that are
+ * too big themselves are added empty and filled the same way, so
+ * only a scalar bigger than the limit makes an entry bigger than it.
+ * An object that repeats a key is written whole as well, since adding
+ * its members one by one would keep only the last of them. Nodes are
+ * JsonValue pointers for a tree and word indexes for a tape.
+ */
+typedef struct {
+  RedisModuleIO* aof;
+  RedisModuleString* key;
+  const JsonTape* tape;
+  size_t chunkSize;
+  char* ops;
+  size_t len;
+  size_t cap;
+  JsonDiffStep* path;
+  size_t depth;
+  size_t pathCap;
+} AofWriter;
+
+static JsonValueType nodeType(const AofWriter* w, uintptr_t node) {
+  return w->tape ? tapeType(w->tape, node) : ((JsonValue*)node)->type;
+}
+
+static size_t nodeSize(const AofWriter* w, uintptr_t node) {
+  return w->tape ?
+    tapeSerializedSize(w->tape, node) :
+    jsonSerializedSize((JsonValue*)node);
+}
+
+static char* nodeWrite(const AofWriter* w, uintptr_t node, char* out) {
+  return w->tape ? tapeWrite(w->tape, node, out) : jsonWrite((JsonValue*)node, out);
+}
+
+static void push(AofWriter* w, const char* key, size_t len) {
+  if(w->depth == w->pathCap) {
+    w->pathCap = w->pathCap ? w->pathCap * 2 : 16;
+    w->path = RedisModule_Realloc(w->path, w->pathCap * sizeof(JsonDiffStep));
+  }
+  w->path[w->depth].key = key;
+  w->path[w->depth].len = len;
+  ++w->depth;
+}
+
+static void flush(AofWriter* w) {
+  if(!w->len) return;
+  w->ops[w->len++] = ']';
+  RedisModule_EmitAOF(w->aof, "JSON.PATCH", "sb", w->key, w->ops, w->len);
+  w->len = 0;
+}
+
+/*
+ * Adds the node on the current path, or an empty container of its
+ * type when `empty` is set.
+ */
+static void addOp(AofWriter* w, uintptr_t node, size_t size, bool empty) {
+  size_t opSize = 40 + jsonPointerSize(w->path, w->depth) + (empty ? 2 : size);
+  if(w->len && w->len + opSize > w->chunkSize) flush(w);
+  if(w->len + opSize > w->cap) {
+    w->cap = w->len + opSize > 2 * w->cap ? w->len + opSize : 2 * w->cap;
+    w->ops = RedisModule_Realloc(w->ops, w->cap);
+  }
+
+  char* out = w->ops + w->len;
+  const char* head = w->len ? ",{\"op\":\"add\",\"path\":\"" : "[{\"op\":\"add\",\"path\":\"";
+  memcpy(out, head, 21);
+  out = jsonPointerWrite(w->path, w->depth, out + 21);
+  memcpy(out, "\",\"value\":", 10);
+  out += 10;
+  if(empty) {
+    *out++ = nodeType(w, node) == OBJECT ? '{' : '[';
+    *out++ = nodeType(w, node) == OBJECT ? '}' : ']';
+  } else {
+    out = nodeWrite(w, node, out);
+  }
+  *out++ = '}';
+  w->len = out - w->ops;
+}
+
+static int compareSteps(const void* a, const void* b) {
+  const JsonDiffStep* x = a;
+  const JsonDiffStep* y = b;
+  if(x->len != y->len) return x->len < y->len ? -1 : 1;
+  return memcmp(x->key, y->key, x->len);
+}
+
+static bool repeatsKeys(const AofWriter* w, uintptr_t node) {
+  size_t count = 0, cap = 16;
+  JsonDiffStep* keys = RedisModule_Alloc(cap * sizeof(JsonDiffStep));
+  if(w->tape) {
+    const JsonTape* tape = w->tape;
+    size_t end = tapeNext(tape, node);
+    for(size_t i = node + 1; i < end; i = tapeNext(tape, i + 1)) {
+      if(count == cap) {
+        cap *= 2;
+        keys = RedisModule_Realloc(keys, cap * sizeof(JsonDiffStep));
+      }
+      keys[count].key = tapeString(tape, i, &keys[count].len);
+      ++count;
+    }
+  } else {
+    const struct JsonObject* object = &((JsonValue*)node)->value.object;
+    if(object->size > cap) {
+      keys = RedisModule_Realloc(keys, object->size * sizeof(JsonDiffStep));
+    }
+    for(; count < object->size; count++) {
+      keys[count].key = keyData(object->elements[count]);
+      keys[count].len = object->elements[count]->keyLen;
+    }
+  }
+  qsort(keys, count, sizeof(JsonDiffStep), compareSteps);
+  bool repeats = false;
+  for(size_t i = 1; i < count && !repeats; i++) {
+    repeats = !compareSteps(&keys[i - 1], &keys[i]);
+  }
+  RedisModule_Free(keys);
+  return repeats;
+}
+
+/*
+ * Whether the node goes in one piece rather than member by member.
+ */
+static bool whole(const AofWriter* w, uintptr_t node, size_t size) {
+  JsonValueType type = nodeType(w, node);
+  if(size <= w->chunkSize || (type != OBJECT && type != ARRAY)) return true;
+  return type == OBJECT && repeatsKeys(w, node);
+}
+
+static void fill(AofWriter* w, uintptr_t node);
+
+static void addMember(AofWriter* w, uintptr_t node) {
+  size_t size = nodeSize(w, node);
+  if(whole(w, node, size)) {
+    addOp(w, node, size, false);
+    return;
+  }
+  addOp(w, node, 0, true);
+  fill(w, node);
+}
+
+static void fill(AofWriter* w, uintptr_t node) {
+  if(w->tape) {
+    const JsonTape* tape = w->tape;
+    bool object = tapeTag(tape, node) == '{';
+    size_t end = tapeNext(tape, node);
+    for(size_t i = node + 1, index = 0; i < end; index++) {
+      if(object) {
+        size_t len;
+        const char* key = tapeString(tape, i, &len);
+        push(w, key, len);
+        ++i;
+      } else {
+        push(w, NULL, index);
+      }
+      addMember(w, i);
+      --w->depth;
+      i = tapeNext(tape, i);
+    }
+    return;
+  }
+
+  JsonValue* value = (JsonValue*)node;
+  if(value->type == OBJECT) {
+    for(size_t i = 0; i < value->value.object.size; i++) {
+      JsonKeyVal* member = value->value.object.elements[i];
+      push(w, keyData(member), member->keyLen);
+      addMember(w, (uintptr_t)member->value);
+      --w->depth;
+    }
+  } else {
+    for(size_t i = 0; i < value->value.array.size; i++) {
+      push(w, NULL, i);
+      addMember(w, (uintptr_t)value->value.array.array[i]);
+      --w->depth;
+    }
+  }
+}
+
+void JsonTypeAofRewriteImpl(
+  RedisModuleIO* aof,
+  RedisModuleString* key,
+  const RedisJsonValue* doc
+) {
+  AofWriter w;
+  memset(&w, 0, sizeof(AofWriter));
+  w.aof = aof;
+  w.key = key;
+  w.tape = doc->tape;
+  w.chunkSize = jsonConfig.aofChunkSize ? jsonConfig.aofChunkSize : SIZE_MAX;
+  uintptr_t root = doc->tape ? 0 : (uintptr_t)doc->rootJson;
+
+  JsonValueType type = nodeType(&w, root);
+  size_t size = nodeSize(&w, root);
+  if(whole(&w, root, size)) {
+    char* json = RedisModule_Alloc(size);
+    size_t len = nodeWrite(&w, root, json) - json;
+    RedisModule_EmitAOF(aof, "JSON.SET", "scb", key, "$", json, len);
+    RedisModule_Free(json);
+    return;
+  }
+
+  RedisModule_EmitAOF(aof, "JSON.SET", "scc", key, "$", type == OBJECT ? "{}" : "[]");
+  fill(&w, root);
+  flush(&w);
+  RedisModule_Free(w.ops);
+  RedisModule_Free(w.path);
+}
@@ -0,0 +1,87 @@
+#include "arena.h"
+#include "redismodule.h"
+
+#define ARENA_ALIGN 8
+#define ARENA_MIN_CHUNK 4096
+#define ARENA_MAX_CHUNK (1024 * 1024)
+
+static inline size_t alignSize(size_t size) {
+  return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static ArenaChunk* newChunk(JsonArena* arena, size_t size) {
+  ArenaChunk* chunk = RedisModule_Calloc(1, sizeof(ArenaChunk) + size);
+  chunk->size = size;
+  chunk->used = 0;
+  arena->reserved += sizeof(ArenaChunk) + size;
+  ++arena->chunks;
+  return chunk;
+}
+
+/*
+ * `sizeHint` sizes the first chunk, so a document whose size is
+ * known up front (parse, RDB load) usually lives in a single block.
+ */
+JsonArena* arenaNew(size_t sizeHint) {
+  JsonArena* arena = RedisModule_Calloc(1, sizeof(JsonArena));
+  arena->nextChunkSize = ARENA_MIN_CHUNK;
+  if(sizeHint > ARENA_MIN_CHUNK) {
+    arena->head = newChunk(arena, alignSize(sizeHint));
+  }
+  return arena;
+}
+
+/*
+ * Returns zeroed memory: chunks are calloc'ed and never reused.
+ */
+void* arenaAlloc(JsonArena* arena, size_t size) {
+  size = alignSize(size);
+  ArenaChunk* chunk = arena->head;
+  if(chunk && chunk->size - chunk->used >= size) {
+    void* ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+  }
+
+  /*
+   * Big blocks get a chunk of their own behind the current one
+   * instead of abandoning whatever room the current one has left.
+   */
+  if(chunk && size > arena->nextChunkSize / 2) {
+    ArenaChunk* big = newChunk(arena, size);
+    big->used = size;
+    big->next = chunk->next;
+    chunk->next = big;
+    return big->data;
+  }
+
+  chunk = newChunk(arena, size > arena->nextChunkSize ? size : arena->nextChunkSize);
+  chunk->next = arena->head;
+  arena->head = chunk;
+  if(arena->nextChunkSize < ARENA_MAX_CHUNK) arena->nextChunkSize *= 2;
+
+  chunk->used = size;
+  return chunk->data;
+}
+
+void arenaRelease(JsonArena* arena, size_t size) {
+  arena->wasted += alignSize(size);
+}
+
+void arenaFree(JsonArena* arena) {
+  ArenaChunk* chunk = arena->head;
+  while(chunk) {
+    ArenaChunk* next = chunk->next;
+    RedisModule_Free(chunk);
+    chunk = next;
+  }
+  RedisModule_Free(arena);
+}
+
+size_t arenaLive(const JsonArena* arena) {
+  size_t used = 0;
+  for(const ArenaChunk* chunk = arena->head; chunk; chunk = chunk->next) {
+    used += chunk->used;
+  }
+  return used - arena->wasted;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Bump allocator owning every node, key and string of one document.
+ * Memory is only returned when the whole arena is freed, one chunk
+ * at a time; bytes that a mutation stops using are counted in
+ * `wasted`, and docCompact moves a document to a new arena once they
+ * pile up.
+ */
+typedef struct ArenaChunk {
+  struct ArenaChunk* next;
+  size_t size;
+  size_t used;
+  char data[];
+} ArenaChunk;
+
+typedef struct {
+  ArenaChunk* head;
+  size_t nextChunkSize;
+  size_t reserved;
+  size_t wasted;
+  size_t chunks;
+} JsonArena;
+
+JsonArena* arenaNew(size_t sizeHint);
+void* arenaAlloc(JsonArena* arena, size_t size);
+void arenaRelease(JsonArena* arena, size_t size);
+void arenaFree(JsonArena* arena);
+
+/*
+ * Bytes handed out and not released since, which is enough for a copy
+ * of everything still in use.
+ */
+size_t arenaLive(const JsonArena* arena);
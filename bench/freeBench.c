@@ -0,0 +1,190 @@
+/*
+ * Main thread time of deleting a large document, before and after
+ * lazy free support. Before, Redis called the free callback inline.
+ * Now it calls unlink2 and free_effort2 first and, for an effort
+ * above its lazyfree threshold, queues the free for a background
+ * thread; that hand off is reproduced here with one worker thread.
+ * Runs for heap trees, arena trees and tapes.
+ *
+ *   cmake -S . -B build -DREDISJSON_BUILD_BENCH=ON
+ *   cmake --build build --target freeBench && ./build/freeBench
+ */
+#include "redismodule.h"
+#include "value.h"
+#include "jsonToValue.h"
+#include "config.h"
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define OBJECTS 20000
+#define ROUNDS 7
+
+/* Same as LAZYFREE_THRESHOLD in Redis. */
+#define LAZYFREE_THRESHOLD 64
+
+static void* benchAlloc(size_t size) { return malloc(size); }
+static void* benchCalloc(size_t count, size_t size) { return calloc(count, size); }
+static void* benchRealloc(void* ptr, size_t size) { return realloc(ptr, size); }
+static void benchFree(void* ptr) { free(ptr); }
+static size_t benchMallocSize(void* ptr) { return malloc_usable_size(ptr); }
+
+/*
+ * CPU time of the calling thread, so the main thread is not charged
+ * for the lazyfree thread running in between on a busy or single core
+ * machine.
+ */
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * About eleven nodes per object, so 220k in all.
+ */
+static char* buildJson(size_t* len) {
+  size_t cap = OBJECTS * 200 + 16;
+  char* json = malloc(cap);
+  char* out = json;
+  *out++ = '[';
+  for(int i = 0; i < OBJECTS; i++) {
+    if(i) *out++ = ',';
+    out += sprintf(
+      out,
+      "{\"id\":%d,\"name\":\"user %d\",\"active\":%s,\"score\":%d.25,"
+      "\"tags\":[\"a\",\"b\",\"c\"],\"parent\":null}",
+      i,
+      i,
+      i % 2 ? "true" : "false",
+      i % 1000
+    );
+  }
+  *out++ = ']';
+  *len = out - json;
+  return json;
+}
+
+/*
+ * A single-slot queue standing in for Redis's lazyfree job list.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+static RedisJsonValue* pending;
+static bool stopping;
+static double backgroundSeconds;
+
+static void* lazyfreeThread(void* arg) {
+  pthread_mutex_lock(&lock);
+  while(1) {
+    while(!pending && !stopping) pthread_cond_wait(&ready, &lock);
+    if(!pending) break;
+    RedisJsonValue* doc = pending;
+    pthread_mutex_unlock(&lock);
+    double start = now();
+    docFree(doc);
+    double elapsed = now() - start;
+    pthread_mutex_lock(&lock);
+    backgroundSeconds += elapsed;
+    pending = NULL;
+    pthread_cond_broadcast(&ready);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+static void waitForLazyfree(void) {
+  pthread_mutex_lock(&lock);
+  while(pending) pthread_cond_wait(&ready, &lock);
+  pthread_mutex_unlock(&lock);
+}
+
+static int compareDoubles(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+static double median(double* samples) {
+  qsort(samples, ROUNDS, sizeof(double), compareDoubles);
+  return samples[ROUNDS / 2];
+}
+
+/*
+ * The first round is a warm-up: it is where the allocator maps and
+ * returns fresh memory, which would otherwise only be charged to the
+ * first variant.
+ */
+static void run(const char* name, const char* json, size_t len) {
+  double inlineSeconds[ROUNDS], mainSeconds[ROUNDS], lazySeconds[ROUNDS];
+  size_t effort = 0;
+  for(int round = -1; round < ROUNDS; round++) {
+    RedisJsonValue* doc = parseDocument(NULL, json, len);
+    double start = now();
+    docFree(doc);
+    double elapsed = now() - start;
+    if(round >= 0) inlineSeconds[round] = elapsed;
+
+    doc = parseDocument(NULL, json, len);
+    backgroundSeconds = 0;
+    start = now();
+    docUnlink(doc);
+    effort = docFreeEffort(doc);
+    if(effort > LAZYFREE_THRESHOLD) {
+      pthread_mutex_lock(&lock);
+      pending = doc;
+      pthread_cond_signal(&ready);
+      pthread_mutex_unlock(&lock);
+    } else {
+      docFree(doc);
+    }
+    elapsed = now() - start;
+    waitForLazyfree();
+    if(round >= 0) {
+      mainSeconds[round] = elapsed;
+      lazySeconds[round] = backgroundSeconds;
+    }
+  }
+  printf(
+    "%-6s effort %8zu   DEL before %8.3f ms   after %8.3f ms"
+    "   (lazyfree thread %8.3f ms)\n",
+    name,
+    effort,
+    median(inlineSeconds) * 1e3,
+    median(mainSeconds) * 1e3,
+    median(lazySeconds) * 1e3
+  );
+}
+
+int main(void) {
+  RedisModule_Alloc = benchAlloc;
+  RedisModule_Calloc = benchCalloc;
+  RedisModule_Realloc = benchRealloc;
+  RedisModule_Free = benchFree;
+  RedisModule_MallocSize = benchMallocSize;
+
+  size_t len;
+  char* json = buildJson(&len);
+  printf("document: %zu bytes, %d objects\n", len, OBJECTS);
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, lazyfreeThread, NULL);
+
+  jsonConfig.storage = STORAGE_TREE;
+  jsonConfig.arena = 0;
+  run("heap", json, len);
+  jsonConfig.arena = 1;
+  run("arena", json, len);
+  jsonConfig.storage = STORAGE_TAPE;
+  run("tape", json, len);
+
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  pthread_cond_signal(&ready);
+  pthread_mutex_unlock(&lock);
+  pthread_join(thread, NULL);
+  free(json);
+  return 0;
+}
@@ -0,0 +1,248 @@
+/*
+ * Replays what a master sends on to a copy of the document and checks
+ * that the copy ends up byte for byte the same. A whole-document
+ * JSON.SET with set-diff goes to replicas as the JSON.PATCH that
+ * jsonDiffApply emits, unless the diff is incomplete and the command
+ * is sent as it came. An AOF rewrite is loaded back the way Redis
+ * would, JSON.SET then every JSON.PATCH into an arena, which also
+ * checks that a flat object of more than 100k members, split into
+ * 4 MB patches, loads without the arena growing out of bounds. Exits
+ * with 1 when any case differs.
+ *
+ *   cmake -S . -B build -DREDISJSON_BUILD_BENCH=ON
+ *   cmake --build build --target replayCheck && ./build/replayCheck
+ */
+#include "redismodule.h"
+#include "value.h"
+#include "jsonToValue.h"
+#include "jsonDiff.h"
+#include "jsonPatch.h"
+#include "config.h"
+#include <malloc.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void* benchAlloc(size_t size) { return malloc(size); }
+static void* benchCalloc(size_t count, size_t size) { return calloc(count, size); }
+static void* benchRealloc(void* ptr, size_t size) { return realloc(ptr, size); }
+static void benchFree(void* ptr) { free(ptr); }
+static size_t benchMallocSize(void* ptr) { return malloc_usable_size(ptr); }
+
+/*
+ * The document being loaded, and the text of its AOF commands.
+ */
+static RedisJsonValue* loaded;
+static size_t commands;
+static size_t largestCommand;
+
+/*
+ * Stands in for Redis replaying the AOF, one command at a time:
+ * "scb" and "scc" are JSON.SET key $ json, "sb" is JSON.PATCH key
+ * patch.
+ */
+static void benchEmitAOF(RedisModuleIO* aof, const char* cmd, const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  va_arg(ap, RedisModuleString*);
+  if(fmt[1] == 'c') va_arg(ap, const char*);
+  const char* json = va_arg(ap, const char*);
+  size_t len = fmt[strlen(fmt) - 1] == 'c' ? strlen(json) : va_arg(ap, size_t);
+  va_end(ap);
+
+  ++commands;
+  if(len > largestCommand) largestCommand = len;
+  if(!strcmp(cmd, "JSON.SET")) {
+    if(loaded) docFree(loaded);
+    loaded = docNew(true, len);
+    loaded->rootJson = parseJson(NULL, json, len, loaded->arena);
+    return;
+  }
+  JsonValue* patch = parseJson(NULL, json, len, loaded->arena);
+  const char* err = patch ? jsonPatchApply(loaded->arena, &loaded->rootJson, patch) : "unparsable";
+  if(err) printf("  JSON.PATCH %.60s...: %s\n", json, err);
+  docCompact(loaded);
+}
+
+static JsonValue* parse(const char* json) {
+  JsonValue* value = parseJson(NULL, json, strlen(json), NULL);
+  if(!value) {
+    printf("unparsable document %s\n", json);
+    exit(1);
+  }
+  return value;
+}
+
+/*
+ * Drops the backslash of every escaped slash. A pointer only holds
+ * the decoded `/`, so a member JSON.PATCH creates from it is stored
+ * with a plain one, which is the same key.
+ */
+static size_t plainSlashes(char* text, size_t len) {
+  size_t out = 0;
+  for(size_t i = 0; i < len; i++) {
+    if(text[i] == '\\' && i + 1 < len && text[i + 1] != '/') {
+      text[out++] = text[i++];
+    } else if(text[i] == '\\') {
+      ++i;
+    }
+    text[out++] = text[i];
+  }
+  return out;
+}
+
+/*
+ * True when both trees serialize to the same text, members in the
+ * same order and repeated keys included.
+ */
+static bool sameText(JsonValue* a, JsonValue* b) {
+  size_t aLen, bLen;
+  char* aText = jsonToBuffer(a, &aLen);
+  char* bText = jsonToBuffer(b, &bLen);
+  aLen = plainSlashes(aText, aLen);
+  bLen = plainSlashes(bText, bLen);
+  bool same = aLen == bLen && !memcmp(aText, bText, aLen);
+  RedisModule_Free(aText);
+  RedisModule_Free(bText);
+  return same;
+}
+
+/*
+ * Keys holding escapes, `~` and `/`, and objects repeating a key,
+ * which the parser accepts.
+ */
+static const char* diffCases[][2] = {
+  {"{\"a\\/b\":1}", "{\"a\\/b\":2}"},
+  {"{\"a\\/b\":{\"c~d\":1,\"e/f\":[1]}}", "{\"a\\/b\":{\"c~d\":2,\"e/f\":[1,2]}}"},
+  {"{\"x\\\"y\":1,\"q\\\\/z\":1}", "{\"x\\\"y\":3,\"q\\\\/z\":4}"},
+  {"{\"u\\u002Fv\":1,\"t\\t\":1}", "{\"u\\u002Fv\":2,\"t\\t\":2}"},
+  {"{\"a\":1}", "{\"a\":1,\"a\":2}"},
+  {"{\"a\":1,\"a\":2}", "{\"a\":1,\"a\":3}"},
+  {"{\"a\":1,\"a\":2}", "{\"a\":1}"},
+  {"{\"a\":1,\"a\":2,\"b\":1}", "{\"a\":1,\"a\":2,\"b\":2}"},
+  {"{\"a\":1,\"b\":2}", "{\"b\":2,\"a\":1}"},
+};
+
+static bool checkDiff(const char* from, const char* to) {
+  JsonValue* master = parse(from);
+  JsonValue* replica = parse(from);
+  JsonValue* src = parse(to);
+
+  JsonDiff diff;
+  jsonDiffInit(&diff, SIZE_MAX);
+  jsonDiffApply(NULL, master, src, &diff);
+  const char* sent = "nothing";
+  if(diff.changes && diff.incomplete) {
+    sent = "verbatim";
+    JsonTypeFreeImpl(replica, NULL);
+    replica = parse(to);
+  } else if(diff.changes) {
+    sent = "patch";
+    JsonValue* patch = parseJson(NULL, diff.ops, diff.len, NULL);
+    const char* err = patch ? jsonPatchApply(NULL, &replica, patch) : "unparsable";
+    if(err) printf("  patch %.*s: %s\n", (int)diff.len, diff.ops, err);
+  }
+
+  bool ok = sameText(master, src) && sameText(master, replica);
+  printf("%s %-8s %s -> %s\n", ok ? "ok  " : "FAIL", sent, from, to);
+  jsonDiffFree(&diff);
+  JsonTypeFreeImpl(master, NULL);
+  JsonTypeFreeImpl(replica, NULL);
+  JsonTypeFreeImpl(src, NULL);
+  return ok;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Rewrites `json` from the configured storage and loads it back.
+ * Returns the arena bytes the load reserved, or 0 on a mismatch.
+ */
+static size_t checkAof(const char* json, size_t len, long long chunkSize) {
+  jsonConfig.aofChunkSize = chunkSize;
+  RedisJsonValue* doc = parseDocument(NULL, json, len);
+  commands = largestCommand = 0;
+  double start = now();
+  JsonTypeAofRewriteImpl(NULL, NULL, doc);
+  double elapsed = now() - start;
+
+  JsonValue* expected = parseJson(NULL, json, len, NULL);
+  bool ok = loaded && loaded->rootJson && sameText(loaded->rootJson, expected);
+  size_t reserved = ok ? loaded->arena->reserved : 0;
+  printf(
+    "%s %-4s %9zu bytes, chunk %8lld: %6zu commands, largest %8zu,"
+    " loaded into %9zu bytes in %7.1f ms\n",
+    ok ? "ok  " : "FAIL",
+    jsonConfig.storage == STORAGE_TAPE ? "tape" : "tree",
+    len,
+    chunkSize,
+    commands,
+    largestCommand,
+    reserved,
+    elapsed * 1e3
+  );
+  if(!ok && len < 200) printf("  %s\n", json);
+  JsonTypeFreeImpl(expected, NULL);
+  docFree(doc);
+  docFree(loaded);
+  loaded = NULL;
+  return reserved;
+}
+
+static const char* aofCases[] = {
+  "{\"a\\/b\":1,\"c\":2}",
+  "{\"a\\/b\":{\"c~d\":[1,2,3],\"e/f\":{\"x\\\"y\":\"long enough string\"}},\"u\\u002Fv\":3}",
+  "{\"a\":1,\"a\":2,\"b\":[1,2,3,4]}",
+  "{\"o\":{\"k\":\"first value\",\"k\":\"second value\"},\"p\":[{\"k\":1,\"k\":2}]}",
+};
+
+/*
+ * About 40 bytes a member, so 4 MB patches carry over 100k adds each.
+ */
+#define WIDE_MEMBERS 150000
+
+static char* buildWide(size_t* len) {
+  char* json = malloc(WIDE_MEMBERS * 48 + 2);
+  char* out = json;
+  *out++ = '{';
+  for(int i = 0; i < WIDE_MEMBERS; i++) {
+    out += sprintf(out, "%s\"member%06d\":\"value %06d\"", i ? "," : "", i, i);
+  }
+  *out++ = '}';
+  *len = out - json;
+  return json;
+}
+
+int main(void) {
+  RedisModule_Alloc = benchAlloc;
+  RedisModule_Calloc = benchCalloc;
+  RedisModule_Realloc = benchRealloc;
+  RedisModule_Free = benchFree;
+  RedisModule_MallocSize = benchMallocSize;
+  RedisModule_EmitAOF = benchEmitAOF;
+
+  bool ok = true;
+  for(size_t i = 0; i < sizeof(diffCases) / sizeof(diffCases[0]); i++) {
+    ok &= checkDiff(diffCases[i][0], diffCases[i][1]);
+  }
+
+  size_t len;
+  char* wide = buildWide(&len);
+  for(int storage = STORAGE_TREE; storage <= STORAGE_TAPE; storage++) {
+    jsonConfig.storage = storage;
+    for(size_t i = 0; i < sizeof(aofCases) / sizeof(aofCases[0]); i++) {
+      ok &= checkAof(aofCases[i], strlen(aofCases[i]), 8) != 0;
+    }
+    /* The arena holds the nodes, keys and strings: a few times the text. */
+    size_t reserved = checkAof(wide, len, 4 * 1024 * 1024);
+    ok &= reserved && reserved < 8 * len;
+  }
+  free(wide);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,212 @@
+#include "config.h"
+#include <limits.h>
+
+JsonConfig jsonConfig = {
+  .parser = PARSER_STRUCTURAL,
+  .arena = 1,
+  .storage = STORAGE_TREE,
+  .objectIndexThreshold = 32,
+  .pathCacheSize = 1024,
+  .descentIndexMaxMemory = 64 * 1024 * 1024,
+  .setDiff = 1,
+  .memoryVerify = 0,
+  .aofChunkSize = 4 * 1024 * 1024
+};
+
+static const char* parserNames[] = { "structural", "legacy" };
+static const int parserValues[] = { PARSER_STRUCTURAL, PARSER_LEGACY };
+static const char* storageNames[] = { "tree", "tape" };
+static const int storageValues[] = { STORAGE_TREE, STORAGE_TAPE };
+
+static int getEnumConfig(const char* name, void* privdata) {
+  return *(int*)privdata;
+}
+
+static int getBoolConfig(const char* name, void* privdata) {
+  return *(int*)privdata;
+}
+
+static int setBoolConfig(
+  const char* name,
+  int val,
+  void* privdata,
+  RedisModuleString** err
+) {
+  *(int*)privdata = val;
+  return REDISMODULE_OK;
+}
+
+static long long getNumericConfig(const char* name, void* privdata) {
+  return *(long long*)privdata;
+}
+
+static int setNumericConfig(
+  const char* name,
+  long long val,
+  void* privdata,
+  RedisModuleString** err
+) {
+  *(long long*)privdata = val;
+  return REDISMODULE_OK;
+}
+
+static int setEnumConfig(
+  const char* name,
+  int val,
+  void* privdata,
+  RedisModuleString** err
+) {
+  *(int*)privdata = val;
+  return REDISMODULE_OK;
+}
+
+int registerJsonConfigs(RedisModuleCtx* ctx) {
+  if(RedisModule_RegisterEnumConfig(
+    ctx,
+    "parser",
+    PARSER_STRUCTURAL,
+    REDISMODULE_CONFIG_DEFAULT,
+    parserNames,
+    parserValues,
+    2,
+    getEnumConfig,
+    setEnumConfig,
+    NULL,
+    &jsonConfig.parser) == REDISMODULE_ERR) {
+    return REDISMODULE_ERR;
+  }
+
+  /* Only affects documents created after the change. */
+  if(RedisModule_RegisterBoolConfig(
+    ctx,
+    "arena",
+    1,
+    REDISMODULE_CONFIG_DEFAULT,
+    getBoolConfig,
+    setBoolConfig,
+    NULL,
+    &jsonConfig.arena) == REDISMODULE_ERR) {
+    return REDISMODULE_ERR;
+  }
+
+  /* Applies to documents created or loaded after the change. */
+  if(RedisModule_RegisterEnumConfig(
+    ctx,
+    "storage",
+    STORAGE_TREE,
+    REDISMODULE_CONFIG_DEFAULT,
+    storageNames,
+    storageValues,
+    2,
+    getEnumConfig,
+    setEnumConfig,
+    NULL,
+    &jsonConfig.storage) == REDISMODULE_ERR) {
+    return REDISMODULE_ERR;
+  }
+
+  /*
+   * Objects with at least this many members get a key index; 0 turns
+   * it off. Existing objects pick up a change when they are next
+   * loaded or modified.
+   */
+  if(RedisModule_RegisterNumericConfig(
+    ctx,
+    "object-index-threshold",
+    32,
+    REDISMODULE_CONFIG_DEFAULT,
+    0,
+    UINT32_MAX,
+    getNumericConfig,
+    setNumericConfig,
+    NULL,
+    &jsonConfig.objectIndexThreshold) == REDISMODULE_ERR) {
+    return REDISMODULE_ERR;
+  }
+
+  /* Compiled paths kept for reuse; 0 disables the cache. */
+  if(RedisModule_RegisterNumericConfig(
+    ctx,
+    "path-cache-size",
+    1024,
+    REDISMODULE_CONFIG_DEFAULT,
+    0,
+    1024 * 1024,
+    getNumericConfig,
+    setNumericConfig,
+    NULL,
+    &jsonConfig.pathCacheSize) == REDISMODULE_ERR) {
+    return REDISMODULE_ERR;
+  }
+
+  /*
+   * Largest `..key` index kept per document, in bytes; documents that
+   * would need more are walked instead. 0 disables the index.
+   */
+  if(RedisModule_RegisterNumericConfig(
+    ctx,
+    "descent-index-max-memory",
+    64 * 1024 * 1024,
+    REDISMODULE_CONFIG_MEMORY,
+    0,
+    LLONG_MAX,
+    getNumericConfig,
+    setNumericConfig,
+    NULL,
+    &jsonConfig.descentIndexMaxMemory) == REDISMODULE_ERR) {
+    return REDISMODULE_ERR;
+  }
+
+  /*
+   * Whole-document JSON.SET on an existing tree keeps the nodes that
+   * did not change and replicates the difference as JSON.PATCH.
+   */
+  if(RedisModule_RegisterBoolConfig(
+    ctx,
+    "set-diff",
+    1,
+    REDISMODULE_CONFIG_DEFAULT,
+    getBoolConfig,
+    setBoolConfig,
+    NULL,
+    &jsonConfig.setDiff) == REDISMODULE_ERR) {
+    return REDISMODULE_ERR;
+  }
+
+  /*
+   * Debugging aid: MEMORY USAGE walks heap documents and logs when the
+   * walk disagrees with the byte count kept as they change.
+   */
+  if(RedisModule_RegisterBoolConfig(
+    ctx,
+    "memory-verify",
+    0,
+    REDISMODULE_CONFIG_DEFAULT,
+    getBoolConfig,
+    setBoolConfig,
+    NULL,
+    &jsonConfig.memoryVerify) == REDISMODULE_ERR) {
+    return REDISMODULE_ERR;
+  }
+
+  /*
+   * Largest command an AOF rewrite emits for one document, give or
+   * take a member; bigger documents are split. 0 writes every
+   * document as a single JSON.SET.
+   */
+  if(RedisModule_RegisterNumericConfig(
+    ctx,
+    "aof-chunk-size",
+    4 * 1024 * 1024,
+    REDISMODULE_CONFIG_MEMORY,
+    0,
+    LLONG_MAX,
+    getNumericConfig,
+    setNumericConfig,
+    NULL,
+    &jsonConfig.aofChunkSize) == REDISMODULE_ERR) {
+    return REDISMODULE_ERR;
+  }
+
+  return RedisModule_LoadConfigs(ctx);
+}
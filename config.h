@@ -0,0 +1,29 @@
+#pragma once
+
+#include "redismodule.h"
+
+typedef enum {
+  PARSER_STRUCTURAL = 0,
+  PARSER_LEGACY = 1
+} JsonParserEngine;
+
+typedef enum {
+  STORAGE_TREE = 0,
+  STORAGE_TAPE = 1
+} JsonStorageMode;
+
+typedef struct {
+  int parser;
+  int arena;
+  int storage;
+  long long objectIndexThreshold;
+  long long pathCacheSize;
+  long long descentIndexMaxMemory;
+  int setDiff;
+  int memoryVerify;
+  long long aofChunkSize;
+} JsonConfig;
+
+extern JsonConfig jsonConfig;
+
+int registerJsonConfigs(RedisModuleCtx* ctx);
@@ -0,0 +1,293 @@
+#include "defrag.h"
+#include "tape.h"
+#include "descentIndex.h"
+
+/*
+ * How many nodes are moved between two DefragShouldStop checks.
+ */
+#define DEFRAG_CHECK_INTERVAL 64
+
+typedef struct {
+  JsonValue* value;
+  JsonValue* copy;
+  size_t next;
+} DefragFrame;
+
+/*
+ * Where an interrupted walk resumes. Redis finishes one deferred key
+ * before it starts the next, so a single saved walk is enough;
+ * `cursor` is what was handed to Redis and tells a resumed call from
+ * a fresh one. Only the child positions are trusted on resume: the
+ * document may have been written to in between, so the nodes on the
+ * way down are looked up again from the root. An arena document is
+ * rebuilt into `arena` instead, and a write to it drops the rebuild
+ * (see docDefragCancel), so its frames stay valid as they are.
+ */
+static struct {
+  RedisJsonValue* doc;
+  JsonArena* arena;
+  JsonValue* root;
+  unsigned long cursor;
+  unsigned long lastCursor;
+  DefragFrame* frames;
+  size_t depth;
+  size_t cap;
+} walk;
+
+static void* move(RedisModuleDefragCtx* ctx, void* ptr) {
+  void* moved = RedisModule_DefragAlloc(ctx, ptr);
+  return moved ? moved : ptr;
+}
+
+static void push(JsonValue* value) {
+  if(walk.depth == walk.cap) {
+    walk.cap = walk.cap ? walk.cap * 2 : 64;
+    walk.frames = RedisModule_Realloc(walk.frames, walk.cap * sizeof(DefragFrame));
+  }
+  walk.frames[walk.depth].value = value;
+  walk.frames[walk.depth].copy = NULL;
+  walk.frames[walk.depth].next = 0;
+  ++walk.depth;
+}
+
+static size_t childCount(const JsonValue* value) {
+  if(value->type == OBJECT) return value->value.object.size;
+  if(value->type == ARRAY) return value->value.array.size;
+  return 0;
+}
+
+static JsonValue* child(JsonValue* value, size_t i) {
+  if(value->type == ARRAY) return value->value.array.array[i];
+  return value->value.object.elements[i]->value;
+}
+
+/*
+ * Moves a node and the buffers it owns, but not its children.
+ */
+static JsonValue* defragNode(RedisModuleDefragCtx* ctx, JsonValue* value) {
+  value = move(ctx, value);
+  switch(value->type) {
+    case OBJECT: {
+      struct JsonObject* object = &value->value.object;
+      if(object->elements) object->elements = move(ctx, object->elements);
+      if(object->index) object->index = move(ctx, object->index);
+      break;
+    }
+    case ARRAY:
+      if(value->value.array.array) {
+        value->value.array.array = move(ctx, value->value.array.array);
+      }
+      break;
+    case STRING:
+      value->value.string.data = move(ctx, (void*)value->value.string.data);
+      break;
+    default:
+      break;
+  }
+  return value;
+}
+
+/*
+ * The slot that holds child `i`. An object member and its key are
+ * moved on the way, right before the value they hold.
+ */
+static JsonValue** childSlot(RedisModuleDefragCtx* ctx, JsonValue* value, size_t i) {
+  if(value->type == ARRAY) return &value->value.array.array[i];
+  JsonKeyVal* member = move(ctx, value->value.object.elements[i]);
+  value->value.object.elements[i] = member;
+  if(member->keyLen > KEY_INLINE_SIZE) member->key.ptr = move(ctx, member->key.ptr);
+  return &member->value;
+}
+
+/*
+ * Rebuilds the saved walk on the current document: every frame but
+ * the top one was entered through child `next - 1` of the one above
+ * it, and the walk is cut short where that child no longer exists.
+ */
+static void resumeWalk(RedisJsonValue* doc) {
+  walk.frames[0].value = doc->rootJson;
+  for(size_t i = 1; i < walk.depth; i++) {
+    DefragFrame* parent = &walk.frames[i - 1];
+    if(!parent->next || parent->next > childCount(parent->value)) {
+      walk.depth = i;
+      break;
+    }
+    walk.frames[i].value = child(parent->value, parent->next - 1);
+  }
+}
+
+static int defragTree(RedisModuleDefragCtx* ctx, RedisJsonValue* doc, bool resume) {
+  /* The descent index points at nodes that are about to move. */
+  descentIndexInvalidate(doc);
+  if(resume) {
+    resumeWalk(doc);
+  } else {
+    walk.depth = 0;
+    doc->rootJson = defragNode(ctx, doc->rootJson);
+    push(doc->rootJson);
+  }
+
+  size_t steps = 0;
+  while(walk.depth) {
+    DefragFrame* top = &walk.frames[walk.depth - 1];
+    if(top->next >= childCount(top->value)) {
+      --walk.depth;
+      continue;
+    }
+    if(++steps % DEFRAG_CHECK_INTERVAL == 0 && RedisModule_DefragShouldStop(ctx)) {
+      return 1;
+    }
+    JsonValue** slot = childSlot(ctx, top->value, top->next++);
+    *slot = defragNode(ctx, *slot);
+    if(childCount(*slot)) push(*slot);
+  }
+  return 0;
+}
+
+/*
+ * A copy of `value` without its children: containers get room for
+ * them and are filled in by copyChild, anything else is copied whole.
+ */
+static JsonValue* copyShell(JsonArena* arena, const JsonValue* value) {
+  size_t count = childCount(value);
+  if(value->type == OBJECT) return allocObject(arena, count);
+  if(value->type != ARRAY) return valueCopy(arena, value);
+  JsonValue* copy = jsonAlloc(arena, sizeof(JsonValue));
+  copy->type = ARRAY;
+  copy->value.array.size = count;
+  copy->value.array.cap = count;
+  if(count) copy->value.array.array = jsonAlloc(arena, count * sizeof(JsonValue*));
+  return copy;
+}
+
+static JsonValue* copyChild(JsonArena* arena, DefragFrame* frame, size_t i) {
+  JsonValue* copy = copyShell(arena, child(frame->value, i));
+  if(frame->value->type == ARRAY) {
+    frame->copy->value.array.array[i] = copy;
+    return copy;
+  }
+  const JsonKeyVal* member = frame->value->value.object.elements[i];
+  JsonKeyVal* keyVal = jsonAlloc(arena, sizeof(JsonKeyVal));
+  keySet(arena, keyVal, keyData(member), member->keyLen);
+  keyVal->value = copy;
+  frame->copy->value.object.elements[i] = keyVal;
+  return copy;
+}
+
+/*
+ * The nodes inside a chunk are pointed into and cannot be moved one
+ * by one, so the document is copied into a fresh arena sized to what
+ * it still uses, the same copy docCopy makes, and the old one freed.
+ * That also gives back what writes left wasted.
+ */
+static int defragArena(RedisModuleDefragCtx* ctx, RedisJsonValue* doc, bool resume) {
+  if(!resume) {
+    walk.arena = arenaNew(arenaLive(doc->arena));
+    walk.root = copyShell(walk.arena, doc->rootJson);
+    walk.depth = 0;
+    if(childCount(doc->rootJson)) {
+      push(doc->rootJson);
+      walk.frames[0].copy = walk.root;
+    }
+  }
+
+  size_t steps = 0;
+  while(walk.depth) {
+    DefragFrame* top = &walk.frames[walk.depth - 1];
+    if(top->next >= childCount(top->value)) {
+      if(top->value->type == OBJECT) objectReindex(walk.arena, &top->copy->value.object);
+      --walk.depth;
+      continue;
+    }
+    if(++steps % DEFRAG_CHECK_INTERVAL == 0 && RedisModule_DefragShouldStop(ctx)) {
+      return 1;
+    }
+    JsonValue* value = child(top->value, top->next);
+    JsonValue* copy = copyChild(walk.arena, top, top->next++);
+    if(childCount(copy)) {
+      push(value);
+      walk.frames[walk.depth - 1].copy = copy;
+    }
+  }
+
+  descentIndexInvalidate(doc);
+  arenaFree(doc->arena);
+  doc->arena = walk.arena;
+  doc->rootJson = walk.root;
+  walk.arena = NULL;
+  return 0;
+}
+
+void docDefragCancel(RedisJsonValue* doc) {
+  if(!walk.arena || walk.doc != doc) return;
+  arenaFree(walk.arena);
+  walk.arena = NULL;
+  walk.doc = NULL;
+  walk.cursor = 0;
+}
+
+/*
+ * The strings live in the same allocation as the words, so `strings`
+ * is pointed at the new copy, and the descent index, whose keys point
+ * into them, is dropped. A resumed call carries on with the object
+ * index it stopped at. A tape shared with a copy stays where it is,
+ * since the other document points at it too.
+ */
+static int defragTape(RedisModuleDefragCtx* ctx, RedisJsonValue* doc, bool resume) {
+  if(__atomic_load_n(&doc->tape->refs, __ATOMIC_ACQUIRE) > 1) return 0;
+  JsonTape* tape = RedisModule_DefragAlloc(ctx, doc->tape);
+  if(tape) {
+    descentIndexInvalidate(doc);
+    tape->strings = (char*)(tape->words + tape->len);
+    doc->tape = tape;
+  }
+  tape = doc->tape;
+  if(!tape->objectIndexes) return 0;
+  tape->objectIndexes = move(ctx, tape->objectIndexes);
+
+  if(!resume) {
+    walk.depth = 0;
+    push(NULL);
+  }
+  DefragFrame* frame = &walk.frames[0];
+  size_t steps = 0;
+  while(frame->next < tape->objectIndexCount) {
+    if(++steps % DEFRAG_CHECK_INTERVAL == 0 && RedisModule_DefragShouldStop(ctx)) {
+      return 1;
+    }
+    TapeObjectIndex* entry = &tape->objectIndexes[frame->next++];
+    entry->index = move(ctx, entry->index);
+  }
+  return 0;
+}
+
+int docDefrag(RedisModuleDefragCtx* ctx, RedisJsonValue** value) {
+  unsigned long cursor = 0;
+  RedisModule_DefragCursorGet(ctx, &cursor);
+  bool resume = cursor && cursor == walk.cursor && *value == walk.doc;
+  if(!resume && walk.arena) {
+    /* A rebuild Redis gave up on. */
+    arenaFree(walk.arena);
+    walk.arena = NULL;
+  }
+
+  RedisJsonValue* doc = *value = move(ctx, *value);
+  int more = 0;
+  if(doc->tape) {
+    more = defragTape(ctx, doc, resume);
+  } else if(doc->arena && doc->rootJson) {
+    more = defragArena(ctx, doc, resume);
+  } else if(doc->rootJson) {
+    more = defragTree(ctx, doc, resume);
+  }
+
+  if(!more) {
+    walk.doc = NULL;
+    walk.cursor = 0;
+    return 0;
+  }
+  walk.doc = doc;
+  walk.cursor = ++walk.lastCursor;
+  RedisModule_DefragCursorSet(ctx, walk.cursor);
+  return 1;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "value.h"
+
+/*
+ * Active defrag for one document. Heap trees are walked depth first
+ * and every node, member, key, string and element array is handed to
+ * RedisModule_DefragAlloc in turn. When Redis asks the walk to stop,
+ * its position is kept and the cursor set, so the next call picks up
+ * where the last one left off. Tapes move their buffer and object
+ * indexes the same way. Arena documents are copied into a new arena,
+ * a few nodes per call, and swapped in once the copy is complete.
+ * Returns 1 while there is more to do and 0 once the document is
+ * done.
+ */
+int docDefrag(RedisModuleDefragCtx* ctx, RedisJsonValue** doc);
+
+/*
+ * Drops the copy of `doc` that an unfinished arena defrag is building.
+ * Every write to an arena tree calls it, since the copy would miss the
+ * write, and so does unlinking the document.
+ */
+void docDefragCancel(RedisJsonValue* doc);
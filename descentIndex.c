@@ -0,0 +1,220 @@
+#include "descentIndex.h"
+#include "config.h"
+#include "objectIndex.h"
+#include "path.h"
+#include "tape.h"
+#include <string.h>
+
+DescentIndexStats descentIndexStats;
+
+typedef void (*MemberVisitor)(
+  DescentIndex* index,
+  uintptr_t parent,
+  const char* key,
+  size_t keyLen,
+  uintptr_t value
+);
+
+static Vector scratchStack;
+
+/*
+ * Calls `visit` for every member, objects in document order and
+ * members in the order of their object.
+ */
+static void forEachMember(
+  RedisJsonValue* doc,
+  DescentIndex* index,
+  MemberVisitor visit
+) {
+  if(doc->tape) {
+    const JsonTape* tape = doc->tape;
+    for(size_t i = 0; i < tape->len && !index->overflow;) {
+      char tag = tapeTag(tape, i);
+      if(tag == '{') {
+        size_t end = tapeNext(tape, i);
+        for(size_t k = i + 1; k < end; k = tapeNext(tape, k + 1)) {
+          size_t len;
+          const char* key = tapeString(tape, k, &len);
+          visit(index, i, key, len, k + 1);
+        }
+      }
+      i = tag == '{' || tag == '[' || tag == 'k' ? i + 1 : tapeNext(tape, i);
+    }
+    return;
+  }
+
+  if(!scratchStack.data) vecNew(&scratchStack, 64, sizeof(JsonValue*));
+  scratchStack.len = 0;
+  vecPush(&scratchStack, &doc->rootJson);
+  while(scratchStack.len && !index->overflow) {
+    JsonValue* value = ((JsonValue**)scratchStack.data)[--scratchStack.len];
+    if(value->type == OBJECT) {
+      struct JsonObject* object = &value->value.object;
+      for(size_t i = 0; i < object->size; i++) {
+        JsonKeyVal* member = object->elements[i];
+        visit(
+          index,
+          (uintptr_t)value,
+          keyData(member),
+          member->keyLen,
+          (uintptr_t)member->value
+        );
+      }
+      for(size_t i = object->size; i > 0; i--) {
+        vecPush(&scratchStack, &object->elements[i - 1]->value);
+      }
+    } else if(value->type == ARRAY) {
+      JsonArray* array = &value->value.array;
+      for(size_t i = array->size; i > 0; i--) {
+        vecPush(&scratchStack, &array->array[i - 1]);
+      }
+    }
+  }
+  if(scratchStack.cap > 4096) vecDel(&scratchStack);
+}
+
+static DescentSlot* findSlot(
+  const DescentIndex* index,
+  const char* key,
+  size_t keyLen,
+  uint32_t hash
+) {
+  size_t slot = hash & index->mask;
+  while(index->slots[slot].key) {
+    DescentSlot* s = &index->slots[slot];
+    if(s->hash == hash && s->keyLen == keyLen && !memcmp(s->key, key, keyLen)) {
+      return s;
+    }
+    slot = (slot + 1) & index->mask;
+  }
+  return &index->slots[slot];
+}
+
+static size_t indexBytes(size_t slots, size_t entries) {
+  return sizeof(DescentIndex) + slots * sizeof(DescentSlot) +
+    entries * sizeof(DescentEntry);
+}
+
+static void grow(DescentIndex* index) {
+  size_t count = (index->mask + 1) * 2;
+  DescentSlot* old = index->slots;
+  size_t oldCount = index->mask + 1;
+  index->slots = RedisModule_Calloc(count, sizeof(DescentSlot));
+  index->mask = count - 1;
+  for(size_t i = 0; i < oldCount; i++) {
+    if(old[i].key) *findSlot(index, old[i].key, old[i].keyLen, old[i].hash) = old[i];
+  }
+  RedisModule_Free(old);
+}
+
+/*
+ * First pass: the distinct keys and how many members each has, which
+ * is enough to size the entries and give up early when they would
+ * not fit.
+ */
+static size_t distinctKeys;
+static size_t totalMembers;
+
+static void countMember(
+  DescentIndex* index,
+  uintptr_t parent,
+  const char* key,
+  size_t keyLen,
+  uintptr_t value
+) {
+  uint32_t hash = hashKey(key, keyLen);
+  DescentSlot* slot = findSlot(index, key, keyLen, hash);
+  if(!slot->key) {
+    if((distinctKeys + 1) * 4 > (index->mask + 1) * 3) {
+      grow(index);
+      slot = findSlot(index, key, keyLen, hash);
+    }
+    slot->key = key;
+    slot->keyLen = (uint32_t)keyLen;
+    slot->hash = hash;
+    ++distinctKeys;
+  }
+  /* A repeated key in the same object is shadowed by the first. */
+  if(slot->count && slot->lastParent == parent) return;
+  slot->lastParent = parent;
+  ++slot->count;
+  ++totalMembers;
+  if(indexBytes(index->mask + 1, totalMembers) > (size_t)jsonConfig.descentIndexMaxMemory) {
+    index->overflow = true;
+  }
+}
+
+static void addMember(
+  DescentIndex* index,
+  uintptr_t parent,
+  const char* key,
+  size_t keyLen,
+  uintptr_t value
+) {
+  DescentSlot* slot = findSlot(index, key, keyLen, hashKey(key, keyLen));
+  if(slot->count && index->entries[slot->first + slot->count - 1].parent == parent) {
+    return;
+  }
+  DescentEntry* entry = &index->entries[slot->first + slot->count++];
+  entry->parent = parent;
+  entry->value = value;
+}
+
+static DescentIndex* build(RedisJsonValue* doc) {
+  DescentIndex* index = RedisModule_Calloc(1, sizeof(DescentIndex));
+  index->slots = RedisModule_Calloc(64, sizeof(DescentSlot));
+  index->mask = 63;
+  distinctKeys = totalMembers = 0;
+  forEachMember(doc, index, countMember);
+  if(index->overflow) {
+    RedisModule_Free(index->slots);
+    index->slots = NULL;
+    index->mask = 0;
+    index->bytes = sizeof(DescentIndex);
+    ++descentIndexStats.overflows;
+    return index;
+  }
+
+  size_t next = 0;
+  for(size_t i = 0; i <= index->mask; i++) {
+    index->slots[i].first = next;
+    next += index->slots[i].count;
+    index->slots[i].count = 0;
+  }
+  index->entries = RedisModule_Alloc(totalMembers * sizeof(DescentEntry));
+  forEachMember(doc, index, addMember);
+  index->bytes = indexBytes(index->mask + 1, totalMembers);
+  ++descentIndexStats.builds;
+  return index;
+}
+
+const DescentIndex* descentIndexGet(RedisJsonValue* doc) {
+  if(jsonConfig.descentIndexMaxMemory <= 0) return NULL;
+  if(!doc->descentIndex) {
+    doc->descentIndex = build(doc);
+    descentIndexStats.bytes += doc->descentIndex->bytes;
+  }
+  return doc->descentIndex->overflow ? NULL : doc->descentIndex;
+}
+
+void descentIndexInvalidate(RedisJsonValue* doc) {
+  DescentIndex* index = doc->descentIndex;
+  if(!index) return;
+  descentIndexStats.bytes -= index->bytes;
+  if(index->slots) RedisModule_Free(index->slots);
+  if(index->entries) RedisModule_Free(index->entries);
+  RedisModule_Free(index);
+  doc->descentIndex = NULL;
+}
+
+const DescentEntry* descentIndexFind(
+  const DescentIndex* index,
+  const char* key,
+  size_t keyLen,
+  uint32_t hash,
+  size_t* count
+) {
+  DescentSlot* slot = findSlot(index, key, keyLen, hash);
+  *count = slot->count;
+  return slot->key ? index->entries + slot->first : NULL;
+}
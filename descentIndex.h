@@ -0,0 +1,69 @@
+#pragma once
+
+#include "value.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Every member of a document grouped by key name, so `$..key` reads
+ * one list instead of walking the whole document. Within a key the
+ * members are ordered by their object in document order, which is
+ * the order a walk would find them in. `parent` and `value` are
+ * JsonValue pointers for a tree and word indexes for a tape.
+ */
+typedef struct {
+  uintptr_t parent;
+  uintptr_t value;
+} DescentEntry;
+
+typedef struct {
+  const char* key;
+  uint32_t keyLen;
+  uint32_t hash;
+  size_t first;
+  size_t count;
+  uintptr_t lastParent;
+} DescentSlot;
+
+/*
+ * `overflow` is set, and nothing else, when the index would have
+ * needed more than redisjson.descent-index-max-memory; the document
+ * is then walked as before until it is written to.
+ */
+typedef struct DescentIndex {
+  bool overflow;
+  size_t mask;
+  size_t bytes;
+  DescentSlot* slots;
+  DescentEntry* entries;
+} DescentIndex;
+
+typedef struct {
+  unsigned long long builds;
+  unsigned long long overflows;
+  size_t bytes;
+} DescentIndexStats;
+
+extern DescentIndexStats descentIndexStats;
+
+/*
+ * The index of `doc`, built on first use. NULL when the index is
+ * disabled or the document is too large for it.
+ */
+const DescentIndex* descentIndexGet(RedisJsonValue* doc);
+
+/*
+ * Drops the index; every write to a document has to call it.
+ */
+void descentIndexInvalidate(RedisJsonValue* doc);
+
+/*
+ * Members named `key`, or NULL with `*count` 0.
+ */
+const DescentEntry* descentIndexFind(
+  const DescentIndex* index,
+  const char* key,
+  size_t keyLen,
+  uint32_t hash,
+  size_t* count
+);
@@ -0,0 +1,335 @@
+#include "jsonDiff.h"
+#include "jsonToValue.h"
+#include "number.h"
+#include <string.h>
+
+static void reserve(char** buf, size_t* cap, size_t len, size_t extra) {
+  if(len + extra <= *cap) return;
+  size_t newCap = *cap ? *cap : 256;
+  while(newCap < len + extra) newCap *= 2;
+  *buf = RedisModule_Realloc(*buf, newCap);
+  *cap = newCap;
+}
+
+void jsonDiffInit(JsonDiff* diff, size_t budget) {
+  memset(diff, 0, sizeof(JsonDiff));
+  diff->budget = budget;
+}
+
+void jsonDiffFree(JsonDiff* diff) {
+  if(diff->ops) RedisModule_Free(diff->ops);
+  if(diff->path) RedisModule_Free(diff->path);
+  memset(diff, 0, sizeof(JsonDiff));
+}
+
+/*
+ * The current path is kept as a stack of steps and only spelled out
+ * as a pointer when an operation is written, so walking unchanged
+ * subtrees costs nothing per key. An index step has a NULL key and
+ * the index in `len`.
+ */
+static void push(JsonDiff* diff, const char* key, size_t len) {
+  if(diff->depth == diff->pathCap) {
+    diff->pathCap = diff->pathCap ? diff->pathCap * 2 : 16;
+    diff->path = RedisModule_Realloc(
+      diff->path,
+      diff->pathCap * sizeof(JsonDiffStep)
+    );
+  }
+  diff->path[diff->depth].key = key;
+  diff->path[diff->depth].len = len;
+  ++diff->depth;
+}
+
+size_t jsonPointerSize(const JsonDiffStep* path, size_t depth) {
+  size_t size = 0;
+  for(size_t i = 0; i < depth; i++) {
+    const JsonDiffStep* step = &path[i];
+    if(step->key) {
+      size += 1;
+      for(size_t j = 0; j < step->len; j++) {
+        if(step->key[j] == '\\') {
+          ++j;
+          size += 2;
+        } else {
+          size += step->key[j] == '~' || step->key[j] == '/' ? 2 : 1;
+        }
+      }
+    } else {
+      size += 2;
+      for(size_t index = step->len; index >= 10; index /= 10) ++size;
+    }
+  }
+  return size;
+}
+
+/*
+ * Keys go into the pointer in their stored form, which is how
+ * JSON.PATCH reads them back: escapes are copied as they are, so the
+ * path stays a valid JSON string, and a bare `~` or `/` is encoded.
+ * An escaped `\/` is a slash all the same and also becomes `~1`,
+ * since JSON.PATCH splits on it.
+ */
+char* jsonPointerWrite(const JsonDiffStep* path, size_t depth, char* out) {
+  for(size_t i = 0; i < depth; i++) {
+    const JsonDiffStep* step = &path[i];
+    *out++ = '/';
+    if(!step->key) {
+      out += formatInteger((int64_t)step->len, out);
+      continue;
+    }
+    for(size_t j = 0; j < step->len; j++) {
+      char ch = step->key[j];
+      if(ch == '\\' && step->key[j + 1] != '/') {
+        *out++ = ch;
+        *out++ = step->key[++j];
+        continue;
+      }
+      if(ch == '\\') ch = step->key[++j];
+      if(ch == '~' || ch == '/') {
+        *out++ = '~';
+        *out++ = ch == '~' ? '0' : '1';
+      } else {
+        *out++ = ch;
+      }
+    }
+  }
+  return out;
+}
+
+static void append(JsonDiff* diff, const char* str, size_t len) {
+  memcpy(diff->ops + diff->len, str, len);
+  diff->len += len;
+}
+
+/*
+ * Writes one operation on the current path, `value` being written
+ * for add and replace.
+ */
+static void emit(JsonDiff* diff, const char* op, JsonValue* value) {
+  ++diff->changes;
+  if(diff->incomplete) return;
+  size_t size = 32 + strlen(op) + jsonPointerSize(diff->path, diff->depth);
+  if(value) size += 10 + jsonSerializedSize(value);
+  if(diff->len + size > diff->budget) {
+    diff->incomplete = true;
+    return;
+  }
+  reserve(&diff->ops, &diff->cap, diff->len, size);
+  append(diff, diff->len ? ",{\"op\":\"" : "[{\"op\":\"", 8);
+  append(diff, op, strlen(op));
+  append(diff, "\",\"path\":\"", 10);
+  diff->len = jsonPointerWrite(diff->path, diff->depth, diff->ops + diff->len) -
+    diff->ops;
+  append(diff, "\"", 1);
+  if(value) {
+    append(diff, ",\"value\":", 9);
+    diff->len = jsonWrite(value, diff->ops + diff->len) - diff->ops;
+  }
+  append(diff, "}", 1);
+}
+
+static bool scalarEquals(const JsonValue* a, const JsonValue* b) {
+  if(a->type != b->type) return false;
+  switch(a->type) {
+    case INTEGER:
+      return a->value.integer == b->value.integer;
+    case DOUBLE:
+      return !memcmp(&a->value.number, &b->value.number, sizeof(double));
+    case STRING:
+      return a->value.string.size == b->value.string.size &&
+        !memcmp(a->value.string.data, b->value.string.data, a->value.string.size);
+    case BOOLEAN:
+      return a->value.boolean == b->value.boolean;
+    default:
+      return true;
+  }
+}
+
+static void diffValue(
+  JsonArena* arena,
+  JsonValue* target,
+  JsonValue* src,
+  JsonDiff* diff
+);
+
+static void freeMember(JsonArena* arena, JsonKeyVal* keyVal) {
+  JsonTypeFreeImpl(keyVal->value, arena);
+  keyFree(arena, keyVal);
+  jsonFree(arena, keyVal, sizeof(JsonKeyVal));
+}
+
+/*
+ * A pointer names the first member with its key, so an operation on
+ * any later one with the same key would land on the wrong member.
+ */
+static void checkRepeated(struct JsonObject* object, size_t i, JsonDiff* diff) {
+  if(diff->incomplete) return;
+  JsonKeyVal* member = object->elements[i];
+  if(objectFindHashed(object, keyData(member), member->keyLen, member->hash) != i) {
+    diff->incomplete = true;
+  }
+}
+
+/*
+ * Members in the same order are the common case and are walked in
+ * step. Otherwise each new member is looked up by key, and the
+ * elements array is rewritten in the new order once at the end.
+ * Repeated keys, which the parser accepts, make the diff incomplete
+ * wherever it touches them.
+ */
+static void diffObject(
+  JsonArena* arena,
+  struct JsonObject* object,
+  struct JsonObject* src,
+  JsonDiff* diff
+) {
+  bool inStep = object->size == src->size;
+  size_t same = 0;
+  if(inStep) {
+    while(
+      same < src->size &&
+      object->elements[same]->hash == src->elements[same]->hash &&
+      object->elements[same]->keyLen == src->elements[same]->keyLen &&
+      !memcmp(
+        keyData(object->elements[same]),
+        keyData(src->elements[same]),
+        src->elements[same]->keyLen
+      )
+    ) {
+      ++same;
+    }
+  }
+  if(inStep && same == src->size) {
+    for(size_t i = 0; i < src->size; i++) {
+      JsonKeyVal* member = src->elements[i];
+      push(diff, keyData(member), member->keyLen);
+      size_t changes = diff->changes;
+      diffValue(arena, object->elements[i]->value, member->value, diff);
+      if(diff->changes != changes) checkRepeated(object, i, diff);
+      --diff->depth;
+    }
+    return;
+  }
+
+  JsonKeyVal** elements = RedisModule_Alloc(src->size * sizeof(JsonKeyVal*));
+  bool* used = RedisModule_Calloc(object->size + 1, sizeof(bool));
+  size_t last = 0;
+  bool added = false;
+  for(size_t i = 0; i < src->size; i++) {
+    JsonKeyVal* member = src->elements[i];
+    push(diff, keyData(member), member->keyLen);
+    size_t pos = objectFindHashed(
+      object,
+      keyData(member),
+      member->keyLen,
+      member->hash
+    );
+    /* A key seen before in `src` is added again. */
+    if(pos != OBJECT_NONE && used[pos]) diff->incomplete = true;
+    if(pos != OBJECT_NONE && !used[pos]) {
+      if(added || pos < last) {
+        /* A reorder has no operation but still has to reach replicas. */
+        ++diff->changes;
+        diff->incomplete = true;
+      }
+      used[pos] = true;
+      last = pos;
+      elements[i] = object->elements[pos];
+      diffValue(arena, elements[i]->value, member->value, diff);
+    } else {
+      elements[i] = jsonAlloc(arena, sizeof(JsonKeyVal));
+      keySet(arena, elements[i], keyData(member), member->keyLen);
+      elements[i]->value = valueCopy(arena, member->value);
+      added = true;
+      emit(diff, "add", member->value);
+    }
+    --diff->depth;
+  }
+  for(size_t i = 0; i < object->size; i++) {
+    if(!used[i]) checkRepeated(object, i, diff);
+  }
+  for(size_t i = 0; i < object->size; i++) {
+    if(used[i]) continue;
+    JsonKeyVal* removed = object->elements[i];
+    push(diff, keyData(removed), removed->keyLen);
+    emit(diff, "remove", NULL);
+    --diff->depth;
+    freeMember(arena, removed);
+  }
+
+  if(src->size > object->cap) {
+    object->elements = jsonRealloc(
+      arena,
+      object->elements,
+      object->cap * sizeof(JsonKeyVal*),
+      src->size * sizeof(JsonKeyVal*)
+    );
+    object->cap = src->size;
+  }
+  memcpy(object->elements, elements, src->size * sizeof(JsonKeyVal*));
+  object->size = src->size;
+  objectReindex(arena, object);
+  RedisModule_Free(elements);
+  RedisModule_Free(used);
+}
+
+/*
+ * Elements are matched by position: the common prefix is recursed
+ * into, then the tail is appended or cut off.
+ */
+static void diffArray(
+  JsonArena* arena,
+  JsonArray* array,
+  JsonArray* src,
+  JsonDiff* diff
+) {
+  size_t common = array->size < src->size ? array->size : src->size;
+  for(size_t i = 0; i < common; i++) {
+    push(diff, NULL, i);
+    diffValue(arena, array->array[i], src->array[i], diff);
+    --diff->depth;
+  }
+  for(size_t i = common; i < src->size; i++) {
+    JsonValue* copy = valueCopy(arena, src->array[i]);
+    arrayInsert(arena, array, array->size, &copy, 1);
+    push(diff, "-", 1);
+    emit(diff, "add", src->array[i]);
+    --diff->depth;
+  }
+  for(size_t i = array->size; i-- > src->size;) {
+    push(diff, NULL, i);
+    emit(diff, "remove", NULL);
+    --diff->depth;
+  }
+  if(array->size > src->size) arrayTrim(arena, array, 0, src->size);
+}
+
+static void diffValue(
+  JsonArena* arena,
+  JsonValue* target,
+  JsonValue* src,
+  JsonDiff* diff
+) {
+  if(target->type == OBJECT && src->type == OBJECT) {
+    diffObject(arena, &target->value.object, &src->value.object, diff);
+  } else if(target->type == ARRAY && src->type == ARRAY) {
+    diffArray(arena, &target->value.array, &src->value.array, diff);
+  } else if(!scalarEquals(target, src)) {
+    valueReplace(arena, target, valueCopy(arena, src));
+    emit(diff, "replace", src);
+  }
+}
+
+void jsonDiffApply(
+  JsonArena* arena,
+  JsonValue* target,
+  JsonValue* src,
+  JsonDiff* diff
+) {
+  diffValue(arena, target, src, diff);
+  if(diff->len) {
+    reserve(&diff->ops, &diff->cap, diff->len, 1);
+    append(diff, "]", 1);
+  }
+}
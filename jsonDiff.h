@@ -0,0 +1,51 @@
+#pragma once
+
+#include "value.h"
+
+/*
+ * What an overwrite changed, as the text of an RFC 6902 patch that
+ * JSON.PATCH applies. `incomplete` is set when the patch would not
+ * reproduce the result: members came in a different order, or the
+ * text grew past `budget` bytes and was abandoned. `changes` counts
+ * the operations, and members that moved count too, so it is zero
+ * only when the target was left as it was.
+ */
+typedef struct {
+  const char* key;
+  size_t len;
+} JsonDiffStep;
+
+typedef struct {
+  char* ops;
+  size_t len;
+  size_t cap;
+  size_t budget;
+  size_t changes;
+  bool incomplete;
+  JsonDiffStep* path;
+  size_t depth;
+  size_t pathCap;
+} JsonDiff;
+
+void jsonDiffInit(JsonDiff* diff, size_t budget);
+void jsonDiffFree(JsonDiff* diff);
+
+/*
+ * Turns the tree `target`, allocated from `arena`, into a copy of
+ * `src`: nodes that are equal stay as they are, members and elements
+ * are matched up and recursed into, and only the subtrees that differ
+ * are copied over. `src` is left untouched.
+ */
+void jsonDiffApply(
+  JsonArena* arena,
+  JsonValue* target,
+  JsonValue* src,
+  JsonDiff* diff
+);
+
+/*
+ * Spells out a path as an RFC 6901 pointer; jsonPointerSize is its
+ * exact length. An index step has a NULL key and the index in `len`.
+ */
+size_t jsonPointerSize(const JsonDiffStep* path, size_t depth);
+char* jsonPointerWrite(const JsonDiffStep* path, size_t depth, char* out);
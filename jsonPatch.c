@@ -0,0 +1,577 @@
+#include "jsonPatch.h"
+#include "jsonToValue.h"
+#include "path.h"
+#include <string.h>
+
+/*
+ * Every change is journaled so that a failing operation can undo the
+ * ones before it; values that leave the document are only freed once
+ * the whole patch has applied.
+ *
+ *   UNDO_SET     the slot held `value` before
+ *   UNDO_INSERT  a member or element was inserted at the slot
+ *   UNDO_REMOVE  `keyVal` or `value` was removed from the slot
+ *
+ * A move removes a node and inserts the very same node elsewhere;
+ * both entries are marked `moved` so that neither frees it.
+ */
+typedef enum {
+  UNDO_SET,
+  UNDO_INSERT,
+  UNDO_REMOVE
+} UndoKind;
+
+/*
+ * A member or element by position, or the root when `container` is
+ * NULL. Undo runs in reverse, so positions are always those of the
+ * tree right after the change.
+ */
+typedef struct {
+  JsonValue* container;
+  size_t pos;
+} Slot;
+
+typedef struct {
+  UndoKind kind;
+  bool moved;
+  Slot slot;
+  JsonKeyVal* keyVal;
+  JsonValue* value;
+} PatchUndo;
+
+/*
+ * Consecutive operations on members of the same object or array
+ * resolve its pointer once: the last parent found is kept until a
+ * change above or beside it may have moved it.
+ */
+typedef struct {
+  JsonArena* arena;
+  JsonValue** root;
+  Vector undo;
+  char* segment;
+  size_t segmentCap;
+  const char* parentPath;
+  size_t parentLen;
+  JsonValue* parent;
+} Patch;
+
+static const char* ERR_INVALID = "ERR invalid patch";
+static const char* ERR_NOT_FOUND = "ERR patch path not found";
+
+static JsonValue** slotRef(Patch* p, const Slot* slot) {
+  if(!slot->container) return p->root;
+  if(slot->container->type == OBJECT) {
+    return &slot->container->value.object.elements[slot->pos]->value;
+  }
+  return &slot->container->value.array.array[slot->pos];
+}
+
+static void journal(
+  Patch* p,
+  UndoKind kind,
+  Slot slot,
+  JsonKeyVal* keyVal,
+  JsonValue* value,
+  bool moved
+) {
+  PatchUndo undo = {kind, moved, slot, keyVal, value};
+  vecPush(&p->undo, &undo);
+}
+
+static void freeMemberShell(JsonArena* arena, JsonKeyVal* keyVal) {
+  keyFree(arena, keyVal);
+  jsonFree(arena, keyVal, sizeof(JsonKeyVal));
+}
+
+static void undoChange(Patch* p, PatchUndo* undo) {
+  JsonValue* container = undo->slot.container;
+  switch(undo->kind) {
+    case UNDO_SET: {
+      JsonValue** ref = slotRef(p, &undo->slot);
+      if(!undo->moved) JsonTypeFreeImpl(*ref, p->arena);
+      *ref = undo->value;
+      break;
+    }
+    case UNDO_INSERT: {
+      JsonValue* value;
+      if(container->type == OBJECT) {
+        struct JsonObject* object = &container->value.object;
+        JsonKeyVal* keyVal = object->elements[undo->slot.pos];
+        objectRemove(p->arena, object, undo->slot.pos);
+        value = keyVal->value;
+        freeMemberShell(p->arena, keyVal);
+      } else {
+        value = arrayRemove(&container->value.array, undo->slot.pos);
+      }
+      if(!undo->moved) JsonTypeFreeImpl(value, p->arena);
+      break;
+    }
+    case UNDO_REMOVE:
+      if(container->type == OBJECT) {
+        objectInsert(
+          p->arena,
+          &container->value.object,
+          undo->slot.pos,
+          undo->keyVal
+        );
+      } else {
+        arrayInsert(
+          p->arena,
+          &container->value.array,
+          undo->slot.pos,
+          &undo->value,
+          1
+        );
+      }
+      break;
+  }
+}
+
+static void commitChange(Patch* p, PatchUndo* undo) {
+  switch(undo->kind) {
+    case UNDO_SET:
+      JsonTypeFreeImpl(undo->value, p->arena);
+      break;
+    case UNDO_INSERT:
+      break;
+    case UNDO_REMOVE:
+      if(!undo->moved) JsonTypeFreeImpl(undo->value, p->arena);
+      if(undo->keyVal) freeMemberShell(p->arena, undo->keyVal);
+      break;
+  }
+}
+
+/*
+ * Pointers arrive in their stored form, like keys everywhere else.
+ * RFC 6901 splits the decoded pointer on every `/`, so an escaped
+ * `\/` separates segments as well; this is its length at `at`, or 0.
+ */
+static size_t separatorLen(const char* ptr, size_t len, size_t at) {
+  if(at < len && ptr[at] == '/') return 1;
+  if(at + 1 < len && ptr[at] == '\\' && ptr[at + 1] == '/') return 2;
+  return 0;
+}
+
+/*
+ * The end of the segment starting at `at`, stepping over escapes so
+ * that the `/` of an escaped backslash followed by one still splits.
+ */
+static size_t segmentEnd(const char* ptr, size_t len, size_t at) {
+  while(at < len && !separatorLen(ptr, len, at)) {
+    at += ptr[at] == '\\' ? 2 : 1;
+  }
+  return at < len ? at : len;
+}
+
+/*
+ * Where the last segment's separator starts.
+ */
+static size_t lastSeparator(const char* ptr, size_t len) {
+  size_t split = 0;
+  for(size_t at = 0; at < len;) {
+    split = at;
+    at = segmentEnd(ptr, len, at + separatorLen(ptr, len, at));
+  }
+  return split;
+}
+
+/*
+ * Decodes `~1` and `~0` into the scratch buffer; NULL when the
+ * segment holds any other `~` sequence.
+ */
+static const char* decodeSegment(
+  Patch* p,
+  const char* raw,
+  size_t rawLen,
+  size_t* len
+) {
+  if(rawLen > p->segmentCap) {
+    p->segment = RedisModule_Realloc(p->segment, rawLen);
+    p->segmentCap = rawLen;
+  }
+  size_t out = 0;
+  for(size_t i = 0; i < rawLen; i++) {
+    char ch = raw[i];
+    if(ch == '~') {
+      if(i + 1 == rawLen || (raw[i + 1] != '0' && raw[i + 1] != '1')) {
+        return NULL;
+      }
+      ch = raw[++i] == '0' ? '~' : '/';
+    }
+    p->segment[out++] = ch;
+  }
+  *len = out;
+  return p->segment;
+}
+
+/*
+ * A `/` decoded from `~1` stands for a slash the stored key may hold
+ * escaped or not, so it also matches `\/`.
+ */
+static bool slashKeyMatches(const JsonKeyVal* keyVal, const char* seg, size_t len) {
+  const char* key = keyData(keyVal);
+  size_t keyLen = keyVal->keyLen;
+  size_t i = 0, j = 0;
+  while(i < keyLen && j < len) {
+    if(seg[j] == '/' && key[i] == '\\' && i + 1 < keyLen && key[i + 1] == '/') {
+      i += 2;
+      ++j;
+    } else if(key[i] != seg[j]) {
+      return false;
+    } else if(key[i] == '\\') {
+      if(i + 1 == keyLen || j + 1 == len || key[i + 1] != seg[j + 1]) return false;
+      i += 2;
+      j += 2;
+    } else {
+      ++i;
+      ++j;
+    }
+  }
+  return i == keyLen && j == len;
+}
+
+static size_t memberPosition(struct JsonObject* object, const char* seg, size_t len) {
+  size_t pos = objectFind(object, seg, len);
+  if(pos != OBJECT_NONE || !memchr(seg, '/', len)) return pos;
+  for(pos = 0; pos < object->size; pos++) {
+    if(slashKeyMatches(object->elements[pos], seg, len)) return pos;
+  }
+  return OBJECT_NONE;
+}
+
+static bool parseIndex(const char* seg, size_t len, size_t* index) {
+  if(!len || len > 18 || (len > 1 && seg[0] == '0')) return false;
+  size_t value = 0;
+  for(size_t i = 0; i < len; i++) {
+    if(seg[i] < '0' || seg[i] > '9') return false;
+    value = value * 10 + (seg[i] - '0');
+  }
+  *index = value;
+  return true;
+}
+
+/*
+ * Position of the existing member or element named by the raw
+ * segment, or SIZE_MAX.
+ */
+static size_t childPosition(
+  Patch* p,
+  JsonValue* node,
+  const char* raw,
+  size_t rawLen
+) {
+  size_t len, pos;
+  const char* seg = decodeSegment(p, raw, rawLen, &len);
+  if(!seg) return SIZE_MAX;
+  if(node->type == OBJECT) {
+    pos = memberPosition(&node->value.object, seg, len);
+    return pos == OBJECT_NONE ? SIZE_MAX : pos;
+  }
+  if(node->type == ARRAY) {
+    if(!parseIndex(seg, len, &pos) || pos >= node->value.array.size) {
+      return SIZE_MAX;
+    }
+    return pos;
+  }
+  return SIZE_MAX;
+}
+
+/*
+ * Splits a non-empty pointer into the node holding its target and
+ * the raw last segment. NULL when the pointer is malformed or the
+ * parent does not exist.
+ */
+static JsonValue* resolveParent(
+  Patch* p,
+  const char* ptr,
+  size_t len,
+  const char** last,
+  size_t* lastLen
+) {
+  if(!separatorLen(ptr, len, 0)) return NULL;
+  size_t split = lastSeparator(ptr, len);
+  *last = ptr + split + separatorLen(ptr, len, split);
+  *lastLen = len - (*last - ptr);
+
+  if(p->parent && p->parentLen == split && !memcmp(p->parentPath, ptr, split)) {
+    return p->parent;
+  }
+  JsonValue* node = *p->root;
+  for(size_t at = 0; at < split;) {
+    size_t start = at + separatorLen(ptr, split, at);
+    size_t end = segmentEnd(ptr, split, start);
+    size_t pos = childPosition(p, node, ptr + start, end - start);
+    if(pos == SIZE_MAX) return NULL;
+    Slot slot = {node, pos};
+    node = *slotRef(p, &slot);
+    at = end;
+  }
+  p->parentPath = ptr;
+  p->parentLen = split;
+  p->parent = node;
+  return node;
+}
+
+/*
+ * Drops the cached parent when the change at `ptr` replaced or
+ * removed it or one of its ancestors, or, when `shifts` is set,
+ * moved the elements after it in an array above it.
+ */
+static void changed(Patch* p, const char* ptr, size_t len, bool shifts) {
+  if(!p->parent) return;
+  if(!len) {
+    p->parent = NULL;
+    return;
+  }
+  if(shifts) len = lastSeparator(ptr, len);
+  if(
+    len <= p->parentLen &&
+    !memcmp(p->parentPath, ptr, len) &&
+    (len == p->parentLen ? !shifts : separatorLen(p->parentPath, p->parentLen, len))
+  ) {
+    p->parent = NULL;
+  }
+}
+
+static JsonValue* locate(Patch* p, const char* ptr, size_t len) {
+  if(!len) return *p->root;
+  const char* last;
+  size_t lastLen;
+  JsonValue* parent = resolveParent(p, ptr, len, &last, &lastLen);
+  if(!parent) return NULL;
+  size_t pos = childPosition(p, parent, last, lastLen);
+  if(pos == SIZE_MAX) return NULL;
+  Slot slot = {parent, pos};
+  return *slotRef(p, &slot);
+}
+
+static void setSlot(Patch* p, Slot slot, JsonValue* value, bool moved) {
+  JsonValue** ref = slotRef(p, &slot);
+  journal(p, UNDO_SET, slot, NULL, *ref, moved);
+  *ref = value;
+}
+
+/*
+ * The operations own `value` only when they succeed.
+ */
+static const char* opAdd(
+  Patch* p,
+  const char* ptr,
+  size_t len,
+  JsonValue* value,
+  bool moved
+) {
+  if(!len) {
+    changed(p, ptr, len, false);
+    Slot root = {NULL, 0};
+    setSlot(p, root, value, moved);
+    return NULL;
+  }
+  const char* last;
+  size_t lastLen;
+  JsonValue* parent = resolveParent(p, ptr, len, &last, &lastLen);
+  if(!parent) return ERR_NOT_FOUND;
+  size_t segLen;
+  const char* seg = decodeSegment(p, last, lastLen, &segLen);
+  if(!seg) return ERR_INVALID;
+
+  if(parent->type == OBJECT) {
+    struct JsonObject* object = &parent->value.object;
+    size_t pos = memberPosition(object, seg, segLen);
+    if(pos != OBJECT_NONE) {
+      Slot slot = {parent, pos};
+      setSlot(p, slot, value, moved);
+      changed(p, ptr, len, false);
+      return NULL;
+    }
+    if(!jsonValidKey(seg, segLen)) return "ERR invalid key in path";
+    JsonKeyVal* keyVal = jsonAlloc(p->arena, sizeof(JsonKeyVal));
+    keySet(p->arena, keyVal, seg, segLen);
+    keyVal->value = value;
+    objectAppend(p->arena, object, keyVal);
+    Slot slot = {parent, object->size - 1};
+    journal(p, UNDO_INSERT, slot, NULL, NULL, moved);
+    return NULL;
+  }
+  if(parent->type == ARRAY) {
+    JsonArray* array = &parent->value.array;
+    size_t pos = array->size;
+    if(
+      !(segLen == 1 && seg[0] == '-') &&
+      (!parseIndex(seg, segLen, &pos) || pos > array->size)
+    ) {
+      return ERR_NOT_FOUND;
+    }
+    arrayInsert(p->arena, array, pos, &value, 1);
+    Slot slot = {parent, pos};
+    journal(p, UNDO_INSERT, slot, NULL, NULL, moved);
+    changed(p, ptr, len, true);
+    return NULL;
+  }
+  return ERR_NOT_FOUND;
+}
+
+static const char* opRemove(
+  Patch* p,
+  const char* ptr,
+  size_t len,
+  JsonValue** removed,
+  bool moved
+) {
+  if(!len) return ERR_INVALID;
+  const char* last;
+  size_t lastLen;
+  JsonValue* parent = resolveParent(p, ptr, len, &last, &lastLen);
+  size_t pos = parent ? childPosition(p, parent, last, lastLen) : SIZE_MAX;
+  if(pos == SIZE_MAX) return ERR_NOT_FOUND;
+
+  Slot slot = {parent, pos};
+  if(parent->type == OBJECT) {
+    JsonKeyVal* keyVal = parent->value.object.elements[pos];
+    objectRemove(p->arena, &parent->value.object, pos);
+    *removed = keyVal->value;
+    journal(p, UNDO_REMOVE, slot, keyVal, keyVal->value, moved);
+  } else {
+    *removed = arrayRemove(&parent->value.array, pos);
+    journal(p, UNDO_REMOVE, slot, NULL, *removed, moved);
+  }
+  changed(p, ptr, len, parent->type == ARRAY);
+  return NULL;
+}
+
+static const char* opReplace(
+  Patch* p,
+  const char* ptr,
+  size_t len,
+  JsonValue* value
+) {
+  Slot slot = {NULL, 0};
+  if(len) {
+    const char* last;
+    size_t lastLen;
+    slot.container = resolveParent(p, ptr, len, &last, &lastLen);
+    if(!slot.container) return ERR_NOT_FOUND;
+    slot.pos = childPosition(p, slot.container, last, lastLen);
+    if(slot.pos == SIZE_MAX) return ERR_NOT_FOUND;
+  }
+  setSlot(p, slot, value, false);
+  changed(p, ptr, len, false);
+  return NULL;
+}
+
+/*
+ * `from` may not be a proper prefix of `path`: nothing can be moved
+ * into itself.
+ */
+static const char* opMove(
+  Patch* p,
+  const char* from,
+  size_t fromLen,
+  const char* path,
+  size_t len
+) {
+  if(fromLen == len && !memcmp(from, path, len)) {
+    return locate(p, from, fromLen) ? NULL : ERR_NOT_FOUND;
+  }
+  if(fromLen < len && !memcmp(from, path, fromLen) && separatorLen(path, len, fromLen)) {
+    return ERR_INVALID;
+  }
+  JsonValue* value;
+  const char* err = opRemove(p, from, fromLen, &value, true);
+  return err ? err : opAdd(p, path, len, value, true);
+}
+
+static const JsonString* stringMember(JsonValue* op, const char* key) {
+  size_t pos = objectFind(&op->value.object, key, strlen(key));
+  if(pos == OBJECT_NONE) return NULL;
+  JsonValue* value = op->value.object.elements[pos]->value;
+  return value->type == STRING ? &value->value.string : NULL;
+}
+
+/*
+ * Takes `value` out of the operation, leaving null in its place so
+ * the patch can still be freed as a whole.
+ */
+static JsonValue* takeValue(Patch* p, JsonValue* op) {
+  size_t pos = objectFind(&op->value.object, "value", 5);
+  if(pos == OBJECT_NONE) return NULL;
+  JsonKeyVal* keyVal = op->value.object.elements[pos];
+  JsonValue* value = keyVal->value;
+  keyVal->value = jsonAlloc(p->arena, sizeof(JsonValue));
+  keyVal->value->type = NIL;
+  return value;
+}
+
+static bool opIs(const JsonString* name, const char* op) {
+  return name->size == strlen(op) && !memcmp(name->data, op, name->size);
+}
+
+static const char* applyOperation(Patch* p, JsonValue* op) {
+  if(op->type != OBJECT) return ERR_INVALID;
+  const JsonString* name = stringMember(op, "op");
+  const JsonString* path = stringMember(op, "path");
+  if(!name || !path) return ERR_INVALID;
+
+  if(opIs(name, "remove")) {
+    JsonValue* removed;
+    return opRemove(p, path->data, path->size, &removed, false);
+  }
+  if(opIs(name, "add") || opIs(name, "replace")) {
+    JsonValue* value = takeValue(p, op);
+    if(!value) return ERR_INVALID;
+    const char* err = opIs(name, "add") ?
+      opAdd(p, path->data, path->size, value, false) :
+      opReplace(p, path->data, path->size, value);
+    if(err) JsonTypeFreeImpl(value, p->arena);
+    return err;
+  }
+  if(opIs(name, "test")) {
+    size_t pos = objectFind(&op->value.object, "value", 5);
+    if(pos == OBJECT_NONE) return ERR_INVALID;
+    JsonValue* target = locate(p, path->data, path->size);
+    if(!target) return ERR_NOT_FOUND;
+    if(!valueEquals(target, op->value.object.elements[pos]->value)) {
+      return "ERR patch test failed";
+    }
+    return NULL;
+  }
+
+  const JsonString* from = stringMember(op, "from");
+  if(!from) return ERR_INVALID;
+  if(opIs(name, "move")) {
+    return opMove(p, from->data, from->size, path->data, path->size);
+  }
+  if(opIs(name, "copy")) {
+    JsonValue* source = locate(p, from->data, from->size);
+    if(!source) return ERR_NOT_FOUND;
+    JsonValue* copy = valueCopy(p->arena, source);
+    const char* err = opAdd(p, path->data, path->size, copy, false);
+    if(err) JsonTypeFreeImpl(copy, p->arena);
+    return err;
+  }
+  return ERR_INVALID;
+}
+
+const char* jsonPatchApply(JsonArena* arena, JsonValue** root, JsonValue* patch) {
+  Patch p;
+  memset(&p, 0, sizeof(Patch));
+  p.arena = arena;
+  p.root = root;
+  vecNew(&p.undo, 16, sizeof(PatchUndo));
+
+  const char* err = patch->type == ARRAY ? NULL : ERR_INVALID;
+  for(size_t i = 0; !err && i < patch->value.array.size; i++) {
+    err = applyOperation(&p, patch->value.array.array[i]);
+  }
+
+  PatchUndo* undo = p.undo.data;
+  if(err) {
+    for(size_t i = p.undo.len; i-- > 0;) undoChange(&p, &undo[i]);
+  } else {
+    for(size_t i = 0; i < p.undo.len; i++) commitChange(&p, &undo[i]);
+  }
+  vecDel(&p.undo);
+  if(p.segment) RedisModule_Free(p.segment);
+  JsonTypeFreeImpl(patch, arena);
+  return err;
+}
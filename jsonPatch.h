@@ -0,0 +1,13 @@
+#pragma once
+
+#include "value.h"
+
+/*
+ * Applies an RFC 6902 patch, parsed into `arena`, to the tree at
+ * `*root` in the same arena. Operations run in order and edit the
+ * tree in place; when one fails everything done before it is undone,
+ * so the document is either fully patched or unchanged. The patch is
+ * consumed either way. Returns NULL on success, otherwise the error
+ * to reply with.
+ */
+const char* jsonPatchApply(JsonArena* arena, JsonValue** root, JsonValue* patch);
@@ -1,64 +1,331 @@
 #include "jsonToValue.h"
 #include "redismodule.h"
 #include "value.h"
+#include "config.h"
+#include "structural.h"
+#include "number.h"
+#include "tape.h"
 #include <string.h>
-#include <math.h>
 
+/*
+ * Keep the stage 1 index between calls so that steady state parsing
+ * (and rejecting bad input) does not touch the allocator. Buffers
+ * grown by an unusually large payload are given back afterwards.
+ */
+#define SCRATCH_INDEX_RETAIN (64 * 1024)
+
+static StructuralIndex scratchIndex;
+
+static inline bool isSpace(char ch) {
+  return ch == ' ' || ch == '\n' || ch == '\t' || ch == '\r';
+}
+
+static inline bool isOp(char ch) {
+  return ch == '{' || ch == '}' || ch == '[' || ch == ']' ||
+    ch == ':' || ch == ',';
+}
+
+static inline bool isDigit(char ch) {
+  return ch >= '0' && ch <= '9';
+}
+
+static inline bool isHex(char ch) {
+  return isDigit(ch) || (ch >= 'a' && ch <= 'f') || (ch >= 'A' && ch <= 'F');
+}
+
+/*
+ * Strict token checks shared by both engines, all bounded by `end`.
+ */
+static bool validStringBody(const char* p, const char* end) {
+  while(p < end) {
+    unsigned char ch = *p++;
+    if(ch < 0x20) return false;
+    if(ch != '\\') continue;
+    if(p == end) return false;
+    switch(*p++) {
+      case '"': case '\\': case '/': case 'b':
+      case 'f': case 'n': case 'r': case 't':
+        break;
+      case 'u':
+        if(end - p < 4) return false;
+        for(int i = 0; i < 4; i++) {
+          if(!isHex(p[i])) return false;
+        }
+        p += 4;
+        break;
+      default:
+        return false;
+    }
+  }
+  return true;
+}
+
+static bool validNumber(const char* p, const char* end) {
+  if(p < end && *p == '-') ++p;
+  if(p == end || !isDigit(*p)) return false;
+  if(*p == '0') {
+    ++p;
+  } else {
+    while(p < end && isDigit(*p)) ++p;
+  }
+  if(p < end && *p == '.') {
+    ++p;
+    if(p == end || !isDigit(*p)) return false;
+    while(p < end && isDigit(*p)) ++p;
+  }
+  if(p < end && (*p == 'e' || *p == 'E')) {
+    ++p;
+    if(p < end && (*p == '+' || *p == '-')) ++p;
+    if(p == end || !isDigit(*p)) return false;
+    while(p < end && isDigit(*p)) ++p;
+  }
+  return p == end;
+}
+
+static bool validScalar(const char* p, const char* end) {
+  size_t len = end - p;
+  if(len == 4 && (!memcmp(p, "true", 4) || !memcmp(p, "null", 4)))
+    return true;
+  if(len == 5 && !memcmp(p, "false", 5))
+    return true;
+  return validNumber(p, end);
+}
+
+/*
+ * Token stream over either the raw bytes (legacy engine) or the
+ * stage 1 index (structural engine), so both are validated by the
+ * same grammar before a single node is allocated.
+ */
 typedef struct {
   const char* json;
+  size_t len;
+  const uint32_t* indexes;
+  size_t count;
+  size_t pos;
+} TokenSource;
+
+typedef struct {
+  char kind;
+  const char* start;
+  const char* end;
+} Token;
+
+static bool nextToken(TokenSource* src, Token* tok) {
+  const char* json = src->json;
+  if(src->indexes) {
+    if(src->pos >= src->count) {
+      tok->kind = '\0';
+      return true;
+    }
+    size_t at = src->indexes[src->pos];
+    tok->kind = json[at];
+    if(tok->kind == '"') {
+      if(src->pos + 1 >= src->count) return false;
+      tok->start = json + at + 1;
+      tok->end = json + src->indexes[src->pos + 1];
+      src->pos += 2;
+      return true;
+    }
+    tok->start = json + at;
+    tok->end = json + src->indexes[src->pos + 1];
+    while(tok->end > tok->start && isSpace(tok->end[-1])) --tok->end;
+    ++src->pos;
+    return true;
+  }
+
+  size_t i = src->pos;
+  while(i < src->len && isSpace(json[i])) ++i;
+  if(i == src->len) {
+    src->pos = i;
+    tok->kind = '\0';
+    return true;
+  }
+  tok->kind = json[i];
+  if(tok->kind == '"') {
+    size_t j = i + 1;
+    while(j < src->len && json[j] != '"') {
+      j += json[j] == '\\' ? 2 : 1;
+    }
+    if(j >= src->len) return false;
+    tok->start = json + i + 1;
+    tok->end = json + j;
+    src->pos = j + 1;
+    return true;
+  }
+  tok->start = json + i;
+  if(isOp(tok->kind)) {
+    src->pos = i + 1;
+    return true;
+  }
+  while(i < src->len && !isSpace(json[i]) && !isOp(json[i]) && json[i] != '"')
+    ++i;
+  tok->end = json + i;
+  src->pos = i;
+  return true;
+}
+
+typedef enum {
+  EXPECT_VALUE,
+  EXPECT_VALUE_OR_CLOSE,
+  EXPECT_KEY,
+  EXPECT_KEY_OR_CLOSE,
+  EXPECT_COLON,
+  EXPECT_NEXT
+} ValidatorState;
+
+static bool validateTokens(TokenSource* src) {
+  char stack[JSON_MAX_DEPTH];
+  size_t depth = 0;
+  ValidatorState state = EXPECT_VALUE;
+  Token tok;
+
+  while(1) {
+    if(!nextToken(src, &tok)) return false;
+    char ch = tok.kind;
+    if(ch == '\0') return state == EXPECT_NEXT && depth == 0;
+
+    switch(state) {
+      case EXPECT_VALUE_OR_CLOSE:
+        if(ch == ']') {
+          --depth;
+          state = EXPECT_NEXT;
+          break;
+        }
+        /* fall through */
+      case EXPECT_VALUE:
+        if(ch == '{' || ch == '[') {
+          if(depth == JSON_MAX_DEPTH) return false;
+          stack[depth++] = ch;
+          state = ch == '{' ? EXPECT_KEY_OR_CLOSE : EXPECT_VALUE_OR_CLOSE;
+        } else if(ch == '"') {
+          if(!validStringBody(tok.start, tok.end)) return false;
+          state = EXPECT_NEXT;
+        } else if(!isOp(ch)) {
+          if(!validScalar(tok.start, tok.end)) return false;
+          state = EXPECT_NEXT;
+        } else {
+          return false;
+        }
+        break;
+      case EXPECT_KEY_OR_CLOSE:
+        if(ch == '}') {
+          --depth;
+          state = EXPECT_NEXT;
+          break;
+        }
+        /* fall through */
+      case EXPECT_KEY:
+        if(ch != '"' || !validStringBody(tok.start, tok.end)) return false;
+        state = EXPECT_COLON;
+        break;
+      case EXPECT_COLON:
+        if(ch != ':') return false;
+        state = EXPECT_VALUE;
+        break;
+      case EXPECT_NEXT:
+        if(depth == 0) return false;
+        if(ch == ',') {
+          state = stack[depth - 1] == '{' ? EXPECT_KEY : EXPECT_VALUE;
+        } else if(
+          (ch == '}' && stack[depth - 1] == '{') ||
+          (ch == ']' && stack[depth - 1] == '[')
+        ) {
+          --depth;
+        } else {
+          return false;
+        }
+        break;
+    }
+  }
+}
+
+static void parseNumberToken(const char* p, size_t len, JsonValue* val) {
+  NumberKind kind = parseNumber(
+    p,
+    len,
+    &val->value.integer,
+    &val->value.number
+  );
+  val->type = kind == NUMBER_INTEGER ? INTEGER : DOUBLE;
+}
+
+static void parseScalarToken(const char* p, size_t len, JsonValue* val) {
+  switch(*p) {
+    case 't':
+      val->type = BOOLEAN;
+      val->value.boolean = true;
+      break;
+    case 'f':
+      val->type = BOOLEAN;
+      val->value.boolean = false;
+      break;
+    case 'n':
+      val->type = NIL;
+      break;
+    default:
+      parseNumberToken(p, len, val);
+      break;
+  }
+}
+
+typedef struct {
+  const char* json;
+  size_t len;
   size_t index;
   RedisModuleCtx* rctx;
+  JsonArena* arena;
 } ParserContext;
 
 static JsonValue* parseValue(ParserContext* ctx);
 
+static inline char peek(ParserContext* ctx) {
+  return ctx->index < ctx->len ? ctx->json[ctx->index] : '\0';
+}
+
 static void skipSpace(ParserContext* ctx) {
-  while(
-    ctx->json[ctx->index] == ' ' ||
-    ctx->json[ctx->index] == '\n'
-  ) {
+  while(isSpace(peek(ctx))) {
     ++ctx->index;
   }
 }
 
+/*
+ * Returns the body of the string at the cursor within the input;
+ * callers copy it into a key or a string node.
+ */
 static const char* parseStr(ParserContext* ctx, size_t* length) {
   skipSpace(ctx);
-  const char* start = ctx->json + ctx->index;
-  const char* end = start;
-  if(ctx->json[ctx->index] == '"') {
-    ++start;
-    ++ctx->index;
-    while(ctx->json[ctx->index] != '"') {
-      ++ctx->index;
-      ++end;
+  if(peek(ctx) == '"') {
+    const char* start = ctx->json + ++ctx->index;
+    while(peek(ctx) != '"') {
+      ctx->index += peek(ctx) == '\\' ? 2 : 1;
     }
+    size_t len = (ctx->json + ctx->index) - start;
     ++ctx->index;
-    size_t len = (end - start) + 1;
-    char* str = RedisModule_Alloc(len * sizeof(char));
-    memcpy(str, start, len);
-    str[len] = '\0';
     *length = len;
-    return str;
+    return start;
   }
   *length = 0;
-  return 0;
+  return ctx->json + ctx->index;
 }
 
 static void parseObject(ParserContext* ctx, JsonValue* val) {
   ++ctx->index;
-  size_t elemSize = 0;
+  size_t cap = 0;
   struct JsonObject object;
+  object.elements = NULL;
   object.size = 0;
-  while(ctx->json[ctx->index] != '}') {
-    JsonKeyVal* keyVal = RedisModule_Calloc(1, sizeof(JsonKeyVal));
+  object.index = NULL;
+  skipSpace(ctx);
+  while(peek(ctx) != '}') {
+    JsonKeyVal* keyVal = jsonAlloc(ctx->arena, sizeof(JsonKeyVal));
     size_t len;
 
     skipSpace(ctx);
     const char* key = parseStr(ctx, &len);
-    keyVal->key = key;
+    keySet(ctx->arena, keyVal, key, len);
     skipSpace(ctx);
 
-    if(ctx->json[ctx->index] == ':')
+    if(peek(ctx) == ':')
       ++ctx->index;
 
     skipSpace(ctx);
@@ -66,23 +333,25 @@ static void parseObject(ParserContext* ctx, JsonValue* val) {
     keyVal->value = objVal;
     skipSpace(ctx);
 
-    ++elemSize;
-    if(object.size == 0) {
-      object.elements = RedisModule_Calloc(1, sizeof(JsonKeyVal*));
-    } else if(elemSize > object.size) {
-      object.elements = RedisModule_Realloc(
+    if(object.size == cap) {
+      size_t newCap = cap ? cap * 2 : 1;
+      object.elements = jsonRealloc(
+        ctx->arena,
         object.elements,
-        elemSize * 2 * sizeof(JsonKeyVal*)
+        cap * sizeof(JsonKeyVal*),
+        newCap * sizeof(JsonKeyVal*)
       );
+      cap = newCap;
     }
-    object.size = elemSize;
-    object.elements[object.size - 1] = keyVal;
+    object.elements[object.size++] = keyVal;
 
-    if(ctx->json[ctx->index] == ',')
+    if(peek(ctx) == ',')
       ++ctx->index;
+    skipSpace(ctx);
   }
-  skipSpace(ctx);
   ++ctx->index;
+  object.cap = cap;
+  objectReindex(ctx->arena, &object);
   val->value.object = object;
   val->type = OBJECT;
 }
@@ -90,202 +359,570 @@ static void parseObject(ParserContext* ctx, JsonValue* val) {
 static void parseArray(ParserContext* ctx, JsonValue* val) {
   ++ctx->index;
   JsonArray array;
+  array.array = NULL;
   array.size = 0;
-  size_t elemSize = 0;
-  while(ctx->json[ctx->index] != ']') {
+  array.cap = 0;
+  skipSpace(ctx);
+  while(peek(ctx) != ']') {
     skipSpace(ctx);
     JsonValue* elem = parseValue(ctx);
     skipSpace(ctx);
-    ++elemSize;
-    if(array.size == 0) {
-      array.array = RedisModule_Calloc(1, sizeof(JsonKeyVal*));
-    } else if(elemSize > array.size) {
-      array.array = RedisModule_Realloc(
+    if(array.size == array.cap) {
+      size_t cap = array.cap ? array.cap * 2 : 1;
+      array.array = jsonRealloc(
+        ctx->arena,
         array.array,
-        elemSize * 2 * sizeof(JsonValue*)
+        array.cap * sizeof(JsonValue*),
+        cap * sizeof(JsonValue*)
       );
+      array.cap = cap;
     }
-    array.size = elemSize;
-    array.array[array.size - 1] = elem;
-    if(ctx->json[ctx->index] == ',')
+    array.array[array.size++] = elem;
+    if(peek(ctx) == ',')
       ++ctx->index;
+    skipSpace(ctx);
   }
-  skipSpace(ctx);
   ++ctx->index;
   val->value.array = array;
   val->type = ARRAY;
 }
 
 static JsonValue* parseValue(ParserContext* ctx) {
-  JsonValue* val = RedisModule_Calloc(1, sizeof(JsonValue));
+  JsonValue* val = jsonAlloc(ctx->arena, sizeof(JsonValue));
   skipSpace(ctx);
-  if(ctx->json[ctx->index] == '{') {
+  if(peek(ctx) == '{') {
     parseObject(ctx, val);
-  } else if (
-    ctx->json[ctx->index] == '"' ||
-    ctx->json[ctx->index] == '\''
-  ) {
+  } else if(peek(ctx) == '"') {
     size_t len;
     const char* str = parseStr(ctx, &len);
     val->type = STRING;
     val->value.string.size = len;
-    val->value.string.data = str;
-  } else if (ctx->json[ctx->index] == '[') {
+    val->value.string.data = jsonStrndup(ctx->arena, str, len);
+  } else if(peek(ctx) == '[') {
     parseArray(ctx, val);
-  } else if (ctx->json[ctx->index] == 't') { // true
-    ctx->index += 4;
-    val->type = BOOLEAN;
-    val->value.boolean = true;
-  } else if (ctx->json[ctx->index] == 'f') { // false
-    ctx->index += 5;
-    val->type = BOOLEAN;
-    val->value.boolean = false;
   } else {
-    bool negative;
-    if(ctx->json[ctx->index] == '-') {
-      negative = true;
-      ++ctx->index;
-    } else if(ctx->json[ctx->index] == '+') {
-      negative = false;
+    size_t start = ctx->index;
+    while(
+      ctx->index < ctx->len &&
+      !isSpace(peek(ctx)) &&
+      !isOp(peek(ctx))
+    ) {
       ++ctx->index;
     }
-    double number = 0;
-    bool isDecimal = false;
-    int numOfDecimals = 1;
-    skipSpace(ctx);
+    parseScalarToken(ctx->json + start, ctx->index - start, val);
+  }
+  return val;
+}
+
+/*
+ * Stage 2 of the structural parser: builds the tree by walking the
+ * positions found by buildStructuralIndex instead of the raw bytes.
+ * A string always spans two consecutive entries (its quotes) and a
+ * bare scalar ends where the next entry starts. The index has been
+ * validated by then, so nothing here can fail.
+ *
+ * Children are collected on a shared scratch stack and copied out
+ * once their container closes, so every elements array is allocated
+ * exactly once at its final size.
+ */
+typedef struct {
+  const char* json;
+  const uint32_t* indexes;
+  size_t count;
+  size_t pos;
+  JsonArena* arena;
+} StructuralCursor;
+
+static void** scratchStack;
+static size_t scratchLen;
+static size_t scratchCap;
+
+static inline void scratchPush(void* ptr) {
+  if(scratchLen == scratchCap) {
+    scratchCap = scratchCap ? scratchCap * 2 : 256;
+    scratchStack = RedisModule_Realloc(scratchStack, scratchCap * sizeof(void*));
+  }
+  scratchStack[scratchLen++] = ptr;
+}
+
+static void* scratchPop(JsonArena* arena, size_t base, size_t* count) {
+  *count = scratchLen - base;
+  if(!*count) return NULL;
+  void* elements = jsonAlloc(arena, *count * sizeof(void*));
+  memcpy(elements, scratchStack + base, *count * sizeof(void*));
+  scratchLen = base;
+  return elements;
+}
+
+static JsonValue* buildValue(StructuralCursor* cur);
+
+static inline char cursorChar(StructuralCursor* cur) {
+  return cur->json[cur->indexes[cur->pos]];
+}
+
+static const char* buildStr(StructuralCursor* cur, size_t* length) {
+  size_t start = cur->indexes[cur->pos] + 1;
+  size_t end = cur->indexes[cur->pos + 1];
+  cur->pos += 2;
+
+  *length = end - start;
+  return cur->json + start;
+}
+
+static void buildScalar(StructuralCursor* cur, JsonValue* val) {
+  const char* start = cur->json + cur->indexes[cur->pos];
+  const char* end = cur->json + cur->indexes[cur->pos + 1];
+  ++cur->pos;
+  while(isSpace(end[-1])) --end;
+  parseScalarToken(start, end - start, val);
+}
+
+static void buildObject(StructuralCursor* cur, JsonValue* val) {
+  ++cur->pos;
+  size_t base = scratchLen;
+  val->type = OBJECT;
+  if(cursorChar(cur) != '}') {
     while(1) {
-      if(ctx->json[ctx->index] >= '0' && ctx->json[ctx->index] <= '9') {
-        if(!isDecimal) {
-          number = (number * 10) + (ctx->json[ctx->index] - 48);
-          ++ctx->index;
-        } else {
-          number = number + ((ctx->json[ctx->index] - 48) / pow(10, numOfDecimals));
-          ++ctx->index;
-        }
-        continue;
-      }
-      if(ctx->json[ctx->index] == '.') {
-        isDecimal = true;
-        ++ctx->index;
-        continue;
-      }
-      break;
+      JsonKeyVal* keyVal = jsonAlloc(cur->arena, sizeof(JsonKeyVal));
+      size_t len;
+      const char* key = buildStr(cur, &len);
+      keySet(cur->arena, keyVal, key, len);
+      ++cur->pos;
+      keyVal->value = buildValue(cur);
+      scratchPush(keyVal);
+
+      if(cursorChar(cur) == '}') break;
+      ++cur->pos;
     }
-    if(isDecimal) {
-      val->value.number = negative ? -number : number;
-      val->type = DOUBLE;
-    } else {
-      val->value.integer = (int64_t)(negative ? -number : number);
-      val->type = INTEGER;
+  }
+  ++cur->pos;
+  struct JsonObject* object = &val->value.object;
+  object->elements = scratchPop(cur->arena, base, &object->size);
+  object->cap = object->size;
+  objectReindex(cur->arena, object);
+}
+
+static void buildArray(StructuralCursor* cur, JsonValue* val) {
+  ++cur->pos;
+  size_t base = scratchLen;
+  val->type = ARRAY;
+  if(cursorChar(cur) != ']') {
+    while(1) {
+      scratchPush(buildValue(cur));
+
+      if(cursorChar(cur) == ']') break;
+      ++cur->pos;
+    }
+  }
+  ++cur->pos;
+  JsonArray* array = &val->value.array;
+  array->array = scratchPop(cur->arena, base, &array->size);
+  array->cap = array->size;
+}
+
+static JsonValue* buildValue(StructuralCursor* cur) {
+  JsonValue* val = jsonAlloc(cur->arena, sizeof(JsonValue));
+  switch(cursorChar(cur)) {
+    case '{':
+      buildObject(cur, val);
+      break;
+    case '[':
+      buildArray(cur, val);
+      break;
+    case '"': {
+      size_t len;
+      const char* str = buildStr(cur, &len);
+      val->value.string.data = jsonStrndup(cur->arena, str, len);
+      val->value.string.size = len;
+      val->type = STRING;
+      break;
     }
+    default:
+      buildScalar(cur, val);
+      break;
   }
   return val;
 }
 
-JsonValue* parseJson(
+/*
+ * Validates the input with the configured engine. For the structural
+ * engine this leaves the stage 1 index in scratchIndex for the build.
+ * `sizeHint` estimates the bytes the tree will need; it errs low since
+ * an undershoot costs a small extra chunk while an overshoot stays
+ * reserved for the life of the document.
+ */
+static bool validateInput(const char* json, size_t len, size_t* sizeHint) {
+  TokenSource src = {
+    .json = json,
+    .len = len,
+    .indexes = NULL,
+    .count = 0,
+    .pos = 0
+  };
+  if(jsonConfig.parser == PARSER_STRUCTURAL) {
+    if(buildStructuralIndex(json, len, &scratchIndex) != STRUCTURAL_OK) {
+      return false;
+    }
+    src.indexes = scratchIndex.indexes;
+    src.count = scratchIndex.len;
+    *sizeHint = len + scratchIndex.len / 3 * (sizeof(JsonValue) + sizeof(void*));
+  } else {
+    *sizeHint = len * 2;
+  }
+  return validateTokens(&src);
+}
+
+static JsonValue* buildTree(
   RedisModuleCtx* ctx,
-  const char* json
+  const char* json,
+  size_t len,
+  JsonArena* arena
 ) {
+  if(jsonConfig.parser == PARSER_STRUCTURAL) {
+    StructuralCursor cur = {
+      .json = json,
+      .indexes = scratchIndex.indexes,
+      .count = scratchIndex.len,
+      .pos = 0,
+      .arena = arena
+    };
+    return buildValue(&cur);
+  }
+
   ParserContext pctx;
   pctx.json = json;
+  pctx.len = len;
   pctx.index = 0;
   pctx.rctx = ctx;
+  pctx.arena = arena;
 
   return parseValue(&pctx);
 }
 
-static void valueToString(
+/*
+ * The structural engine writes the tape straight from the index; the
+ * legacy engine goes through a throwaway tree.
+ */
+static JsonTape* buildTape(
   RedisModuleCtx* ctx,
-  JsonValue* val,
-  RedisModuleString* out
-);
-
-static void arrayToString(
-  RedisModuleCtx* ctx,
-  JsonValue* val,
-  RedisModuleString* out
+  const char* json,
+  size_t len,
+  size_t sizeHint
 ) {
-  RedisModule_StringAppendBuffer(ctx, out, "[", 1);
-  for(size_t i = 0; i < val->value.array.size; i++) {
-    valueToString(ctx, val->value.array.array[i], out);
-    RedisModule_StringAppendBuffer(ctx, out, ",", 1);
+  if(jsonConfig.parser == PARSER_STRUCTURAL) {
+    return tapeFromIndex(json, scratchIndex.indexes, scratchIndex.len);
+  }
+  JsonArena* arena = arenaNew(sizeHint);
+  JsonTape* tape = tapeFromValue(buildTree(ctx, json, len, arena));
+  arenaFree(arena);
+  return tape;
+}
+
+static void releaseScratch(void) {
+  if(scratchIndex.cap > SCRATCH_INDEX_RETAIN) {
+    freeStructuralIndex(&scratchIndex);
+  }
+  if(scratchCap > SCRATCH_INDEX_RETAIN) {
+    RedisModule_Free(scratchStack);
+    scratchStack = NULL;
+    scratchCap = 0;
   }
-  RedisModule_StringAppendBuffer(ctx, out, "]", 1);
 }
 
-static void objectToString(
+JsonValue* parseJson(
   RedisModuleCtx* ctx,
-  JsonValue* val,
-  RedisModuleString* out
+  const char* json,
+  size_t len,
+  JsonArena* arena
 ) {
-  RedisModule_StringAppendBuffer(ctx, out, "{", 1);
-  for(size_t i = 0; i < val->value.object.size; i++) {
-    RedisModule_StringAppendBuffer(ctx, out, "\"", 1);
-    const char* key = val->value.object.elements[i]->key;
-    RedisModule_StringAppendBuffer(ctx, out, key, strlen(key));
-    RedisModule_StringAppendBuffer(ctx, out, "\":", 2);
+  size_t sizeHint;
+  JsonValue* val = NULL;
+  if(validateInput(json, len, &sizeHint)) {
+    val = buildTree(ctx, json, len, arena);
+  }
+  releaseScratch();
+  return val;
+}
 
-    valueToString(ctx, val->value.object.elements[i]->value, out);
-    RedisModule_StringAppendBuffer(ctx, out, ",", 1);
+JsonTape* parseTape(RedisModuleCtx* ctx, const char* json, size_t len) {
+  size_t sizeHint;
+  JsonTape* tape = NULL;
+  if(validateInput(json, len, &sizeHint)) {
+    tape = buildTape(ctx, json, len, sizeHint);
   }
-  RedisModule_StringAppendBuffer(ctx, out, "}", 1);
+  releaseScratch();
+  return tape;
 }
 
-static void valueToString(
+RedisJsonValue* parseDocument(
   RedisModuleCtx* ctx,
-  JsonValue* val,
-  RedisModuleString* out
+  const char* json,
+  size_t len
 ) {
+  size_t sizeHint;
+  RedisJsonValue* doc = NULL;
+  if(validateInput(json, len, &sizeHint)) {
+    if(jsonConfig.storage == STORAGE_TAPE) {
+      doc = docNew(false, 0);
+      doc->tape = buildTape(ctx, json, len, sizeHint);
+    } else {
+      doc = docNew(jsonConfig.arena, sizeHint);
+      size_t heapBytes = jsonHeapBytes();
+      doc->rootJson = buildTree(ctx, json, len, doc->arena);
+      if(!doc->arena) doc->heapBytes = jsonHeapBytes() - heapBytes;
+    }
+  }
+  releaseScratch();
+  return doc;
+}
+
+/*
+ * Upper bound of the serialized size: exact for everything except
+ * doubles, which are counted at their longest possible form.
+ */
+static size_t serializedSize(JsonValue* val) {
+  switch(val->type) {
+    case OBJECT: {
+      struct JsonObject* object = &val->value.object;
+      size_t size = 2 + (object->size ? object->size - 1 : 0);
+      for(size_t i = 0; i < object->size; i++) {
+        size += object->elements[i]->keyLen + 3;
+        size += serializedSize(object->elements[i]->value);
+      }
+      return size;
+    }
+    case ARRAY: {
+      JsonArray* array = &val->value.array;
+      size_t size = 2 + (array->size ? array->size - 1 : 0);
+      for(size_t i = 0; i < array->size; i++) {
+        size += serializedSize(array->array[i]);
+      }
+      return size;
+    }
+    case DOUBLE:
+      return NUMBER_BUF_SIZE;
+    case INTEGER:
+      return integerLength(val->value.integer);
+    case STRING:
+      return val->value.string.size + 2;
+    case BOOLEAN:
+      return val->value.boolean ? 4 : 5;
+    case NIL:
+      return 4;
+    default:
+      return 0;
+  }
+}
+
+static char* valueToString(JsonValue* val, char* out);
+
+static char* arrayToString(JsonValue* val, char* out) {
+  *out++ = '[';
+  for(size_t i = 0; i < val->value.array.size; i++) {
+    if(i) *out++ = ',';
+    out = valueToString(val->value.array.array[i], out);
+  }
+  *out++ = ']';
+  return out;
+}
+
+static char* objectToString(JsonValue* val, char* out) {
+  *out++ = '{';
+  for(size_t i = 0; i < val->value.object.size; i++) {
+    if(i) *out++ = ',';
+    JsonKeyVal* keyVal = val->value.object.elements[i];
+    size_t keyLen = keyVal->keyLen;
+    *out++ = '"';
+    memcpy(out, keyData(keyVal), keyLen);
+    out += keyLen;
+    *out++ = '"';
+    *out++ = ':';
+    out = valueToString(keyVal->value, out);
+  }
+  *out++ = '}';
+  return out;
+}
+
+static char* valueToString(JsonValue* val, char* out) {
   switch(val->type) {
     case OBJECT:
-      objectToString(ctx, val, out);
-      break;
+      return objectToString(val, out);
     case ARRAY:
-      arrayToString(ctx, val, out);
-      break;
-    case DOUBLE: {
-      char buf[128];
-      sprintf(buf, "%.17g", val->value.number);
-      RedisModule_StringAppendBuffer(ctx, out, buf, strlen(buf));
-      break;
+      return arrayToString(val, out);
+    case DOUBLE:
+      return out + formatDouble(val->value.number, out);
+    case INTEGER:
+      return out + formatInteger(val->value.integer, out);
+    case STRING:
+      *out++ = '"';
+      memcpy(out, val->value.string.data, val->value.string.size);
+      out += val->value.string.size;
+      *out++ = '"';
+      return out;
+    case BOOLEAN:
+      if(val->value.boolean) {
+        memcpy(out, "true", 4);
+        return out + 4;
+      }
+      memcpy(out, "false", 5);
+      return out + 5;
+    case NIL:
+      memcpy(out, "null", 4);
+      return out + 4;
+    default:
+      return out;
+  }
+}
+
+bool jsonValidKey(const char* key, size_t len) {
+  for(size_t i = 0; i < len; i++) {
+    if(key[i] == '\\') ++i;
+    else if(key[i] == '"') return false;
+  }
+  return validStringBody(key, key + len);
+}
+
+size_t jsonSerializedSize(JsonValue* val) {
+  return serializedSize(val);
+}
+
+char* jsonWrite(JsonValue* val, char* out) {
+  return valueToString(val, out);
+}
+
+char* jsonToBuffer(JsonValue* val, size_t* len) {
+  char* buf = RedisModule_Alloc(serializedSize(val));
+  *len = valueToString(val, buf) - buf;
+  return buf;
+}
+
+int replyWithJson(RedisModuleCtx* ctx, JsonValue* val) {
+  size_t len;
+  char* buf = jsonToBuffer(val, &len);
+  int ret = RedisModule_ReplyWithStringBuffer(ctx, buf, len);
+  RedisModule_Free(buf);
+  return ret;
+}
+
+static unsigned hexValue(const char* p) {
+  unsigned value = 0;
+  for(int i = 0; i < 4; i++) {
+    char ch = p[i];
+    value = value * 16 + (isDigit(ch) ? ch - '0' : (ch | 0x20) - 'a' + 10);
+  }
+  return value;
+}
+
+static char* writeUtf8(unsigned code, char* out) {
+  if(code < 0x80) {
+    *out++ = code;
+  } else if(code < 0x800) {
+    *out++ = 0xc0 | (code >> 6);
+    *out++ = 0x80 | (code & 0x3f);
+  } else if(code < 0x10000) {
+    *out++ = 0xe0 | (code >> 12);
+    *out++ = 0x80 | ((code >> 6) & 0x3f);
+    *out++ = 0x80 | (code & 0x3f);
+  } else {
+    *out++ = 0xf0 | (code >> 18);
+    *out++ = 0x80 | ((code >> 12) & 0x3f);
+    *out++ = 0x80 | ((code >> 6) & 0x3f);
+    *out++ = 0x80 | (code & 0x3f);
+  }
+  return out;
+}
+
+size_t jsonUnescape(const char* str, size_t len, char* out) {
+  const char* end = str + len;
+  char* start = out;
+  while(str < end) {
+    const char* escape = memchr(str, '\\', end - str);
+    if(!escape) escape = end;
+    memcpy(out, str, escape - str);
+    out += escape - str;
+    if(escape == end) break;
+    str = escape + 2;
+    switch(escape[1]) {
+      case 'b': *out++ = '\b'; break;
+      case 'f': *out++ = '\f'; break;
+      case 'n': *out++ = '\n'; break;
+      case 'r': *out++ = '\r'; break;
+      case 't': *out++ = '\t'; break;
+      case 'u': {
+        unsigned code = hexValue(str);
+        str += 4;
+        if(
+          code >= 0xd800 && code < 0xdc00 &&
+          end - str >= 6 && str[0] == '\\' && str[1] == 'u'
+        ) {
+          unsigned low = hexValue(str + 2);
+          if(low >= 0xdc00 && low < 0xe000) {
+            code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+            str += 6;
+          }
+        }
+        out = writeUtf8(code, out);
+        break;
+      }
+      default:
+        *out++ = escape[1];
     }
-    case INTEGER: {
-      char buf[15 + 1 + 1];
-      sprintf(buf, "%lld", val->value.integer);
-      RedisModule_StringAppendBuffer(ctx, out, buf, strlen(buf));
-      break;
+  }
+  return out - start;
+}
+
+/*
+ * Short strings are decoded on the stack; most have nothing to decode
+ * and are replied with as they are.
+ */
+int replyWithJsonString(RedisModuleCtx* ctx, const char* str, size_t len) {
+  if(!memchr(str, '\\', len)) {
+    return RedisModule_ReplyWithStringBuffer(ctx, str, len);
+  }
+  char stackBuf[256];
+  char* buf = len <= sizeof(stackBuf) ? stackBuf : RedisModule_Alloc(len);
+  int ret = RedisModule_ReplyWithStringBuffer(
+    ctx,
+    buf,
+    jsonUnescape(str, len, buf)
+  );
+  if(buf != stackBuf) RedisModule_Free(buf);
+  return ret;
+}
+
+int replyWithResp3(RedisModuleCtx* ctx, JsonValue* val) {
+  switch(val->type) {
+    case OBJECT: {
+      struct JsonObject* object = &val->value.object;
+      RedisModule_ReplyWithMap(ctx, object->size);
+      for(size_t i = 0; i < object->size; i++) {
+        JsonKeyVal* keyVal = object->elements[i];
+        replyWithJsonString(ctx, keyData(keyVal), keyVal->keyLen);
+        replyWithResp3(ctx, keyVal->value);
+      }
+      return REDISMODULE_OK;
     }
-    case STRING: {
-      RedisModule_StringAppendBuffer(ctx, out, "\"", 1);
-      RedisModule_StringAppendBuffer(
+    case ARRAY: {
+      JsonArray* array = &val->value.array;
+      RedisModule_ReplyWithArray(ctx, array->size);
+      for(size_t i = 0; i < array->size; i++) {
+        replyWithResp3(ctx, array->array[i]);
+      }
+      return REDISMODULE_OK;
+    }
+    case DOUBLE:
+      return RedisModule_ReplyWithDouble(ctx, val->value.number);
+    case INTEGER:
+      return RedisModule_ReplyWithLongLong(ctx, val->value.integer);
+    case STRING:
+      return replyWithJsonString(
         ctx,
-        out,
         val->value.string.data,
         val->value.string.size
       );
-      RedisModule_StringAppendBuffer(ctx, out, "\"", 1);
-      break;
-    }
-    case BOOLEAN: {
-      bool isTrue = val->value.boolean;
-      RedisModule_StringAppendBuffer(
-        ctx,
-        out,
-        isTrue ? "true" : "false",
-        isTrue ? 4 : 5
-      );
-      break;
-    }
+    case BOOLEAN:
+      return RedisModule_ReplyWithBool(ctx, val->value.boolean);
     default:
-      break;
+      return RedisModule_ReplyWithNull(ctx);
   }
 }
-
-RedisModuleString* jsonToString(
-  RedisModuleCtx* ctx,
-  JsonValue* val
-) {
-  RedisModuleString* str = RedisModule_CreateString(ctx, "", 0);
-  valueToString(ctx, val, str);
-  return str;
-}
@@ -3,12 +3,68 @@
 #include "value.h"
 #include "redismodule.h"
 
+/*
+ * Parses exactly `len` bytes; the input does not need to be NUL
+ * terminated. The whole input is validated before anything is
+ * allocated and NULL is returned if it is not a single valid JSON
+ * value. Nodes are allocated from `arena`, or the heap when NULL.
+ */
 JsonValue* parseJson(
   RedisModuleCtx* ctx,
-  const char* json
+  const char* json,
+  size_t len,
+  JsonArena* arena
 );
 
-RedisModuleString* jsonToString(
+/*
+ * Same as parseJson but builds a tape, whatever the storage setting.
+ */
+struct JsonTape* parseTape(RedisModuleCtx* ctx, const char* json, size_t len);
+
+/*
+ * Same as parseJson but returns a new document: a tape when
+ * redisjson.storage is `tape`, otherwise a tree in an arena sized
+ * from the parse when redisjson.arena is enabled.
+ */
+RedisJsonValue* parseDocument(
   RedisModuleCtx* ctx,
-  JsonValue* val
+  const char* json,
+  size_t len
 );
+
+/*
+ * True when `key` can be stored as a member name as is: keys are kept
+ * in their escaped form, so it has to be a valid JSON string body.
+ */
+bool jsonValidKey(const char* key, size_t len);
+
+/*
+ * Upper bound of the serialized size, and the serializer itself,
+ * which returns the end of what it wrote.
+ */
+size_t jsonSerializedSize(JsonValue* val);
+char* jsonWrite(JsonValue* val, char* out);
+
+/*
+ * Serializes into one buffer allocated up front from a single sizing
+ * pass. Free with RedisModule_Free.
+ */
+char* jsonToBuffer(JsonValue* val, size_t* len);
+
+int replyWithJson(RedisModuleCtx* ctx, JsonValue* val);
+
+/*
+ * Decodes the escapes of a stored string or key into `out`, which
+ * needs `len` bytes as decoding never makes it longer, and returns
+ * the decoded length.
+ */
+size_t jsonUnescape(const char* str, size_t len, char* out);
+int replyWithJsonString(RedisModuleCtx* ctx, const char* str, size_t len);
+
+/*
+ * Replies with the value as native RESP3 types instead of JSON text:
+ * objects as maps, arrays as arrays, numbers, booleans and null as
+ * themselves and strings decoded. RESP2 clients get what the module
+ * API falls back to, flat arrays for maps and integers for booleans.
+ */
+int replyWithResp3(RedisModuleCtx* ctx, JsonValue* val);
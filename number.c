@@ -0,0 +1,479 @@
+#include "number.h"
+#include "redismodule.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define MAX_MANTISSA_DIGITS 19
+#define MAX_EXACT_MANTISSA (1ULL << 53)
+#define MAX_EXACT_POW10 22
+#define STACK_TOKEN_SIZE 128
+
+static const double exactPow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static const uint64_t intPow10[] = {
+  1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+  10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+  100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+  100000000000000ULL, 1000000000000000ULL
+};
+
+/*
+ * Clinger's fast path: both the mantissa and the power of ten are
+ * exact doubles, so a single IEEE multiply or divide rounds
+ * correctly. Exponents slightly above 22 still qualify when the
+ * surplus can be moved into the mantissa without losing exactness.
+ */
+static bool fastPath(uint64_t mantissa, int64_t exponent, double* out) {
+  if(mantissa > MAX_EXACT_MANTISSA) return false;
+  if(exponent < 0) {
+    if(exponent < -MAX_EXACT_POW10) return false;
+    *out = (double)mantissa / exactPow10[-exponent];
+    return true;
+  }
+  if(exponent > MAX_EXACT_POW10) {
+    int64_t surplus = exponent - MAX_EXACT_POW10;
+    if(surplus > 15) return false;
+    if(mantissa > MAX_EXACT_MANTISSA / intPow10[surplus]) return false;
+    mantissa *= intPow10[surplus];
+    exponent = MAX_EXACT_POW10;
+  }
+  *out = (double)mantissa * exactPow10[exponent];
+  return true;
+}
+
+static double slowPath(const char* p, size_t len) {
+  char stackBuf[STACK_TOKEN_SIZE];
+  char* buf = len < STACK_TOKEN_SIZE ? stackBuf : RedisModule_Alloc(len + 1);
+  memcpy(buf, p, len);
+  buf[len] = '\0';
+  double out = strtod(buf, NULL);
+  if(buf != stackBuf) RedisModule_Free(buf);
+  return out;
+}
+
+NumberKind parseNumber(
+  const char* p,
+  size_t len,
+  int64_t* integer,
+  double* number
+) {
+  const char* start = p;
+  const char* end = p + len;
+  bool negative = false;
+  if(*p == '-') {
+    negative = true;
+    ++p;
+  }
+
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int64_t exponent = 0;
+  bool truncated = false;
+  bool isInteger = true;
+
+  for(; p < end && *p >= '0' && *p <= '9'; p++) {
+    if(digits < MAX_MANTISSA_DIGITS) {
+      mantissa = mantissa * 10 + (*p - '0');
+      if(mantissa) ++digits;
+    } else {
+      ++exponent;
+      truncated |= *p != '0';
+    }
+  }
+  if(p < end && *p == '.') {
+    isInteger = false;
+    for(++p; p < end && *p >= '0' && *p <= '9'; p++) {
+      if(digits < MAX_MANTISSA_DIGITS) {
+        mantissa = mantissa * 10 + (*p - '0');
+        if(mantissa) ++digits;
+        --exponent;
+      } else {
+        truncated |= *p != '0';
+      }
+    }
+  }
+  if(p < end && (*p == 'e' || *p == 'E')) {
+    isInteger = false;
+    ++p;
+    bool negativeExp = *p == '-';
+    if(*p == '-' || *p == '+') ++p;
+    int64_t exp = 0;
+    for(; p < end; p++) {
+      if(exp < 100000) exp = exp * 10 + (*p - '0');
+    }
+    exponent += negativeExp ? -exp : exp;
+  }
+
+  if(isInteger && exponent == 0) {
+    if(negative && mantissa <= (uint64_t)INT64_MAX + 1) {
+      *integer = (int64_t)(0 - mantissa);
+      return NUMBER_INTEGER;
+    }
+    if(!negative && mantissa <= (uint64_t)INT64_MAX) {
+      *integer = (int64_t)mantissa;
+      return NUMBER_INTEGER;
+    }
+  }
+
+  double value;
+  if(mantissa == 0) {
+    value = 0;
+  } else if(truncated || !fastPath(mantissa, exponent, &value)) {
+    *number = slowPath(start, len);
+    return NUMBER_DOUBLE;
+  }
+  *number = negative ? -value : value;
+  return NUMBER_DOUBLE;
+}
+
+static const char digitPairs[] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+static const uint64_t digitThresholds[] = {
+  0ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+  10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+  100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+  100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+  100000000000000000ULL, 1000000000000000000ULL,
+  10000000000000000000ULL
+};
+
+/*
+ * floor(log10) estimated from the bit length (1233 / 4096 ~ log10(2))
+ * and corrected with one table compare.
+ */
+static inline int countDigits(uint64_t value) {
+  int bits = 64 - __builtin_clzll(value | 1);
+  int digits = (bits * 1233) >> 12;
+  return digits + (value >= digitThresholds[digits]);
+}
+
+static inline void writeDigits(uint64_t value, char* end) {
+  while(value >= 100) {
+    unsigned pair = (unsigned)(value % 100) * 2;
+    value /= 100;
+    end -= 2;
+    memcpy(end, digitPairs + pair, 2);
+  }
+  if(value >= 10) {
+    memcpy(end - 2, digitPairs + value * 2, 2);
+  } else {
+    end[-1] = (char)('0' + value);
+  }
+}
+
+size_t integerLength(int64_t value) {
+  uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+  return (value < 0) + countDigits(magnitude);
+}
+
+size_t formatInteger(int64_t value, char* out) {
+  uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+  size_t sign = value < 0;
+  out[0] = '-';
+  size_t len = sign + countDigits(magnitude);
+  writeDigits(magnitude, out + len);
+  return len;
+}
+
+/*
+ * Grisu2 (Florian Loitsch, "Printing Floating-Point Numbers Quickly
+ * and Accurately with Integers"), as popularised by RapidJSON.
+ */
+typedef struct {
+  uint64_t f;
+  int e;
+} DiyFp;
+
+#define DP_SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFULL
+#define DP_EXPONENT_MASK 0x7FF0000000000000ULL
+#define DP_HIDDEN_BIT 0x0010000000000000ULL
+#define DP_SIGNIFICAND_SIZE 52
+#define DP_EXPONENT_BIAS (0x3FF + DP_SIGNIFICAND_SIZE)
+#define DP_MIN_EXPONENT (-DP_EXPONENT_BIAS + 1)
+
+static const uint64_t cachedPowersF[] = {
+  0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+  0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+  0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+  0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+  0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+  0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+  0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+  0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+  0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+  0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+  0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+  0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+  0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+  0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+  0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+  0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+  0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+  0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+  0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+  0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+  0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+  0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+  0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+  0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+  0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+  0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+  0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+  0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+  0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL
+};
+
+static const int16_t cachedPowersE[] = {
+  -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+  -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+  -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+  -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+  -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+  109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+  375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+  641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+  907, 933, 960, 986, 1013, 1039, 1066
+};
+
+static DiyFp diyFpFromDouble(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  int biasedExponent = (int)((bits & DP_EXPONENT_MASK) >> DP_SIGNIFICAND_SIZE);
+  uint64_t significand = bits & DP_SIGNIFICAND_MASK;
+  DiyFp fp;
+  if(biasedExponent != 0) {
+    fp.f = significand + DP_HIDDEN_BIT;
+    fp.e = biasedExponent - DP_EXPONENT_BIAS;
+  } else {
+    fp.f = significand;
+    fp.e = DP_MIN_EXPONENT;
+  }
+  return fp;
+}
+
+static DiyFp diyFpNormalize(DiyFp fp) {
+  int shift = __builtin_clzll(fp.f);
+  fp.f <<= shift;
+  fp.e -= shift;
+  return fp;
+}
+
+static DiyFp diyFpMultiply(DiyFp a, DiyFp b) {
+  __uint128_t product = (__uint128_t)a.f * b.f;
+  uint64_t high = (uint64_t)(product >> 64);
+  uint64_t low = (uint64_t)product;
+  if(low & (1ULL << 63)) ++high;
+  DiyFp fp = { high, a.e + b.e + 64 };
+  return fp;
+}
+
+static void normalizedBoundaries(DiyFp v, DiyFp* minus, DiyFp* plus) {
+  DiyFp pl = { (v.f << 1) + 1, v.e - 1 };
+  while(!(pl.f & (DP_HIDDEN_BIT << 1))) {
+    pl.f <<= 1;
+    pl.e--;
+  }
+  pl.f <<= 64 - DP_SIGNIFICAND_SIZE - 2;
+  pl.e -= 64 - DP_SIGNIFICAND_SIZE - 2;
+
+  DiyFp mi;
+  if(v.f == DP_HIDDEN_BIT) {
+    mi.f = (v.f << 2) - 1;
+    mi.e = v.e - 2;
+  } else {
+    mi.f = (v.f << 1) - 1;
+    mi.e = v.e - 1;
+  }
+  mi.f <<= mi.e - pl.e;
+  mi.e = pl.e;
+  *minus = mi;
+  *plus = pl;
+}
+
+static DiyFp cachedPower(int e, int* k) {
+  double dk = (-61 - e) * 0.30102999566398114 + 347;
+  int ik = (int)dk;
+  if(dk - ik > 0.0) ++ik;
+  unsigned index = (unsigned)((ik >> 3) + 1);
+  *k = -(-348 + (int)(index << 3));
+  DiyFp fp = { cachedPowersF[index], cachedPowersE[index] };
+  return fp;
+}
+
+static void grisuRound(
+  char* buffer,
+  int len,
+  uint64_t delta,
+  uint64_t rest,
+  uint64_t tenKappa,
+  uint64_t wpw
+) {
+  while(
+    rest < wpw &&
+    delta - rest >= tenKappa &&
+    (rest + tenKappa < wpw || wpw - rest > rest + tenKappa - wpw)
+  ) {
+    buffer[len - 1]--;
+    rest += tenKappa;
+  }
+}
+
+static void digitGen(
+  DiyFp w,
+  DiyFp mp,
+  uint64_t delta,
+  char* buffer,
+  int* len,
+  int* k
+) {
+  DiyFp one = { 1ULL << -mp.e, mp.e };
+  uint64_t wpw = mp.f - w.f;
+  uint32_t p1 = (uint32_t)(mp.f >> -one.e);
+  uint64_t p2 = mp.f & (one.f - 1);
+  int kappa = countDigits(p1);
+  *len = 0;
+
+  while(kappa > 0) {
+    uint32_t divisor = (uint32_t)digitThresholds[kappa - 1];
+    uint32_t d = divisor ? p1 / divisor : p1;
+    p1 = divisor ? p1 % divisor : 0;
+    if(d || *len) buffer[(*len)++] = (char)('0' + d);
+    kappa--;
+    uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+    if(rest <= delta) {
+      *k += kappa;
+      grisuRound(
+        buffer,
+        *len,
+        delta,
+        rest,
+        (kappa ? digitThresholds[kappa] : 1) << -one.e,
+        wpw
+      );
+      return;
+    }
+  }
+
+  while(1) {
+    p2 *= 10;
+    delta *= 10;
+    char d = (char)(p2 >> -one.e);
+    if(d || *len) buffer[(*len)++] = (char)('0' + d);
+    p2 &= one.f - 1;
+    kappa--;
+    if(p2 < delta) {
+      *k += kappa;
+      int index = -kappa;
+      uint64_t scale = index < 20 ? (index ? digitThresholds[index] : 1) : 0;
+      grisuRound(buffer, *len, delta, p2, one.f, wpw * scale);
+      return;
+    }
+  }
+}
+
+static void grisu2(double value, char* buffer, int* len, int* k) {
+  DiyFp v = diyFpFromDouble(value);
+  DiyFp minus, plus;
+  normalizedBoundaries(v, &minus, &plus);
+
+  DiyFp cached = cachedPower(plus.e, k);
+  DiyFp w = diyFpMultiply(diyFpNormalize(v), cached);
+  DiyFp wp = diyFpMultiply(plus, cached);
+  DiyFp wm = diyFpMultiply(minus, cached);
+  wm.f++;
+  wp.f--;
+  digitGen(w, wp, wp.f - wm.f, buffer, len, k);
+}
+
+static size_t writeExponent(int k, char* out) {
+  char* p = out;
+  if(k < 0) {
+    *p++ = '-';
+    k = -k;
+  }
+  if(k >= 100) {
+    *p++ = (char)('0' + k / 100);
+    k %= 100;
+    memcpy(p, digitPairs + k * 2, 2);
+    p += 2;
+  } else if(k >= 10) {
+    memcpy(p, digitPairs + k * 2, 2);
+    p += 2;
+  } else {
+    *p++ = (char)('0' + k);
+  }
+  return p - out;
+}
+
+/*
+ * Lays out `len` significant digits scaled by 10^k the way
+ * JavaScript does: plain notation for 1e-6 <= |v| < 1e21,
+ * scientific notation otherwise.
+ */
+static size_t prettify(char* buffer, int len, int k) {
+  int kk = len + k;
+  if(k >= 0 && kk <= 21) {
+    memset(buffer + len, '0', kk - len);
+    buffer[kk] = '.';
+    buffer[kk + 1] = '0';
+    return kk + 2;
+  }
+  if(kk > 0 && kk <= 21) {
+    memmove(buffer + kk + 1, buffer + kk, len - kk);
+    buffer[kk] = '.';
+    return len + 1;
+  }
+  if(kk > -6 && kk <= 0) {
+    int offset = 2 - kk;
+    memmove(buffer + offset, buffer, len);
+    buffer[0] = '0';
+    buffer[1] = '.';
+    memset(buffer + 2, '0', offset - 2);
+    return len + offset;
+  }
+  if(len == 1) {
+    buffer[1] = 'e';
+    return 2 + writeExponent(kk - 1, buffer + 2);
+  }
+  memmove(buffer + 2, buffer + 1, len - 1);
+  buffer[1] = '.';
+  buffer[len + 1] = 'e';
+  return len + 2 + writeExponent(kk - 1, buffer + len + 2);
+}
+
+size_t formatDouble(double value, char* out) {
+  if(isnan(value)) {
+    memcpy(out, "null", 4);
+    return 4;
+  }
+  size_t sign = signbit(value) ? 1 : 0;
+  out[0] = '-';
+  if(isinf(value)) {
+    /* Out of range input such as 1e400 reads back as infinity. */
+    memcpy(out + sign, "1e999", 5);
+    return sign + 5;
+  }
+  if(value == 0) {
+    memcpy(out + sign, "0.0", 3);
+    return sign + 3;
+  }
+
+  int len, k;
+  grisu2(sign ? -value : value, out + sign, &len, &k);
+  return sign + prettify(out + sign, len, k);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+  NUMBER_INTEGER,
+  NUMBER_DOUBLE
+} NumberKind;
+
+/*
+ * Converts a validated JSON number token. Tokens without a fraction
+ * or exponent that fit in an int64_t are returned exactly as
+ * integers; everything else is returned as the correctly rounded
+ * double.
+ */
+NumberKind parseNumber(
+  const char* p,
+  size_t len,
+  int64_t* integer,
+  double* number
+);
+
+/*
+ * Large enough for any output of formatInteger or formatDouble.
+ */
+#define NUMBER_BUF_SIZE 32
+
+/*
+ * Both write the textual form into `out` (not NUL terminated) and
+ * return the number of bytes written.
+ */
+size_t formatInteger(int64_t value, char* out);
+
+size_t integerLength(int64_t value);
+
+/*
+ * Shortest decimal that parses back to the same double (Grisu2).
+ * Always contains a '.' or an exponent so it reads back as a DOUBLE.
+ */
+size_t formatDouble(double value, char* out);
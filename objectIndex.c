@@ -0,0 +1,63 @@
+#include "objectIndex.h"
+#include "value.h"
+#include "redismodule.h"
+#include <string.h>
+
+static inline uint64_t mix(uint64_t h, uint64_t word) {
+  h = (h ^ word) * 0xbf58476d1ce4e5b9ULL;
+  return h ^ (h >> 31);
+}
+
+/*
+ * Eight bytes per multiply; keys are mostly shorter than that.
+ */
+uint32_t hashKey(const char* key, size_t len) {
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+  while(len >= 8) {
+    uint64_t word;
+    memcpy(&word, key, 8);
+    h = mix(h, word);
+    key += 8;
+    len -= 8;
+  }
+  if(len) {
+    uint64_t word = 0;
+    memcpy(&word, key, len);
+    h = mix(h, word);
+  }
+  h ^= h >> 29;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 32;
+  return (uint32_t)h;
+}
+
+static size_t slotCount(size_t size) {
+  size_t count = 8;
+  while(count * 3 < size * 4) count *= 2;
+  return count;
+}
+
+ObjectIndex* objectIndexNew(JsonArena* arena, size_t size) {
+  size_t count = slotCount(size);
+  size_t bytes = sizeof(ObjectIndex) + count * sizeof(IndexSlot);
+  ObjectIndex* index = jsonAlloc(arena, bytes);
+  index->mask = count - 1;
+  index->used = 0;
+  return index;
+}
+
+size_t objectIndexBytes(const ObjectIndex* index) {
+  return sizeof(ObjectIndex) + ((size_t)index->mask + 1) * sizeof(IndexSlot);
+}
+
+void objectIndexFree(JsonArena* arena, ObjectIndex* index) {
+  if(index) jsonFree(arena, index, objectIndexBytes(index));
+}
+
+void objectIndexAdd(ObjectIndex* index, uint32_t hash, size_t pos) {
+  uint32_t slot = hash & index->mask;
+  while(index->slots[slot].pos) slot = (slot + 1) & index->mask;
+  index->slots[slot].hash = hash;
+  index->slots[slot].pos = (uint32_t)pos + 1;
+  ++index->used;
+}
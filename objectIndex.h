@@ -0,0 +1,58 @@
+#pragma once
+
+#include "arena.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Open addressing table from key hash to member position, kept next
+ * to the members of a wide object so lookups do not have to compare
+ * every key. The members themselves stay in insertion order.
+ */
+typedef struct {
+  uint32_t hash;
+  uint32_t pos;
+} IndexSlot;
+
+typedef struct ObjectIndex {
+  uint32_t mask;
+  uint32_t used;
+  IndexSlot slots[];
+} ObjectIndex;
+
+uint32_t hashKey(const char* key, size_t len);
+
+/*
+ * Empty index with room for `size` members. Allocated from `arena`,
+ * or the heap when NULL.
+ */
+ObjectIndex* objectIndexNew(JsonArena* arena, size_t size);
+void objectIndexFree(JsonArena* arena, ObjectIndex* index);
+size_t objectIndexBytes(const ObjectIndex* index);
+
+/*
+ * True when `used` more members still keep the load under 3/4.
+ */
+static inline int objectIndexFits(const ObjectIndex* index, size_t used) {
+  return (uint64_t)used * 4 <= ((uint64_t)index->mask + 1) * 3;
+}
+
+void objectIndexAdd(ObjectIndex* index, uint32_t hash, size_t pos);
+
+/*
+ * Walks the positions whose key hashes to `hash`, starting from
+ * `*slot = hash & mask`; returns SIZE_MAX once the probe ends.
+ * Candidates still have to be compared with the key.
+ */
+static inline size_t objectIndexNext(
+  const ObjectIndex* index,
+  uint32_t hash,
+  uint32_t* slot
+) {
+  while(1) {
+    IndexSlot s = index->slots[*slot];
+    *slot = (*slot + 1) & index->mask;
+    if(!s.pos) return SIZE_MAX;
+    if(s.hash == hash) return s.pos - 1;
+  }
+}
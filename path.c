@@ -1,19 +1,8 @@
 #include "path.h"
+#include "number.h"
+#include "descentIndex.h"
+#include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
-
-typedef enum {
-  CSNONE = 0,
-  CSOBJECT = 1,
-  CSARRAY = 2,
-  CSRDESCENT = 3
-} CharState;
-
-typedef union {
-  size_t index;
-  const char* key;
-  CharState sstate;
-} Path;
 
 void vecNew(Vector* v, size_t cap, size_t elemSize) {
   v->cap = cap;
@@ -39,6 +28,7 @@ void vecPush(Vector* v, void* value) {
 void vecDel(Vector* v) {
   if(!v) return;
   RedisModule_Free(v->data);
+  v->data = NULL;
 }
 
 void vecClear(Vector* v) {
@@ -48,197 +38,1388 @@ void vecClear(Vector* v) {
   vecNew(v, 1, v->elemSize);
 }
 
-typedef enum {
-  START,
-  ROOT,
-  DOT,
-  WORD,
-  SBRACKET,
-  NUMBER
-} State;
+/* Compiler */
+
+/*
+ * Parentheses and `!` nest the compiler's own recursion, so they are
+ * bounded separately from the value stack.
+ */
+#define FILTER_MAX_NESTING 64
+
+typedef struct {
+  const char* p;
+  const char* end;
+  Vector code;
+  Vector keys;
+  Vector numbers;
+  Vector pool;
+  int stack;
+  int nesting;
+  bool error;
+} PathCompiler;
+
+static inline void emit(PathCompiler* c, int32_t word) {
+  vecPush(&c->code, &word);
+}
+
+static inline bool atEnd(PathCompiler* c) {
+  return c->p >= c->end;
+}
+
+static inline char peek(PathCompiler* c) {
+  return atEnd(c) ? '\0' : *c->p;
+}
+
+static void skipSpace(PathCompiler* c) {
+  while(!atEnd(c) && (*c->p == ' ' || *c->p == '\t' || *c->p == '\n' || *c->p == '\r')) {
+    ++c->p;
+  }
+}
+
+static bool expect(PathCompiler* c, char ch) {
+  skipSpace(c);
+  if(peek(c) != ch) {
+    c->error = true;
+    return false;
+  }
+  ++c->p;
+  return true;
+}
 
-char* _strdup(const char *str1, size_t len) {
-  char* str2 = RedisModule_Calloc(len + 1, sizeof(char));
-  if (str2)
-    memcpy(str2, str1, len);
-  return str2;
+static bool isNameChar(char ch) {
+  switch(ch) {
+    case '.': case '[': case ']': case '(': case ')':
+    case '<': case '>': case '=': case '!': case '&': case '|':
+    case ',': case '\'': case '"': case ' ': case '\t':
+    case '\n': case '\r':
+      return false;
+    default:
+      return true;
+  }
 }
 
-Vector* recursiveSearch(
-  JsonValue* val,
-  const char* key,
-  Vector* vals) {
-  if(val->type == OBJECT) {
-    struct JsonObject object = val->value.object;
-    for(size_t i = 0; i < object.size; i++) {
-      JsonKeyVal* keyVal = object.elements[i];
-      if(!strcmp(keyVal->key, key)) {
-        vecPush(vals, &keyVal->value);
+/*
+ * Keys are kept escaped, as the document stores them; only `\'`,
+ * which JSON does not have, is turned back into a quote.
+ */
+static int32_t addKey(PathCompiler* c, const char* key, size_t len, bool quoted) {
+  PathKey entry;
+  entry.offset = (uint32_t)c->pool.len;
+  for(size_t i = 0; i < len; i++) {
+    char ch = key[i];
+    if(quoted && ch == '\\' && i + 1 < len) {
+      if(key[i + 1] == '\'') {
+        ch = '\'';
+      } else {
+        vecPush(&c->pool, &ch);
+        ch = key[i + 1];
       }
-      vals = recursiveSearch(keyVal->value, key, vals);
+      ++i;
     }
-  } else if(val->type == ARRAY) {
-    JsonArray array = val->value.array;
-    for(size_t i = 0; i < array.size; i++) {
-      vals = recursiveSearch(array.array[i], key, vals);
+    vecPush(&c->pool, &ch);
+  }
+  entry.len = (uint32_t)c->pool.len - entry.offset;
+  entry.hash = 0;
+  vecPush(&c->keys, &entry);
+  return (int32_t)c->keys.len - 1;
+}
+
+static int32_t compileName(PathCompiler* c) {
+  const char* start = c->p;
+  while(!atEnd(c) && isNameChar(*c->p)) ++c->p;
+  if(c->p == start) {
+    c->error = true;
+    return 0;
+  }
+  return addKey(c, start, c->p - start, false);
+}
+
+static int32_t compileQuoted(PathCompiler* c) {
+  char quote = *c->p++;
+  const char* start = c->p;
+  while(!atEnd(c) && *c->p != quote) {
+    if(*c->p == '\\') ++c->p;
+    ++c->p;
+  }
+  if(atEnd(c)) {
+    c->error = true;
+    return 0;
+  }
+  int32_t key = addKey(c, start, c->p - start, true);
+  ++c->p;
+  return key;
+}
+
+static bool compileInteger(PathCompiler* c, int32_t* out) {
+  skipSpace(c);
+  bool negative = peek(c) == '-';
+  if(negative) ++c->p;
+  if(peek(c) < '0' || peek(c) > '9') {
+    if(negative) c->error = true;
+    return false;
+  }
+  int64_t value = 0;
+  while(peek(c) >= '0' && peek(c) <= '9') {
+    value = value * 10 + (*c->p++ - '0');
+    if(value > INT32_MAX) {
+      c->error = true;
+      return false;
     }
   }
-  return vals;
+  *out = (int32_t)(negative ? -value : value);
+  return true;
 }
 
-JsonValue* evalPath(
-  RedisModuleCtx* ctx,
-  JsonValue* value,
-  RedisModuleString* path
+/*
+ * One selector inside brackets, written to `sel` in the encoding of
+ * the matching op.
+ */
+static void compileSelector(PathCompiler* c, Vector* sel) {
+  int32_t words[5];
+  size_t count = 0;
+  skipSpace(c);
+  char ch = peek(c);
+  if(ch == '*') {
+    ++c->p;
+    words[count++] = SEL_WILDCARD;
+  } else if(ch == '\'' || ch == '"') {
+    words[count++] = SEL_KEY;
+    words[count++] = compileQuoted(c);
+  } else {
+    int32_t start = 0, end = 0, step = 1;
+    bool hasStart = compileInteger(c, &start);
+    skipSpace(c);
+    if(peek(c) == ':') {
+      ++c->p;
+      bool hasEnd = compileInteger(c, &end);
+      skipSpace(c);
+      if(peek(c) == ':') {
+        ++c->p;
+        compileInteger(c, &step);
+      }
+      words[count++] = SEL_SLICE;
+      words[count++] = (hasStart ? SLICE_HAS_START : 0) | (hasEnd ? SLICE_HAS_END : 0);
+      words[count++] = start;
+      words[count++] = end;
+      words[count++] = step;
+    } else if(hasStart) {
+      words[count++] = SEL_INDEX;
+      words[count++] = start;
+    } else {
+      c->error = true;
+      return;
+    }
+  }
+  for(size_t i = 0; i < count; i++) vecPush(sel, &words[i]);
+}
+
+static bool push(PathCompiler* c) {
+  if(++c->stack > FILTER_MAX_STACK) c->error = true;
+  return !c->error;
+}
+
+static void compileOr(PathCompiler* c);
+
+/*
+ * `@` or `$` followed by names and indexes only, so it names at most
+ * one value.
+ */
+static void compileSingular(PathCompiler* c, int32_t op) {
+  Vector* code = &c->code;
+  emit(c, op);
+  size_t countAt = code->len;
+  emit(c, 0);
+  int32_t count = 0;
+  for(;;) {
+    if(peek(c) == '.') {
+      ++c->p;
+      emit(c, SEL_KEY);
+      emit(c, compileName(c));
+    } else if(peek(c) == '[') {
+      ++c->p;
+      skipSpace(c);
+      int32_t index;
+      if(peek(c) == '\'' || peek(c) == '"') {
+        emit(c, SEL_KEY);
+        emit(c, compileQuoted(c));
+      } else if(compileInteger(c, &index)) {
+        emit(c, SEL_INDEX);
+        emit(c, index);
+      } else {
+        c->error = true;
+      }
+      expect(c, ']');
+    } else {
+      break;
+    }
+    if(c->error) return;
+    ++count;
+  }
+  ((int32_t*)code->data)[countAt] = count;
+}
+
+static void compileNumber(PathCompiler* c) {
+  const char* start = c->p;
+  if(peek(c) == '-') ++c->p;
+  const char* digits = c->p;
+  while(peek(c) >= '0' && peek(c) <= '9') ++c->p;
+  if(c->p == digits) {
+    c->error = true;
+    return;
+  }
+  if(peek(c) == '.') {
+    ++c->p;
+    digits = c->p;
+    while(peek(c) >= '0' && peek(c) <= '9') ++c->p;
+    if(c->p == digits) {
+      c->error = true;
+      return;
+    }
+  }
+  if(peek(c) == 'e' || peek(c) == 'E') {
+    ++c->p;
+    if(peek(c) == '+' || peek(c) == '-') ++c->p;
+    digits = c->p;
+    while(peek(c) >= '0' && peek(c) <= '9') ++c->p;
+    if(c->p == digits) {
+      c->error = true;
+      return;
+    }
+  }
+  PathNumber number;
+  number.isInteger = parseNumber(
+    start,
+    c->p - start,
+    &number.integer,
+    &number.number
+  ) == NUMBER_INTEGER;
+  vecPush(&c->numbers, &number);
+  emit(c, EX_NUM);
+  emit(c, (int32_t)c->numbers.len - 1);
+}
+
+static bool acceptWord(PathCompiler* c, const char* word) {
+  size_t len = strlen(word);
+  if((size_t)(c->end - c->p) < len || memcmp(c->p, word, len)) return false;
+  if(c->p + len < c->end && isNameChar(c->p[len])) return false;
+  c->p += len;
+  return true;
+}
+
+static void compilePrimary(PathCompiler* c) {
+  skipSpace(c);
+  char ch = peek(c);
+  if(ch == '(') {
+    ++c->p;
+    if(++c->nesting > FILTER_MAX_NESTING) {
+      c->error = true;
+      return;
+    }
+    compileOr(c);
+    --c->nesting;
+    expect(c, ')');
+    return;
+  }
+  if(!push(c)) return;
+  if(ch == '@' || ch == '$') {
+    ++c->p;
+    compileSingular(c, ch == '@' ? EX_REL : EX_ROOT);
+  } else if(ch == '\'' || ch == '"') {
+    emit(c, EX_STR);
+    emit(c, compileQuoted(c));
+  } else if(ch == '-' || (ch >= '0' && ch <= '9')) {
+    compileNumber(c);
+  } else if(acceptWord(c, "true")) {
+    emit(c, EX_TRUE);
+  } else if(acceptWord(c, "false")) {
+    emit(c, EX_FALSE);
+  } else if(acceptWord(c, "null")) {
+    emit(c, EX_NULL);
+  } else {
+    c->error = true;
+  }
+}
+
+static int32_t compileCompareOp(PathCompiler* c) {
+  skipSpace(c);
+  if(c->end - c->p >= 2) {
+    if(!memcmp(c->p, "==", 2)) { c->p += 2; return EX_EQ; }
+    if(!memcmp(c->p, "!=", 2)) { c->p += 2; return EX_NE; }
+    if(!memcmp(c->p, "<=", 2)) { c->p += 2; return EX_LE; }
+    if(!memcmp(c->p, ">=", 2)) { c->p += 2; return EX_GE; }
+  }
+  if(peek(c) == '<') { ++c->p; return EX_LT; }
+  if(peek(c) == '>') { ++c->p; return EX_GT; }
+  return -1;
+}
+
+static void compileUnary(PathCompiler* c) {
+  skipSpace(c);
+  if(peek(c) == '!') {
+    ++c->p;
+    if(++c->nesting > FILTER_MAX_NESTING) {
+      c->error = true;
+      return;
+    }
+    compileUnary(c);
+    --c->nesting;
+    emit(c, EX_NOT);
+    return;
+  }
+  compilePrimary(c);
+  if(c->error) return;
+  int32_t op = compileCompareOp(c);
+  if(op < 0) return;
+  compilePrimary(c);
+  emit(c, op);
+  --c->stack;
+}
+
+static void compileAnd(PathCompiler* c) {
+  compileUnary(c);
+  for(;;) {
+    skipSpace(c);
+    if(c->error || c->end - c->p < 2 || memcmp(c->p, "&&", 2)) return;
+    c->p += 2;
+    compileUnary(c);
+    emit(c, EX_AND);
+    --c->stack;
+  }
+}
+
+static void compileOr(PathCompiler* c) {
+  compileAnd(c);
+  for(;;) {
+    skipSpace(c);
+    if(c->error || c->end - c->p < 2 || memcmp(c->p, "||", 2)) return;
+    c->p += 2;
+    compileAnd(c);
+    emit(c, EX_OR);
+    --c->stack;
+  }
+}
+
+static Vector scratchSelectors;
+
+static void compileBracket(PathCompiler* c) {
+  ++c->p;
+  skipSpace(c);
+  if(peek(c) == '?') {
+    ++c->p;
+    emit(c, OP_FILTER);
+    size_t lenAt = c->code.len;
+    emit(c, 0);
+    c->stack = 0;
+    c->nesting = 0;
+    compileOr(c);
+    ((int32_t*)c->code.data)[lenAt] = (int32_t)(c->code.len - lenAt - 1);
+    expect(c, ']');
+    return;
+  }
+
+  if(!scratchSelectors.data) vecNew(&scratchSelectors, 16, sizeof(int32_t));
+  scratchSelectors.len = 0;
+  int32_t count = 0;
+  for(;;) {
+    compileSelector(c, &scratchSelectors);
+    ++count;
+    skipSpace(c);
+    if(c->error || peek(c) != ',') break;
+    ++c->p;
+  }
+  if(!expect(c, ']')) return;
+
+  if(count > 1) {
+    emit(c, OP_UNION);
+    emit(c, count);
+  }
+  int32_t* words = scratchSelectors.data;
+  for(size_t i = 0; i < scratchSelectors.len; i++) emit(c, words[i]);
+}
+
+static void compileSegments(PathCompiler* c) {
+  if(peek(c) == '$') {
+    ++c->p;
+  } else if(!atEnd(c) && peek(c) != '.' && peek(c) != '[') {
+    emit(c, OP_KEY);
+    emit(c, compileName(c));
+  }
+  while(!atEnd(c) && !c->error) {
+    char ch = *c->p;
+    if(ch == '[') {
+      compileBracket(c);
+    } else if(ch == '.') {
+      ++c->p;
+      if(peek(c) == '.') {
+        ++c->p;
+        emit(c, OP_DESCEND);
+        if(peek(c) == '[') {
+          compileBracket(c);
+          continue;
+        }
+      }
+      if(peek(c) == '*') {
+        ++c->p;
+        emit(c, OP_WILDCARD);
+      } else {
+        emit(c, OP_KEY);
+        emit(c, compileName(c));
+      }
+    } else {
+      c->error = true;
+    }
+  }
+}
+
+/*
+ * The compiler's buffers are kept between calls and copied into the
+ * compiled path, so compiling allocates exactly once.
+ */
+static PathCompiler scratchCompiler;
+
+static void resetBuffer(Vector* v, size_t elemSize) {
+  if(v->data && v->cap > 4096) vecDel(v);
+  if(!v->data) vecNew(v, 16, elemSize);
+  v->len = 0;
+}
+
+CompiledPath* compilePath(const char* cpath, size_t clen) {
+  PathCompiler c = scratchCompiler;
+  resetBuffer(&c.code, sizeof(int32_t));
+  resetBuffer(&c.keys, sizeof(PathKey));
+  resetBuffer(&c.numbers, sizeof(PathNumber));
+  resetBuffer(&c.pool, sizeof(char));
+  c.p = cpath;
+  c.end = cpath + clen;
+  c.stack = 0;
+  c.nesting = 0;
+  c.error = false;
+  compileSegments(&c);
+  scratchCompiler = c;
+  if(scratchSelectors.cap > 4096) vecDel(&scratchSelectors);
+  if(c.error) return NULL;
+
+  /* Numbers first, as they need the strictest alignment. */
+  size_t numbersBytes = c.numbers.len * sizeof(PathNumber);
+  size_t codeBytes = c.code.len * sizeof(int32_t);
+  size_t keysBytes = c.keys.len * sizeof(PathKey);
+  CompiledPath* compiled = RedisModule_Calloc(
+    1,
+    sizeof(CompiledPath) + numbersBytes + codeBytes + keysBytes + c.pool.len + clen
+  );
+  char* at = (char*)(compiled + 1);
+  compiled->numbers = (PathNumber*)at;
+  memcpy(at, c.numbers.data, numbersBytes);
+  at += numbersBytes;
+  compiled->code = (int32_t*)at;
+  compiled->codeLen = c.code.len;
+  memcpy(at, c.code.data, codeBytes);
+  at += codeBytes;
+  compiled->keys = (PathKey*)at;
+  memcpy(at, c.keys.data, keysBytes);
+  at += keysBytes;
+  compiled->pool = at;
+  memcpy(at, c.pool.data, c.pool.len);
+  at += c.pool.len;
+  compiled->source = at;
+  compiled->sourceLen = clen;
+  memcpy(at, cpath, clen);
+  for(size_t i = 0; i < c.keys.len; i++) {
+    PathKey* key = &compiled->keys[i];
+    key->hash = hashKey(compiled->pool + key->offset, key->len);
+  }
+  return compiled;
+}
+
+void freeCompiledPath(CompiledPath* path) {
+  RedisModule_Free(path);
+}
+
+/* Evaluation */
+
+/*
+ * A JsonValue pointer when evaluating a tree, a word index when
+ * evaluating a tape.
+ */
+typedef uintptr_t PathNode;
+
+#define NODE_NONE UINTPTR_MAX
+
+typedef struct {
+  RedisJsonValue* doc;
+  const JsonTape* tape;
+  PathNode root;
+  const CompiledPath* path;
+} PathDoc;
+
+static inline JsonValueType nodeType(const PathDoc* doc, PathNode node) {
+  if(doc->tape) return tapeType(doc->tape, node);
+  return ((JsonValue*)node)->type;
+}
+
+static inline size_t nodeSize(const PathDoc* doc, PathNode node) {
+  if(doc->tape) return tapeSize(doc->tape, node);
+  JsonValue* value = (JsonValue*)node;
+  return value->type == OBJECT ? value->value.object.size : value->value.array.size;
+}
+
+static PathNode nodeMember(const PathDoc* doc, PathNode node, int32_t k) {
+  const PathKey* key = &doc->path->keys[k];
+  const char* bytes = doc->path->pool + key->offset;
+  if(doc->tape) {
+    size_t at = tapeFindKey(doc->tape, node, bytes, key->len);
+    return at == TAPE_NONE ? NODE_NONE : at;
+  }
+  JsonValue* value = (JsonValue*)node;
+  if(value->type != OBJECT) return NODE_NONE;
+  struct JsonObject* object = &value->value.object;
+  size_t pos = objectFindHashed(object, bytes, key->len, key->hash);
+  return pos == OBJECT_NONE ? NODE_NONE : (PathNode)object->elements[pos]->value;
+}
+
+static PathNode nodeElement(const PathDoc* doc, PathNode node, int64_t index) {
+  if(nodeType(doc, node) != ARRAY) return NODE_NONE;
+  if(index < 0) {
+    index += nodeSize(doc, node);
+    if(index < 0) return NODE_NONE;
+  }
+  if(doc->tape) {
+    size_t at = tapeArrayAt(doc->tape, node, index);
+    return at == TAPE_NONE ? NODE_NONE : at;
+  }
+  JsonArray* array = &((JsonValue*)node)->value.array;
+  return (size_t)index < array->size ? (PathNode)array->array[index] : NODE_NONE;
+}
+
+typedef struct {
+  PathNode node;
+  bool object;
+  size_t pos;
+  size_t end;
+} ChildIter;
+
+static inline void childBegin(const PathDoc* doc, PathNode node, ChildIter* it) {
+  JsonValueType type = nodeType(doc, node);
+  it->node = node;
+  it->object = type == OBJECT;
+  it->pos = it->end = 0;
+  if(type != OBJECT && type != ARRAY) return;
+  if(doc->tape) {
+    it->pos = node + 1;
+    it->end = tapeNext(doc->tape, node);
+  } else {
+    it->end = nodeSize(doc, node);
+  }
+}
+
+static inline bool childNext(const PathDoc* doc, ChildIter* it, PathNode* out) {
+  if(it->pos >= it->end) return false;
+  if(doc->tape) {
+    if(it->object) ++it->pos;
+    *out = it->pos;
+    it->pos = tapeNext(doc->tape, it->pos);
+  } else {
+    JsonValue* value = (JsonValue*)it->node;
+    *out = it->object ?
+      (PathNode)value->value.object.elements[it->pos]->value :
+      (PathNode)value->value.array.array[it->pos];
+    ++it->pos;
+  }
+  return true;
+}
+
+/*
+ * Scratch space kept between evaluations, so a warm evaluation does
+ * not allocate: the set being built, the explicit stack of a tree
+ * descent and the elements of a tape array being sliced backwards.
+ */
+static Vector scratchNext;
+static Vector scratchStack;
+static Vector scratchElements;
+
+#define SCRATCH_RETAIN 4096
+
+static void prepare(Vector* v) {
+  if(!v->data) vecNew(v, 16, sizeof(PathNode));
+  v->len = 0;
+}
+
+static void release(Vector* v) {
+  if(v->data && v->cap > SCRATCH_RETAIN) vecDel(v);
+}
+
+static void swapVec(Vector* a, Vector* b) {
+  Vector tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+static void applySlice(
+  const PathDoc* doc,
+  PathNode node,
+  const int32_t* operands,
+  Vector* out
+) {
+  int64_t step = operands[3];
+  if(step == 0 || nodeType(doc, node) != ARRAY) return;
+  int64_t size = nodeSize(doc, node);
+  bool hasStart = operands[0] & SLICE_HAS_START;
+  bool hasEnd = operands[0] & SLICE_HAS_END;
+  int64_t start = operands[1];
+  int64_t end = operands[2];
+  if(start < 0) start += size;
+  if(end < 0) end += size;
+
+  if(step > 0) {
+    start = !hasStart || start < 0 ? 0 : start > size ? size : start;
+    end = !hasEnd ? size : end < 0 ? 0 : end > size ? size : end;
+    ChildIter it;
+    PathNode child;
+    childBegin(doc, node, &it);
+    for(int64_t i = 0; i < end && childNext(doc, &it, &child); i++) {
+      if(i >= start && (i - start) % step == 0) vecPush(out, &child);
+    }
+    return;
+  }
+
+  start = !hasStart || start >= size ? size - 1 : start < -1 ? -1 : start;
+  end = !hasEnd || end < -1 ? -1 : end >= size ? size - 1 : end;
+  if(start <= end) return;
+  PathNode* elements;
+  if(doc->tape) {
+    prepare(&scratchElements);
+    ChildIter it;
+    PathNode child;
+    childBegin(doc, node, &it);
+    while(childNext(doc, &it, &child)) vecPush(&scratchElements, &child);
+    elements = scratchElements.data;
+  } else {
+    elements = (PathNode*)((JsonValue*)node)->value.array.array;
+  }
+  for(int64_t i = start; i > end; i += step) vecPush(out, &elements[i]);
+}
+
+static size_t selectorWidth(int32_t kind) {
+  switch(kind) {
+    case SEL_KEY:
+    case SEL_INDEX:
+      return 2;
+    case SEL_SLICE:
+      return 5;
+    default:
+      return 1;
+  }
+}
+
+static void applySelector(
+  const PathDoc* doc,
+  PathNode node,
+  const int32_t* sel,
+  Vector* out
+) {
+  PathNode found = NODE_NONE;
+  switch(sel[0]) {
+    case SEL_KEY:
+      found = nodeMember(doc, node, sel[1]);
+      break;
+    case SEL_INDEX:
+      found = nodeElement(doc, node, sel[1]);
+      break;
+    case SEL_SLICE:
+      applySlice(doc, node, sel + 1, out);
+      break;
+    case SEL_WILDCARD: {
+      ChildIter it;
+      PathNode child;
+      childBegin(doc, node, &it);
+      while(childNext(doc, &it, &child)) vecPush(out, &child);
+      break;
+    }
+  }
+  if(found != NODE_NONE) vecPush(out, &found);
+}
+
+/*
+ * The node and everything below it, in document order. A tape
+ * already is in that order, so it is a scan past the key words.
+ */
+static void descend(const PathDoc* doc, PathNode node, Vector* out) {
+  if(doc->tape) {
+    size_t end = tapeNext(doc->tape, node);
+    for(size_t i = node; i < end;) {
+      char tag = tapeTag(doc->tape, i);
+      if(tag == 'k') {
+        ++i;
+        continue;
+      }
+      PathNode at = i;
+      vecPush(out, &at);
+      i = tag == '{' || tag == '[' ? i + 1 : tapeNext(doc->tape, i);
+    }
+    return;
+  }
+
+  prepare(&scratchStack);
+  vecPush(&scratchStack, &node);
+  while(scratchStack.len) {
+    PathNode top = ((PathNode*)scratchStack.data)[--scratchStack.len];
+    vecPush(out, &top);
+    JsonValue* value = (JsonValue*)top;
+    if(value->type == OBJECT) {
+      struct JsonObject* object = &value->value.object;
+      for(size_t i = object->size; i > 0; i--) {
+        vecPush(&scratchStack, &object->elements[i - 1]->value);
+      }
+    } else if(value->type == ARRAY) {
+      JsonArray* array = &value->value.array;
+      for(size_t i = array->size; i > 0; i--) {
+        vecPush(&scratchStack, &array->array[i - 1]);
+      }
+    }
+  }
+}
+
+/*
+ * `..key` from the descent index: the members named `key` whose
+ * object lies inside each node. On a tape that is a range of word
+ * indexes, found by binary search; a tree has no such order, so only
+ * a descent from the root is answered. Returns false to fall back to
+ * walking the nodes.
+ */
+static bool descendIndexed(
+  const PathDoc* doc,
+  const PathNode* nodes,
+  size_t count,
+  int32_t k,
+  Vector* out
+) {
+  if(!doc->tape && (count != 1 || nodes[0] != doc->root)) return false;
+  const DescentIndex* index = descentIndexGet(doc->doc);
+  if(!index) return false;
+
+  const PathKey* key = &doc->path->keys[k];
+  size_t found;
+  const DescentEntry* entries = descentIndexFind(
+    index,
+    doc->path->pool + key->offset,
+    key->len,
+    key->hash,
+    &found
+  );
+  for(size_t j = 0; j < count; j++) {
+    size_t lo = 0, hi = found;
+    if(doc->tape) {
+      size_t end = tapeNext(doc->tape, nodes[j]);
+      while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(entries[mid].parent < nodes[j]) lo = mid + 1; else hi = mid;
+      }
+      hi = lo;
+      while(hi < found && entries[hi].parent < end) ++hi;
+    }
+    for(size_t i = lo; i < hi; i++) vecPush(out, (void*)&entries[i].value);
+  }
+  return true;
+}
+
+/* Filters */
+
+typedef enum {
+  FV_NOTHING,
+  FV_NODE,
+  FV_INT,
+  FV_DOUBLE,
+  FV_STR,
+  FV_BOOL,
+  FV_NULL
+} FilterKind;
+
+/*
+ * `fromPath` marks values read through `@` or `$`: on their own they
+ * test for existence rather than truth.
+ */
+typedef struct {
+  FilterKind kind;
+  bool fromPath;
+  union {
+    int64_t integer;
+    double number;
+    bool boolean;
+    struct {
+      const char* data;
+      size_t len;
+    } str;
+  } v;
+} FilterValue;
+
+static void nodeValue(const PathDoc* doc, PathNode node, FilterValue* out) {
+  out->fromPath = true;
+  if(node == NODE_NONE) {
+    out->kind = FV_NOTHING;
+    return;
+  }
+  JsonValueType type = nodeType(doc, node);
+  JsonValue* value = doc->tape ? NULL : (JsonValue*)node;
+  switch(type) {
+    case INTEGER:
+      out->kind = FV_INT;
+      out->v.integer = value ? value->value.integer : tapeInteger(doc->tape, node);
+      break;
+    case DOUBLE:
+      out->kind = FV_DOUBLE;
+      out->v.number = value ? value->value.number : tapeDouble(doc->tape, node);
+      break;
+    case STRING:
+      out->kind = FV_STR;
+      if(value) {
+        out->v.str.data = value->value.string.data;
+        out->v.str.len = value->value.string.size;
+      } else {
+        out->v.str.data = tapeString(doc->tape, node, &out->v.str.len);
+      }
+      break;
+    case BOOLEAN:
+      out->kind = FV_BOOL;
+      out->v.boolean = value ? value->value.boolean : tapeTag(doc->tape, node) == 't';
+      break;
+    case NIL:
+      out->kind = FV_NULL;
+      break;
+    default:
+      out->kind = FV_NODE;
+      break;
+  }
+}
+
+static bool truthy(const FilterValue* value) {
+  if(value->fromPath) return value->kind != FV_NOTHING;
+  return value->kind == FV_BOOL && value->v.boolean;
+}
+
+/*
+ * Integers compare exactly with integers and as doubles with
+ * doubles; values of different types are never equal nor ordered.
+ */
+static bool compareValues(int32_t op, const FilterValue* a, const FilterValue* b) {
+  int cmp;
+  bool ordered = true;
+  bool numeric = (a->kind == FV_INT || a->kind == FV_DOUBLE) &&
+    (b->kind == FV_INT || b->kind == FV_DOUBLE);
+  if(numeric) {
+    if(a->kind == FV_INT && b->kind == FV_INT) {
+      cmp = (a->v.integer > b->v.integer) - (a->v.integer < b->v.integer);
+    } else {
+      double x = a->kind == FV_INT ? (double)a->v.integer : a->v.number;
+      double y = b->kind == FV_INT ? (double)b->v.integer : b->v.number;
+      if(x != x || y != y) return op == EX_NE;
+      cmp = (x > y) - (x < y);
+    }
+  } else if(a->kind != b->kind) {
+    return op == EX_NE;
+  } else if(a->kind == FV_STR) {
+    size_t len = a->v.str.len < b->v.str.len ? a->v.str.len : b->v.str.len;
+    cmp = memcmp(a->v.str.data, b->v.str.data, len);
+    if(!cmp) cmp = (a->v.str.len > b->v.str.len) - (a->v.str.len < b->v.str.len);
+  } else if(a->kind == FV_BOOL) {
+    cmp = a->v.boolean != b->v.boolean;
+    ordered = false;
+  } else if(a->kind == FV_NODE) {
+    cmp = 1;
+    ordered = false;
+  } else {
+    /* Both null or both nothing. */
+    cmp = 0;
+    ordered = false;
+  }
+
+  switch(op) {
+    case EX_EQ: return cmp == 0;
+    case EX_NE: return cmp != 0;
+    case EX_LT: return ordered && cmp < 0;
+    case EX_LE: return ordered ? cmp <= 0 : cmp == 0;
+    case EX_GT: return ordered && cmp > 0;
+    case EX_GE: return ordered ? cmp >= 0 : cmp == 0;
+  }
+  return false;
+}
+
+static bool filterMatches(
+  const PathDoc* doc,
+  const int32_t* code,
+  size_t len,
+  PathNode current
 ) {
-  size_t clen;
-  const char* cpath = RedisModule_StringPtrLen(path, &clen);
-  const char* cpath2 = cpath;
-  State state = START;
-
-  Vector paths;
-  vecNew(&paths, 1, sizeof(Path));
-
-  const char* tok = cpath2;
-  size_t tokLen = 0;
-  size_t i = 0;
-  bool isTokNum = false;
-  CharState sstate = CSNONE;
-
-  while(i < clen) {
-    char ch = *cpath2;
-    switch(state) {
-      case START: {
-        if(isalpha(ch) || ch == '$') {
-          ++tokLen;
-          state = WORD;
+  FilterValue stack[FILTER_MAX_STACK];
+  int sp = 0;
+  for(size_t ip = 0; ip < len;) {
+    int32_t op = code[ip];
+    FilterValue* top = &stack[sp];
+    switch(op) {
+      case EX_REL:
+      case EX_ROOT: {
+        int32_t count = code[ip + 1];
+        PathNode node = op == EX_REL ? current : doc->root;
+        for(int32_t i = 0; i < count && node != NODE_NONE; i++) {
+          const int32_t* step = &code[ip + 2 + i * 2];
+          node = step[0] == SEL_KEY ?
+            nodeMember(doc, node, step[1]) :
+            nodeElement(doc, node, step[1]);
         }
+        nodeValue(doc, node, top);
+        ++sp;
+        ip += 2 + count * 2;
         break;
       }
-      case DOT:
-      case ROOT: {
-        if(isalpha(ch) || ch == '$') {
-          ++tokLen;
-          state = WORD;
-        } else if(ch == '.') {
-          ++tokLen;
-          state = DOT;
-          sstate = CSRDESCENT;
-          ++cpath2;
-          ++i;
-          goto tokEnd;
+      case EX_NUM: {
+        const PathNumber* number = &doc->path->numbers[code[ip + 1]];
+        top->fromPath = false;
+        top->kind = number->isInteger ? FV_INT : FV_DOUBLE;
+        if(number->isInteger) {
+          top->v.integer = number->integer;
+        } else {
+          top->v.number = number->number;
         }
+        ++sp;
+        ip += 2;
         break;
       }
-      case SBRACKET: {
-        if(ch >= '0' && ch <= '9') {
-          ++tokLen;
-          state = NUMBER;
-        }
+      case EX_STR: {
+        const PathKey* key = &doc->path->keys[code[ip + 1]];
+        top->fromPath = false;
+        top->kind = FV_STR;
+        top->v.str.data = doc->path->pool + key->offset;
+        top->v.str.len = key->len;
+        ++sp;
+        ip += 2;
         break;
       }
-      case NUMBER: {
-        if(ch == ']') {
-          state = START;
-          sstate = CSARRAY;
-          isTokNum = true;
-          ++cpath2;
-          ++i;
-          goto tokEnd;
-        }
-        if(ch >= '0' && ch <= '9') {
-          ++tokLen;
-        }
+      case EX_TRUE:
+      case EX_FALSE:
+        top->fromPath = false;
+        top->kind = FV_BOOL;
+        top->v.boolean = op == EX_TRUE;
+        ++sp;
+        ++ip;
+        break;
+      case EX_NULL:
+        top->fromPath = false;
+        top->kind = FV_NULL;
+        ++sp;
+        ++ip;
+        break;
+      case EX_NOT: {
+        bool result = !truthy(&stack[sp - 1]);
+        stack[sp - 1].fromPath = false;
+        stack[sp - 1].kind = FV_BOOL;
+        stack[sp - 1].v.boolean = result;
+        ++ip;
         break;
       }
-      case WORD: {
-        if(ch == '.' || ch == '[') {
-          state = ch == '.' ? DOT : SBRACKET;
-          sstate = CSOBJECT;
-          isTokNum = false;
-          ++cpath2;
-          ++i;
-          goto tokEnd;
+      default: {
+        FilterValue* a = &stack[sp - 2];
+        FilterValue* b = &stack[sp - 1];
+        bool result;
+        if(op == EX_AND) {
+          result = truthy(a) && truthy(b);
+        } else if(op == EX_OR) {
+          result = truthy(a) || truthy(b);
+        } else {
+          result = compareValues(op, a, b);
         }
-        ++tokLen;
+        a->fromPath = false;
+        a->kind = FV_BOOL;
+        a->v.boolean = result;
+        --sp;
+        ++ip;
         break;
       }
     }
-    ++i;
-    ++cpath2;
-    if((clen == i) && (state == WORD)) {
-      state = START;
-      sstate = CSOBJECT;
-      isTokNum = false;
-      goto tokEnd;
-    }
-    continue;
-    tokEnd: {
-      Path path;
-      
-      path.sstate = sstate;
-      switch(sstate) {
-        case CSOBJECT:
-          path.key = _strdup(tok, tokLen);
-          break;
-        case CSARRAY: {
-          size_t index = 0;
-          for(size_t j = 0; j < tokLen; j++) {
-            index = index * 10 + (tok[j] - 48);
-          }
-          path.index = index;
-          break;
+  }
+  return sp && truthy(&stack[0]);
+}
+
+static size_t instructionWidth(const int32_t* code, size_t ip) {
+  switch(code[ip]) {
+    case OP_UNION: {
+      size_t end = ip + 2;
+      for(int32_t s = 0; s < code[ip + 1]; s++) end += selectorWidth(code[end]);
+      return end - ip;
+    }
+    case OP_DESCEND:
+      return 1;
+    case OP_FILTER:
+      return 2 + code[ip + 1];
+    default:
+      return selectorWidth(code[ip]);
+  }
+}
+
+size_t pathStepWidth(const CompiledPath* path, size_t ip) {
+  size_t width = instructionWidth(path->code, ip);
+  if(path->code[ip] == OP_DESCEND && ip + width < path->codeLen) {
+    width += instructionWidth(path->code, ip + width);
+  }
+  return width;
+}
+
+static void applyInstruction(
+  const PathDoc* doc,
+  size_t ip,
+  const PathNode* current,
+  size_t count,
+  Vector* out
+) {
+  const int32_t* code = doc->path->code;
+  switch(code[ip]) {
+    case OP_UNION: {
+      size_t end = ip + instructionWidth(code, ip);
+      for(size_t j = 0; j < count; j++) {
+        for(size_t at = ip + 2; at < end; at += selectorWidth(code[at])) {
+          applySelector(doc, current[j], &code[at], out);
         }
-        default: break;
-      }
-      sstate = CSNONE;
-      vecPush(&paths, &path);
-      tok = cpath2;
-      tokLen = 0;
-    }
-  }
-
-  Vector currArr;
-  vecNew(&currArr, 1, sizeof(JsonValue*));
-  vecPush(&currArr, &value);
-  JsonValue** data = (JsonValue**)currArr.data;
-  Path* pdata = (Path*)paths.data;
-  if(paths.len == 1 && !strcmp(pdata[0].key, "$")) {
-    return data[0];
-  }
-  for(size_t i = 0; i < paths.len; i++) {
-    if(pdata[i].sstate == CSRDESCENT) {
-      vecClear(&currArr);
-      currArr = *recursiveSearch(data[0], pdata[i + 1].key, &currArr);
-      continue;
-    }
-    for(size_t j = 0; j < currArr.len; j++) {
-      if(data[j]->type == OBJECT) {
-        struct JsonObject obj = data[j]->value.object;
-        for(size_t k = 0; k < obj.size; k++) {
-          if(!strcmp(obj.elements[k]->key, pdata[i].key)) {
-            data[j]= obj.elements[k]->value;
+      }
+      break;
+    }
+    case OP_DESCEND:
+      for(size_t j = 0; j < count; j++) descend(doc, current[j], out);
+      break;
+    case OP_FILTER: {
+      size_t len = code[ip + 1];
+      for(size_t j = 0; j < count; j++) {
+        ChildIter it;
+        PathNode child;
+        childBegin(doc, current[j], &it);
+        while(childNext(doc, &it, &child)) {
+          if(filterMatches(doc, &code[ip + 2], len, child)) {
+            vecPush(out, &child);
           }
         }
-      } else if(data[j]->type == ARRAY) {
-        JsonArray arr = data[j]->value.array;
-        size_t index = pdata[i].index;
-        if(index >= 0 && index < arr.size) {
-          data[j] = arr.array[index];
-        }
       }
+      break;
     }
+    default:
+      for(size_t j = 0; j < count; j++) {
+        applySelector(doc, current[j], &code[ip], out);
+      }
+      break;
   }
+}
+
+/* The descendants a descent step selects from. */
+static Vector scratchDescend;
+
+static void applyStep(
+  const PathDoc* doc,
+  size_t ip,
+  const PathNode* current,
+  size_t count,
+  Vector* out
+) {
+  const int32_t* code = doc->path->code;
+  if(code[ip] == OP_DESCEND && ip + 1 < doc->path->codeLen) {
+    if(
+      code[ip + 1] == OP_KEY &&
+      descendIndexed(doc, current, count, code[ip + 2], out)
+    ) {
+      return;
+    }
+    prepare(&scratchDescend);
+    applyInstruction(doc, ip, current, count, &scratchDescend);
+    applyInstruction(
+      doc,
+      ip + 1,
+      scratchDescend.data,
+      scratchDescend.len,
+      out
+    );
+    return;
+  }
+  applyInstruction(doc, ip, current, count, out);
+}
+
+static void releaseScratch(void) {
+  release(&scratchNext);
+  release(&scratchStack);
+  release(&scratchElements);
+  release(&scratchDescend);
+}
+
+static void initDoc(PathDoc* doc, RedisJsonValue* value, const CompiledPath* path) {
+  doc->doc = value;
+  doc->tape = value->tape;
+  doc->root = value->tape ? 0 : (PathNode)value->rootJson;
+  doc->path = path;
+}
+
+static void resetResults(Vector* results) {
+  if(!results->data || results->elemSize != sizeof(PathNode)) {
+    if(results->data) vecDel(results);
+    vecNew(results, 16, sizeof(PathNode));
+  }
+  results->len = 0;
+}
+
+/*
+ * Runs the code one step at a time over the whole current set, which
+ * lives in `results` and is swapped with scratchNext after each step.
+ */
+void evalPath(
+  RedisModuleCtx* ctx,
+  RedisJsonValue* value,
+  const CompiledPath* path,
+  Vector* results
+) {
+  PathDoc doc;
+  initDoc(&doc, value, path);
+  resetResults(results);
+  vecPush(results, &doc.root);
+  prepare(&scratchNext);
+
+  for(size_t ip = 0; ip < path->codeLen && results->len;) {
+    scratchNext.len = 0;
+    applyStep(&doc, ip, results->data, results->len, &scratchNext);
+    ip += pathStepWidth(path, ip);
+    swapVec(results, &scratchNext);
+  }
+  releaseScratch();
+}
+
+void evalPathSplit(
+  RedisModuleCtx* ctx,
+  RedisJsonValue* value,
+  const CompiledPath* path,
+  Vector* parents,
+  Vector* results
+) {
+  PathDoc doc;
+  initDoc(&doc, value, path);
+  resetResults(parents);
+  resetResults(results);
+  vecPush(results, &doc.root);
+  prepare(&scratchNext);
+
+  for(size_t ip = 0; ip < path->codeLen && results->len;) {
+    size_t width = pathStepWidth(path, ip);
+    if(ip + width == path->codeLen) {
+      const PathNode* nodes = results->data;
+      for(size_t i = 0; i < results->len; i++) vecPush(parents, (void*)&nodes[i]);
+    }
+    scratchNext.len = 0;
+    applyStep(&doc, ip, results->data, results->len, &scratchNext);
+    ip += width;
+    swapVec(results, &scratchNext);
+  }
+  releaseScratch();
+}
+
+const char* pathLastKey(const CompiledPath* path, size_t* len) {
+  if(!path->codeLen) return NULL;
+  size_t last = 0;
+  for(size_t ip = 0; ip < path->codeLen; ip += pathStepWidth(path, ip)) {
+    last = ip;
+  }
+  if(path->code[last] != OP_KEY) return NULL;
+  const PathKey* key = &path->keys[path->code[last + 1]];
+  *len = key->len;
+  return path->pool + key->offset;
+}
+
+void evalPathRoot(RedisJsonValue* value, Vector* results) {
+  PathNode root = value->tape ? 0 : (PathNode)value->rootJson;
+  resetResults(results);
+  vecPush(results, &root);
+}
+
+void evalPathStep(
+  RedisJsonValue* value,
+  const CompiledPath* path,
+  size_t ip,
+  const Vector* from,
+  Vector* to
+) {
+  PathDoc doc;
+  initDoc(&doc, value, path);
+  resetResults(to);
+  applyStep(&doc, ip, from->data, from->len, to);
+  releaseScratch();
+}
+
+static bool keyEquals(
+  const CompiledPath* a,
+  int32_t ka,
+  const CompiledPath* b,
+  int32_t kb
+) {
+  const PathKey* x = &a->keys[ka];
+  const PathKey* y = &b->keys[kb];
+  return x->hash == y->hash && x->len == y->len &&
+    !memcmp(a->pool + x->offset, b->pool + y->offset, x->len);
+}
+
+static bool selectorEquals(
+  const CompiledPath* a,
+  size_t ia,
+  const CompiledPath* b,
+  size_t ib
+) {
+  int32_t kind = a->code[ia];
+  if(kind != b->code[ib]) return false;
+  if(kind == SEL_KEY) return keyEquals(a, a->code[ia + 1], b, b->code[ib + 1]);
+  return !memcmp(
+    &a->code[ia + 1],
+    &b->code[ib + 1],
+    (selectorWidth(kind) - 1) * sizeof(int32_t)
+  );
+}
+
+/*
+ * Filters are never considered equal; comparing their literals is not
+ * worth it for the prefixes paths share in practice.
+ */
+static bool instructionEquals(
+  const CompiledPath* a,
+  size_t ia,
+  const CompiledPath* b,
+  size_t ib
+) {
+  int32_t op = a->code[ia];
+  if(op != b->code[ib]) return false;
+  switch(op) {
+    case OP_DESCEND:
+      return true;
+    case OP_FILTER:
+      return false;
+    case OP_UNION: {
+      if(a->code[ia + 1] != b->code[ib + 1]) return false;
+      size_t end = ia + instructionWidth(a->code, ia);
+      ib += 2;
+      for(ia += 2; ia < end; ia += selectorWidth(a->code[ia])) {
+        if(!selectorEquals(a, ia, b, ib)) return false;
+        ib += selectorWidth(b->code[ib]);
+      }
+      return true;
+    }
+    default:
+      return selectorEquals(a, ia, b, ib);
+  }
+}
+
+bool pathStepEquals(
+  const CompiledPath* a,
+  size_t ia,
+  const CompiledPath* b,
+  size_t ib
+) {
+  if(!instructionEquals(a, ia, b, ib)) return false;
+  if(a->code[ia] != OP_DESCEND) return true;
+  return ia + 1 < a->codeLen && ib + 1 < b->codeLen &&
+    instructionEquals(a, ia + 1, b, ib + 1);
+}
+
+/*
+ * Open addressing set of the matches of one write.
+ */
+typedef struct {
+  uintptr_t node;
+  bool used;
+  bool nested;
+} MatchSlot;
+
+typedef struct {
+  MatchSlot* slots;
+  size_t mask;
+} MatchSet;
+
+static void matchSetInit(MatchSet* set, size_t count) {
+  size_t size = 16;
+  while(size < count * 2) size *= 2;
+  set->slots = RedisModule_Calloc(size, sizeof(MatchSlot));
+  set->mask = size - 1;
+}
+
+static MatchSlot* matchSetFind(MatchSet* set, uintptr_t node) {
+  size_t i = ((uint64_t)node * 0x9e3779b97f4a7c15ULL >> 32) & set->mask;
+  while(set->slots[i].used && set->slots[i].node != node) {
+    i = (i + 1) & set->mask;
+  }
+  return &set->slots[i];
+}
+
+/*
+ * Moves the first of each match to the front of the list and leaves
+ * every one of them in `set`.
+ */
+static void uniqueInto(Vector* matches, MatchSet* set) {
+  uintptr_t* nodes = matches->data;
+  size_t count = 0;
+  for(size_t i = 0; i < matches->len; i++) {
+    MatchSlot* slot = matchSetFind(set, nodes[i]);
+    if(slot->used) continue;
+    slot->used = true;
+    slot->node = nodes[i];
+    nodes[count++] = nodes[i];
+  }
+  matches->len = count;
+}
+
+void matchesUnique(Vector* matches) {
+  if(matches->len < 2) return;
+  MatchSet set;
+  matchSetInit(&set, matches->len);
+  uniqueInto(matches, &set);
+  RedisModule_Free(set.slots);
+}
+
+/*
+ * Marks the matches below `value`. A match that is already marked was
+ * reached from another match above it, whose walk went on through
+ * everything under it.
+ */
+static void markNested(MatchSet* set, const JsonValue* value) {
+  size_t count = value->type == OBJECT ? value->value.object.size :
+    value->type == ARRAY ? value->value.array.size : 0;
+  for(size_t i = 0; i < count; i++) {
+    const JsonValue* child = value->type == OBJECT ?
+      value->value.object.elements[i]->value :
+      value->value.array.array[i];
+    MatchSlot* slot = matchSetFind(set, (uintptr_t)child);
+    if(slot->used) {
+      if(slot->nested) continue;
+      slot->nested = true;
+    }
+    markNested(set, child);
+  }
+}
+
+void matchesOutermost(Vector* matches) {
+  if(matches->len < 2) return;
+  MatchSet set;
+  matchSetInit(&set, matches->len);
+  uniqueInto(matches, &set);
+  JsonValue** nodes = matches->data;
+  for(size_t i = 0; i < matches->len; i++) {
+    if(!matchSetFind(&set, (uintptr_t)nodes[i])->nested) markNested(&set, nodes[i]);
+  }
+  size_t count = 0;
+  for(size_t i = 0; i < matches->len; i++) {
+    if(!matchSetFind(&set, (uintptr_t)nodes[i])->nested) nodes[count++] = nodes[i];
+  }
+  matches->len = count;
+  RedisModule_Free(set.slots);
+}
+
+static int compareWords(const void* a, const void* b) {
+  size_t x = *(const size_t*)a, y = *(const size_t*)b;
+  return x < y ? -1 : x > y;
+}
 
-  vecDel(&paths);
-  if(currArr.len > 1) {
-    JsonValue* val = RedisModule_Alloc(sizeof(JsonValue));
-    JsonArray arr;
-    arr.array = data;
-    arr.size = currArr.len;
-    val->type = ARRAY;
-    val->value.array = arr;
-    return val;
+void matchesSorted(Vector* matches) {
+  if(matches->len < 2) return;
+  size_t* at = matches->data;
+  qsort(at, matches->len, sizeof(size_t), compareWords);
+  size_t count = 1;
+  for(size_t i = 1; i < matches->len; i++) {
+    if(at[i] != at[count - 1]) at[count++] = at[i];
   }
-  return data[0];
+  matches->len = count;
 }
@@ -2,6 +2,7 @@
 
 #include "redismodule.h"
 #include "value.h"
+#include "tape.h"
 
 typedef struct {
   void* data;
@@ -10,8 +11,192 @@ typedef struct {
   size_t elemSize;
 } Vector;
 
-JsonValue* evalPath(
+/*
+ * Instructions of a compiled path. Each one maps the current set of
+ * nodes to the next; operands follow the opcode in the code array.
+ *
+ *   OP_KEY k           member named keys[k]
+ *   OP_INDEX i         element i, negative counting from the end
+ *   OP_WILDCARD        every member or element
+ *   OP_SLICE f s e st  elements start:end:step; bit 0 / 1 of f tell
+ *                      whether start / end were given
+ *   OP_UNION n sel...  n selectors, each SEL_KEY k, SEL_INDEX i,
+ *                      SEL_SLICE f s e st or SEL_WILDCARD
+ *   OP_DESCEND         the nodes and all of their descendants
+ *   OP_FILTER len ...  members or elements for which the `len` words
+ *                      of filter code that follow are true
+ *
+ * Filter code runs on a small value stack:
+ *
+ *   EX_REL n step...   the value at a singular path below `@`, each
+ *   EX_ROOT n step...  step SEL_KEY k or SEL_INDEX i; EX_ROOT starts
+ *                      from `$` instead
+ *   EX_NUM c / EX_STR k / EX_TRUE / EX_FALSE / EX_NULL   literals
+ *   EX_EQ EX_NE EX_LT EX_LE EX_GT EX_GE EX_AND EX_OR EX_NOT
+ */
+typedef enum {
+  OP_KEY,
+  OP_INDEX,
+  OP_WILDCARD,
+  OP_SLICE,
+  OP_UNION,
+  OP_DESCEND,
+  OP_FILTER
+} PathOp;
+
+/*
+ * Selectors share their encoding with the matching single ops.
+ */
+typedef enum {
+  SEL_KEY = OP_KEY,
+  SEL_INDEX = OP_INDEX,
+  SEL_WILDCARD = OP_WILDCARD,
+  SEL_SLICE = OP_SLICE
+} PathSelector;
+
+typedef enum {
+  EX_REL,
+  EX_ROOT,
+  EX_NUM,
+  EX_STR,
+  EX_TRUE,
+  EX_FALSE,
+  EX_NULL,
+  EX_EQ,
+  EX_NE,
+  EX_LT,
+  EX_LE,
+  EX_GT,
+  EX_GE,
+  EX_AND,
+  EX_OR,
+  EX_NOT
+} FilterOp;
+
+#define SLICE_HAS_START 1
+#define SLICE_HAS_END 2
+
+/*
+ * Filter expressions deeper than this are rejected at compile time,
+ * which bounds the evaluation stack.
+ */
+#define FILTER_MAX_STACK 32
+
+typedef struct {
+  uint32_t offset;
+  uint32_t len;
+  uint32_t hash;
+} PathKey;
+
+typedef struct {
+  bool isInteger;
+  int64_t integer;
+  double number;
+} PathNumber;
+
+/*
+ * A path compiled once, so evaluating it again needs neither parsing
+ * nor allocation. Code, keys, numbers and the key bytes (`pool`) all
+ * live in the same allocation as the struct, next to a copy of the
+ * source used as the cache key. The last fields are bookkeeping for
+ * the path cache.
+ */
+typedef struct CompiledPath {
+  int32_t* code;
+  size_t codeLen;
+  PathKey* keys;
+  PathNumber* numbers;
+  char* pool;
+  char* source;
+  size_t sourceLen;
+  uint32_t hash;
+  int refs;
+  bool cached;
+  struct CompiledPath* prev;
+  struct CompiledPath* next;
+  struct CompiledPath* chain;
+} CompiledPath;
+
+/*
+ * Accepts JSONPath (`$.a[*].b`, `$..a`, `[1:10:2]`, `['a','b']`,
+ * `[?(@.qty > 5 && @.name == 'x')]`) and the older forms without a
+ * leading `$` such as `a.b[0]`. Returns NULL when the path does not
+ * parse.
+ */
+CompiledPath* compilePath(const char* cpath, size_t clen);
+void freeCompiledPath(CompiledPath* path);
+
+/*
+ * Fills `results` with the matches of the path: JsonValue pointers
+ * for a tree, word indexes for a tape. They come in the order RFC 9535
+ * gives them, each step applied to the previous step's matches in
+ * turn, which is not document order: `$..key` lists the members
+ * grouped by the object they belong to, objects in document order,
+ * so a match can come after one nested in it, and stacked descents
+ * such as `$..a..b` list some nodes more than once. Writes clean the
+ * list up with the matches* functions below first. `results` may be
+ * zeroed or reused from a previous call and is freed with vecDel.
+ * `$..key` is answered from the document's descent index, which the
+ * first such query builds.
+ */
+void evalPath(
   RedisModuleCtx* ctx,
-  JsonValue* value,
-  RedisModuleString* path
+  RedisJsonValue* doc,
+  const CompiledPath* path,
+  Vector* results
 );
+
+/*
+ * Same as evalPath, also leaving in `parents` the nodes the last step
+ * was applied to, for writes that create what the last step names.
+ * pathLastKey returns that name when the last step is a plain key,
+ * NULL otherwise.
+ */
+void evalPathSplit(
+  RedisModuleCtx* ctx,
+  RedisJsonValue* doc,
+  const CompiledPath* path,
+  Vector* parents,
+  Vector* results
+);
+const char* pathLastKey(const CompiledPath* path, size_t* len);
+
+/*
+ * Evaluation one step at a time, for callers that share steps between
+ * paths. A step is one instruction, or a descent together with the
+ * instruction after it; it starts at `ip` and is pathStepWidth words
+ * long. evalPathRoot sets `results` to the root alone and
+ * evalPathStep replaces `to` with the step applied to `from`.
+ */
+size_t pathStepWidth(const CompiledPath* path, size_t ip);
+bool pathStepEquals(
+  const CompiledPath* a,
+  size_t ia,
+  const CompiledPath* b,
+  size_t ib
+);
+void evalPathRoot(RedisJsonValue* doc, Vector* results);
+void evalPathStep(
+  RedisJsonValue* doc,
+  const CompiledPath* path,
+  size_t ip,
+  const Vector* from,
+  Vector* to
+);
+
+/*
+ * Match lists made fit for writing. matchesUnique drops repeated
+ * matches of a tree or a tape, keeping the first of each.
+ * matchesOutermost does the same for a tree and also drops every
+ * match that lies inside another one, for writes that may free what
+ * they replace; it walks the subtree of each match. Both keep the
+ * remaining matches in their order. matchesSorted puts the word
+ * indexes of a tape in document order and drops repeats.
+ */
+void matchesUnique(Vector* matches);
+void matchesOutermost(Vector* matches);
+void matchesSorted(Vector* matches);
+
+void vecNew(Vector* v, size_t cap, size_t elemSize);
+void vecPush(Vector* v, void* value);
+void vecDel(Vector* v);
@@ -0,0 +1,107 @@
+#include "pathCache.h"
+#include "config.h"
+#include "objectIndex.h"
+#include <string.h>
+
+PathCacheStats pathCacheStats;
+
+static CompiledPath** buckets;
+static size_t bucketCount;
+
+/* Most recently used at the head. */
+static CompiledPath* lruHead;
+static CompiledPath* lruTail;
+
+static void lruUnlink(CompiledPath* path) {
+  if(path->prev) path->prev->next = path->next; else lruHead = path->next;
+  if(path->next) path->next->prev = path->prev; else lruTail = path->prev;
+  path->prev = path->next = NULL;
+}
+
+static void lruPushHead(CompiledPath* path) {
+  path->prev = NULL;
+  path->next = lruHead;
+  if(lruHead) lruHead->prev = path; else lruTail = path;
+  lruHead = path;
+}
+
+static void rehash(size_t count) {
+  CompiledPath** grown = RedisModule_Calloc(count, sizeof(CompiledPath*));
+  for(size_t i = 0; i < bucketCount; i++) {
+    CompiledPath* path = buckets[i];
+    while(path) {
+      CompiledPath* chain = path->chain;
+      size_t b = path->hash & (count - 1);
+      path->chain = grown[b];
+      grown[b] = path;
+      path = chain;
+    }
+  }
+  if(buckets) RedisModule_Free(buckets);
+  buckets = grown;
+  bucketCount = count;
+}
+
+static void evict(CompiledPath* path) {
+  CompiledPath** link = &buckets[path->hash & (bucketCount - 1)];
+  while(*link != path) link = &(*link)->chain;
+  *link = path->chain;
+  lruUnlink(path);
+  path->cached = false;
+  --pathCacheStats.entries;
+  ++pathCacheStats.evictions;
+  if(!path->refs) freeCompiledPath(path);
+}
+
+CompiledPath* pathCacheGet(RedisModuleString* path) {
+  size_t len;
+  const char* bytes = RedisModule_StringPtrLen(path, &len);
+  size_t capacity = jsonConfig.pathCacheSize;
+  uint32_t hash = hashKey(bytes, len);
+
+  if(bucketCount) {
+    CompiledPath* cached = buckets[hash & (bucketCount - 1)];
+    for(; cached; cached = cached->chain) {
+      if(
+        cached->hash == hash &&
+        cached->sourceLen == len &&
+        !memcmp(cached->source, bytes, len)
+      ) {
+        ++pathCacheStats.hits;
+        if(cached != lruHead) {
+          lruUnlink(cached);
+          lruPushHead(cached);
+        }
+        ++cached->refs;
+        return cached;
+      }
+    }
+  }
+  ++pathCacheStats.misses;
+
+  CompiledPath* compiled = compilePath(bytes, len);
+  if(!compiled) return NULL;
+  compiled->hash = hash;
+  compiled->refs = 1;
+
+  /* The size may have been lowered since the last insert. */
+  while(pathCacheStats.entries && pathCacheStats.entries >= capacity) {
+    evict(lruTail);
+  }
+  if(!capacity) return compiled;
+
+  if(pathCacheStats.entries >= bucketCount) {
+    rehash(bucketCount ? bucketCount * 2 : 64);
+  }
+  size_t b = hash & (bucketCount - 1);
+  compiled->chain = buckets[b];
+  buckets[b] = compiled;
+  compiled->cached = true;
+  lruPushHead(compiled);
+  ++pathCacheStats.entries;
+  return compiled;
+}
+
+void pathCacheRelease(CompiledPath* path) {
+  if(!--path->refs && !path->cached) freeCompiledPath(path);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "redismodule.h"
+#include "path.h"
+
+typedef struct {
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long evictions;
+  size_t entries;
+} PathCacheStats;
+
+extern PathCacheStats pathCacheStats;
+
+/*
+ * Returns the compiled form of `path`, from the cache when the same
+ * bytes were compiled recently. The result stays valid until it is
+ * handed back with pathCacheRelease, even if it is evicted meanwhile.
+ * The cache holds at most redisjson.path-cache-size paths, least
+ * recently used first out; 0 compiles every path afresh. Paths that
+ * do not compile return NULL and are not cached.
+ */
+CompiledPath* pathCacheGet(RedisModuleString* path);
+void pathCacheRelease(CompiledPath* path);
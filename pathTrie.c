@@ -0,0 +1,70 @@
+#include "pathTrie.h"
+#include <string.h>
+
+void pathTrieInit(PathTrie* trie) {
+  memset(trie, 0, sizeof(PathTrie));
+}
+
+void pathTrieFree(PathTrie* trie) {
+  PathTrieNode* node = trie->nodes;
+  while(node) {
+    PathTrieNode* next = node->allocated;
+    if(node->set.data) vecDel(&node->set);
+    RedisModule_Free(node);
+    node = next;
+  }
+  if(trie->root.set.data) vecDel(&trie->root.set);
+  if(trie->ends) RedisModule_Free(trie->ends);
+  pathTrieInit(trie);
+}
+
+size_t pathTrieAdd(PathTrie* trie, const CompiledPath* path) {
+  PathTrieNode* node = &trie->root;
+  for(size_t ip = 0; ip < path->codeLen; ip += pathStepWidth(path, ip)) {
+    PathTrieNode* child = node->child;
+    while(child && !pathStepEquals(child->path, child->ip, path, ip)) {
+      child = child->sibling;
+    }
+    if(!child) {
+      child = RedisModule_Calloc(1, sizeof(PathTrieNode));
+      child->path = path;
+      child->ip = ip;
+      child->parent = node;
+      child->sibling = node->child;
+      node->child = child;
+      child->allocated = trie->nodes;
+      trie->nodes = child;
+    }
+    node = child;
+  }
+
+  if(trie->count == trie->cap) {
+    trie->cap = trie->cap ? trie->cap * 2 : 8;
+    trie->ends = RedisModule_Realloc(trie->ends, trie->cap * sizeof(PathTrieNode*));
+  }
+  trie->ends[trie->count] = node;
+  return trie->count++;
+}
+
+/*
+ * Depth first, keeping every node's set until the end so children can
+ * be evaluated from their parent's; the trie is as deep as the longest
+ * path, so the walk goes up and down through the parent links instead
+ * of recursing.
+ */
+void pathTrieEval(PathTrie* trie, RedisJsonValue* doc) {
+  evalPathRoot(doc, &trie->root.set);
+  PathTrieNode* node = trie->root.child;
+  while(node) {
+    evalPathStep(doc, node->path, node->ip, &node->parent->set, &node->set);
+    if(node->child) {
+      node = node->child;
+      continue;
+    }
+    while(node && !node->sibling) {
+      node = node->parent;
+      if(node == &trie->root) node = NULL;
+    }
+    if(node) node = node->sibling;
+  }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "path.h"
+
+/*
+ * Several compiled paths merged on their common leading steps, so a
+ * prefix shared by many paths is evaluated once per document.
+ */
+typedef struct PathTrieNode {
+  const CompiledPath* path;
+  size_t ip;
+  struct PathTrieNode* parent;
+  struct PathTrieNode* child;
+  struct PathTrieNode* sibling;
+  struct PathTrieNode* allocated;
+  Vector set;
+} PathTrieNode;
+
+typedef struct {
+  PathTrieNode root;
+  PathTrieNode* nodes;
+  PathTrieNode** ends;
+  size_t count;
+  size_t cap;
+} PathTrie;
+
+void pathTrieInit(PathTrie* trie);
+void pathTrieFree(PathTrie* trie);
+
+/*
+ * Adds a path, which has to outlive the trie, and returns the index
+ * its results are read back with.
+ */
+size_t pathTrieAdd(PathTrie* trie, const CompiledPath* path);
+
+void pathTrieEval(PathTrie* trie, RedisJsonValue* doc);
+
+/*
+ * Matches of the path added as `i`, in the same form as evalPath.
+ */
+static inline const Vector* pathTrieResults(const PathTrie* trie, size_t i) {
+  return &trie->ends[i]->set;
+}
@@ -1,35 +1,58 @@
 #include "redismodule.h"
 #include "string.h"
 #include "value.h"
+#include "tape.h"
+
+/*
+ * Strings come back from the RDB as unterminated heap buffers; copy
+ * them into the document with the terminator the rest of the module
+ * expects, so they are allocated and counted like any other string.
+ */
+static char* loadString(RedisModuleIO* rdb, JsonArena* arena, size_t* len) {
+  char* buf = RedisModule_LoadStringBuffer(rdb, len);
+  char* str = jsonStrndup(arena, buf, *len);
+  RedisModule_Free(buf);
+  return str;
+}
 
 void loadObject(
   RedisModuleIO* rdb,
-  struct JsonObject* object
+  struct JsonObject* object,
+  JsonArena* arena
 ) {
-  object->elements = RedisModule_Calloc(object->size, sizeof(JsonKeyVal*));
+  object->elements = jsonAlloc(arena, object->size * sizeof(JsonKeyVal*));
+  object->cap = object->size;
   for(size_t i = 0; i < object->size; i++) {
-    JsonKeyVal* keyVal = RedisModule_Calloc(1, sizeof(JsonKeyVal));
+    JsonKeyVal* keyVal = jsonAlloc(arena, sizeof(JsonKeyVal));
     size_t len;
-    keyVal->key = RedisModule_LoadStringBuffer(rdb, &len);
-    keyVal->value = RedisModule_Calloc(1, sizeof(JsonValue));
-    JsonTypeRdbLoadImpl(rdb, keyVal->value);
+    char* key = RedisModule_LoadStringBuffer(rdb, &len);
+    keySet(arena, keyVal, key, len);
+    RedisModule_Free(key);
+    keyVal->value = jsonAlloc(arena, sizeof(JsonValue));
+    JsonTypeRdbLoadImpl(rdb, keyVal->value, arena);
     object->elements[i] = keyVal;
   }
+  objectReindex(arena, object);
 }
 
 void loadArray(
   RedisModuleIO* rdb,
-  JsonArray* array
+  JsonArray* array,
+  JsonArena* arena
 ) {
-  array->array = RedisModule_Calloc(array->size, sizeof(JsonValue*));
+  array->array = jsonAlloc(arena, array->size * sizeof(JsonValue*));
   for(size_t i = 0; i < array->size; i++) {
-    JsonValue* elem = RedisModule_Calloc(1, sizeof(JsonValue));
-    JsonTypeRdbLoadImpl(rdb, elem);
+    JsonValue* elem = jsonAlloc(arena, sizeof(JsonValue));
+    JsonTypeRdbLoadImpl(rdb, elem, arena);
     array->array[i] = elem;
   }
 }
 
-static void loadSimpleJson(RedisModuleIO* rdb, JsonValue* value) {
+static void loadSimpleJson(
+  RedisModuleIO* rdb,
+  JsonValue* value,
+  JsonArena* arena
+) {
   value->type = RedisModule_LoadUnsigned(rdb);
   switch(value->type) {
     case DOUBLE: {
@@ -46,12 +69,14 @@ static void loadSimpleJson(RedisModuleIO* rdb, JsonValue* value) {
     }
     case ARRAY: {
       value->value.array.size = RedisModule_LoadUnsigned(rdb);
+      value->value.array.cap = value->value.array.size;
       break;
     }
     case STRING: {
       value->value.string.data =
-        RedisModule_LoadStringBuffer(
+        loadString(
           rdb,
+          arena,
           &value->value.string.size
         );
       break;
@@ -60,18 +85,23 @@ static void loadSimpleJson(RedisModuleIO* rdb, JsonValue* value) {
       value->value.boolean = RedisModule_LoadSigned(rdb);
       break;
     }
+    case NIL: break;
   }
 }
 
-void JsonTypeRdbLoadImpl(RedisModuleIO* rdb, JsonValue* value) {
-  loadSimpleJson(rdb, value);
+void JsonTypeRdbLoadImpl(
+  RedisModuleIO* rdb,
+  JsonValue* value,
+  JsonArena* arena
+) {
+  loadSimpleJson(rdb, value, arena);
   switch(value->type) {
     case OBJECT: {
-      loadObject(rdb, &value->value.object);
+      loadObject(rdb, &value->value.object, arena);
       break;
     }
     case ARRAY: {
-      loadArray(rdb, &value->value.array);
+      loadArray(rdb, &value->value.array, arena);
       break;
     }
     default: break;
@@ -109,6 +139,7 @@ static void saveSimpleJson(RedisModuleIO* rdb, JsonValue* value) {
       RedisModule_SaveSigned(rdb, value->value.boolean);
       break;
     }
+    case NIL: break;
   }
 }
 
@@ -118,8 +149,7 @@ void JsonTypeRdbSaveImpl(RedisModuleIO* rdb, JsonValue* value) {
     struct JsonObject* object = &value->value.object;
     for(int i = 0; i < object->size; i++) {
       JsonKeyVal* keyVal = object->elements[i];
-      size_t keySize = strlen(keyVal->key);
-      RedisModule_SaveStringBuffer(rdb, keyVal->key, keySize);
+      RedisModule_SaveStringBuffer(rdb, keyData(keyVal), keyVal->keyLen);
       JsonTypeRdbSaveImpl(rdb, keyVal->value);
     }
   } else if(value->type == ARRAY) {
@@ -130,39 +160,154 @@ void JsonTypeRdbSaveImpl(RedisModuleIO* rdb, JsonValue* value) {
   }
 }
 
-static void freeKeyValue(JsonKeyVal* keyValue) {
-  JsonTypeFreeImpl(keyValue->value);
-  RedisModule_Free(keyValue);
+static void freeKeyValue(JsonKeyVal* keyValue, JsonArena* arena) {
+  JsonTypeFreeImpl(keyValue->value, arena);
+  keyFree(arena, keyValue);
+  jsonFree(arena, keyValue, sizeof(JsonKeyVal));
 }
 
-static void freeObject(struct JsonObject* object) {
+static void freeObject(struct JsonObject* object, JsonArena* arena) {
   for(size_t i = 0; i < object->size; i++) {
-    freeKeyValue(object->elements[i]);
+    freeKeyValue(object->elements[i], arena);
   }
-  if(object->elements) RedisModule_Free(object->elements);
-  RedisModule_Free(object);
+  jsonFree(arena, object->elements, object->cap * sizeof(JsonKeyVal*));
+  objectIndexFree(arena, object->index);
 }
 
-static void freeArray(JsonArray* array) {
+static void freeArray(JsonArray* array, JsonArena* arena) {
   for(size_t i = 0; i < array->size; i++) {
-    JsonTypeFreeImpl(array->array[i]);
+    JsonTypeFreeImpl(array->array[i], arena);
   }
-  if(array->array) RedisModule_Free(array->array);
-  RedisModule_Free(array);
+  jsonFree(arena, array->array, array->cap * sizeof(JsonValue*));
 }
 
-void JsonTypeFreeImpl(JsonValue* value) {
+/*
+ * Frees a subtree. Inside an arena this only accounts the bytes as
+ * wasted; the whole arena goes away with its document.
+ */
+void JsonTypeFreeImpl(JsonValue* value, JsonArena* arena) {
   switch(value->type) {
     case OBJECT:
-      freeObject(&value->value.object);
+      freeObject(&value->value.object, arena);
       break;
     case ARRAY:
-      freeArray(&value->value.array);
+      freeArray(&value->value.array, arena);
+      break;
+    case STRING:
+      jsonFree(
+        arena,
+        (void*)value->value.string.data,
+        value->value.string.size + 1
+      );
+      break;
+    default: break;
+  }
+  jsonFree(arena, value, sizeof(JsonValue));
+}
+
+/*
+ * Tape documents use the same RDB encoding as trees, so switching
+ * redisjson.storage takes effect on the next load.
+ */
+static void saveTapeValue(
+  RedisModuleIO* rdb,
+  const JsonTape* tape,
+  size_t at
+) {
+  JsonValueType type = tapeType(tape, at);
+  RedisModule_SaveUnsigned(rdb, type);
+  switch(type) {
+    case DOUBLE:
+      RedisModule_SaveDouble(rdb, tapeDouble(tape, at));
+      break;
+    case INTEGER:
+      RedisModule_SaveSigned(rdb, tapeInteger(tape, at));
+      break;
+    case OBJECT: {
+      RedisModule_SaveUnsigned(rdb, tapeSize(tape, at));
+      size_t end = tapeNext(tape, at);
+      for(size_t i = at + 1; i < end; i = tapeNext(tape, i + 1)) {
+        size_t len;
+        const char* key = tapeString(tape, i, &len);
+        RedisModule_SaveStringBuffer(rdb, key, len);
+        saveTapeValue(rdb, tape, i + 1);
+      }
+      break;
+    }
+    case ARRAY: {
+      RedisModule_SaveUnsigned(rdb, tapeSize(tape, at));
+      size_t end = tapeNext(tape, at);
+      for(size_t i = at + 1; i < end; i = tapeNext(tape, i)) {
+        saveTapeValue(rdb, tape, i);
+      }
+      break;
+    }
+    case STRING: {
+      size_t len;
+      const char* str = tapeString(tape, at, &len);
+      RedisModule_SaveStringBuffer(rdb, str, len);
+      break;
+    }
+    case BOOLEAN:
+      RedisModule_SaveSigned(rdb, tapeTag(tape, at) == 't');
+      break;
+    case NIL: break;
+  }
+}
+
+void JsonTapeRdbSaveImpl(RedisModuleIO* rdb, const JsonTape* tape) {
+  saveTapeValue(rdb, tape, 0);
+}
+
+static void loadTapeString(RedisModuleIO* rdb, TapeBuilder* b, char tag) {
+  size_t len;
+  char* buf = RedisModule_LoadStringBuffer(rdb, &len);
+  tapeAppendString(b, tag, buf, len);
+  RedisModule_Free(buf);
+}
+
+static void loadTapeValue(RedisModuleIO* rdb, TapeBuilder* b) {
+  switch(RedisModule_LoadUnsigned(rdb)) {
+    case DOUBLE:
+      tapeAppendDouble(b, RedisModule_LoadDouble(rdb));
       break;
+    case INTEGER:
+      tapeAppendInteger(b, RedisModule_LoadSigned(rdb));
+      break;
+    case OBJECT: {
+      size_t size = RedisModule_LoadUnsigned(rdb);
+      size_t at = tapeOpen(b, '{');
+      for(size_t i = 0; i < size; i++) {
+        loadTapeString(rdb, b, 'k');
+        loadTapeValue(rdb, b);
+      }
+      tapeClose(b, at, size);
+      break;
+    }
+    case ARRAY: {
+      size_t size = RedisModule_LoadUnsigned(rdb);
+      size_t at = tapeOpen(b, '[');
+      for(size_t i = 0; i < size; i++) {
+        loadTapeValue(rdb, b);
+      }
+      tapeClose(b, at, size);
+      break;
+    }
     case STRING:
-      RedisModule_Free((void*)value->value.string.data);
-      RedisModule_Free(value);
+      loadTapeString(rdb, b, '"');
+      break;
+    case BOOLEAN:
+      tapeAppendAtom(b, RedisModule_LoadSigned(rdb) ? 't' : 'f');
+      break;
+    default:
+      tapeAppendAtom(b, 'n');
       break;
-    default: RedisModule_Free(value);
   }
 }
+
+JsonTape* JsonTapeRdbLoadImpl(RedisModuleIO* rdb) {
+  TapeBuilder b;
+  tapeBuilderInit(&b, 0, 0);
+  loadTapeValue(rdb, &b);
+  return tapeBuilderFinish(&b);
+}
@@ -2,36 +2,525 @@
 #include "value.h"
 #include "jsonToValue.h"
 #include "path.h"
+#include "pathCache.h"
+#include "descentIndex.h"
+#include "pathTrie.h"
+#include "jsonPatch.h"
+#include "jsonDiff.h"
+#include "defrag.h"
+#include "config.h"
+#include "structural.h"
+#include "tape.h"
+#include "number.h"
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#include <strings.h>
 
 static RedisModuleType* jsonType;
 
 void* JsonTypeRdbLoad(RedisModuleIO* rdb, int encver) {
-  struct JsonValue* json;
-  json = RedisModule_Calloc(1, sizeof(JsonValue));
-  JsonTypeRdbLoadImpl(rdb, json);
-  return json;
+  if(jsonConfig.storage == STORAGE_TAPE) {
+    RedisJsonValue* doc = docNew(false, 0);
+    doc->tape = JsonTapeRdbLoadImpl(rdb);
+    return doc;
+  }
+  RedisJsonValue* doc = docNew(jsonConfig.arena, 0);
+  size_t heapBytes = jsonHeapBytes();
+  doc->rootJson = jsonAlloc(doc->arena, sizeof(JsonValue));
+  JsonTypeRdbLoadImpl(rdb, doc->rootJson, doc->arena);
+  if(!doc->arena) doc->heapBytes = jsonHeapBytes() - heapBytes;
+  return doc;
 }
 
 void JsonTypeRdbSave(RedisModuleIO* rdb, void* value) {
-  JsonValue* json = (JsonValue*)value;
-  JsonTypeRdbSaveImpl(rdb, json);
+  RedisJsonValue* doc = (RedisJsonValue*)value;
+  if(doc->tape) {
+    JsonTapeRdbSaveImpl(rdb, doc->tape);
+  } else {
+    JsonTypeRdbSaveImpl(rdb, doc->rootJson);
+  }
+}
+
+void JsonTypeAofRewrite(RedisModuleIO* aof, RedisModuleString* key, void* value) {
+  JsonTypeAofRewriteImpl(aof, key, value);
 }
 
 void JsonTypeFree(void* value) {
-  JsonValue* json = (JsonValue*)value;
-  if(json) {
-    JsonTypeFreeImpl(json);
-    RedisModule_Free(json);
+  RedisJsonValue* doc = (RedisJsonValue*)value;
+  if(doc) {
+    docFree(doc);
+  }
+}
+
+/*
+ * With these, UNLINK, lazyfree-lazy-expire and the like hand large
+ * documents to Redis's lazyfree thread instead of freeing them
+ * inline.
+ */
+size_t JsonTypeFreeEffort(RedisModuleKeyOptCtx* ctx, const void* value) {
+  return docFreeEffort(value);
+}
+
+void JsonTypeUnlink(RedisModuleKeyOptCtx* ctx, const void* value) {
+  docUnlink((RedisJsonValue*)value);
+}
+
+/*
+ * COPY and the like. Tapes are shared rather than copied.
+ */
+void* JsonTypeCopy(RedisModuleKeyOptCtx* ctx, const void* value) {
+  return docCopy(value);
+}
+
+int JsonTypeDefrag(RedisModuleDefragCtx* ctx, RedisModuleString* key, void** value) {
+  return docDefrag(ctx, (RedisJsonValue**)value);
+}
+
+size_t JsonTypeMemUsage(RedisModuleKeyOptCtx* ctx, const void* value, size_t sampleSize) {
+  const RedisJsonValue* doc = value;
+  if(jsonConfig.memoryVerify && doc->rootJson && !doc->arena) {
+    size_t walked = valueMemory(doc->rootJson, NULL);
+    if(walked != doc->heapBytes) {
+      RedisModule_Log(
+        NULL,
+        "warning",
+        "document heap bytes counted %zu, walked %zu",
+        doc->heapBytes,
+        walked
+      );
+    }
+  }
+  return docMemory(doc);
+}
+
+/*
+ * Matches of one path are written as the value itself when there is
+ * one and as an array when there are several.
+ */
+static size_t matchesSize(RedisJsonValue* doc, const Vector* matches) {
+  size_t size = 2 + matches->len;
+  for(size_t i = 0; i < matches->len; i++) {
+    size += doc->tape ?
+      tapeSerializedSize(doc->tape, ((size_t*)matches->data)[i]) :
+      jsonSerializedSize(((JsonValue**)matches->data)[i]);
+  }
+  return size;
+}
+
+static char* writeMatches(RedisJsonValue* doc, const Vector* matches, char* out) {
+  bool wrap = matches->len > 1;
+  if(wrap) *out++ = '[';
+  for(size_t i = 0; i < matches->len; i++) {
+    if(i) *out++ = ',';
+    out = doc->tape ?
+      tapeWrite(doc->tape, ((size_t*)matches->data)[i], out) :
+      jsonWrite(((JsonValue**)matches->data)[i], out);
+  }
+  if(wrap) *out++ = ']';
+  return out;
+}
+
+/*
+ * FORMAT RESP3 replies with the same shape built from native types,
+ * an array standing in for the brackets around several matches.
+ */
+static void replyWithResp3Matches(
+  RedisModuleCtx* ctx,
+  RedisJsonValue* doc,
+  const Vector* matches
+) {
+  if(matches->len > 1) RedisModule_ReplyWithArray(ctx, matches->len);
+  for(size_t i = 0; i < matches->len; i++) {
+    if(doc->tape) {
+      tapeReplyWithResp3(ctx, doc->tape, ((size_t*)matches->data)[i]);
+    } else {
+      replyWithResp3(ctx, ((JsonValue**)matches->data)[i]);
+    }
+  }
+}
+
+/*
+ * Replies with the matches of a single path, or null when nothing
+ * matched.
+ */
+static Vector results;
+
+static void replyWithMatches(
+  RedisModuleCtx* ctx,
+  RedisJsonValue* doc,
+  const CompiledPath* path,
+  bool resp3
+) {
+  evalPath(ctx, doc, path, &results);
+  if(results.len && resp3) {
+    replyWithResp3Matches(ctx, doc, &results);
+  } else if(results.len) {
+    char* buf = RedisModule_Alloc(matchesSize(doc, &results));
+    size_t len = writeMatches(doc, &results, buf) - buf;
+    RedisModule_ReplyWithStringBuffer(ctx, buf, len);
+    RedisModule_Free(buf);
+  } else {
+    RedisModule_ReplyWithNull(ctx);
+  }
+  if(results.cap > 4096) vecDel(&results);
+}
+
+static int replyWithPath(
+  RedisModuleCtx* ctx,
+  RedisJsonValue* doc,
+  RedisModuleString* pathStr,
+  bool resp3
+) {
+  CompiledPath* path = pathCacheGet(pathStr);
+  if(!path) {
+    RedisModule_ReplyWithError(ctx, "ERR invalid path");
+    return REDISMODULE_ERR;
+  }
+  replyWithMatches(ctx, doc, path, resp3);
+  pathCacheRelease(path);
+  return REDISMODULE_OK;
+}
+
+/*
+ * Paths are written as JSON strings; they rarely need escaping.
+ */
+static size_t pathKeySize(const char* path, size_t len) {
+  size_t size = len + 2;
+  for(size_t i = 0; i < len; i++) {
+    unsigned char ch = path[i];
+    if(ch == '"' || ch == '\\') size += 1;
+    else if(ch < 0x20) size += 5;
+  }
+  return size;
+}
+
+static char* writePathKey(const char* path, size_t len, char* out) {
+  static const char hex[] = "0123456789abcdef";
+  *out++ = '"';
+  for(size_t i = 0; i < len; i++) {
+    unsigned char ch = path[i];
+    if(ch == '"' || ch == '\\') {
+      *out++ = '\\';
+      *out++ = ch;
+    } else if(ch < 0x20) {
+      memcpy(out, "\\u00", 4);
+      out[4] = hex[ch >> 4];
+      out[5] = hex[ch & 15];
+      out += 6;
+    } else {
+      *out++ = ch;
+    }
+  }
+  *out++ = '"';
+  return out;
+}
+
+/*
+ * Several paths reply with one JSON object from each path to its
+ * matches, null for none, or with a map of the same for FORMAT RESP3.
+ */
+static void replyWithPathsJson(
+  RedisModuleCtx* ctx,
+  RedisJsonValue* doc,
+  CompiledPath** paths,
+  int count,
+  const PathTrie* trie
+) {
+  size_t size = 2 + count;
+  for(int i = 0; i < count; i++) {
+    const Vector* matches = pathTrieResults(trie, i);
+    size += pathKeySize(paths[i]->source, paths[i]->sourceLen) + 1;
+    size += matches->len ? matchesSize(doc, matches) : 4;
   }
+  char* buf = RedisModule_Alloc(size);
+  char* out = buf;
+  *out++ = '{';
+  for(int i = 0; i < count; i++) {
+    const Vector* matches = pathTrieResults(trie, i);
+    if(i) *out++ = ',';
+    out = writePathKey(paths[i]->source, paths[i]->sourceLen, out);
+    *out++ = ':';
+    if(matches->len) {
+      out = writeMatches(doc, matches, out);
+    } else {
+      memcpy(out, "null", 4);
+      out += 4;
+    }
+  }
+  *out++ = '}';
+  RedisModule_ReplyWithStringBuffer(ctx, buf, out - buf);
+  RedisModule_Free(buf);
+}
+
+static void replyWithPathsResp3(
+  RedisModuleCtx* ctx,
+  RedisJsonValue* doc,
+  CompiledPath** paths,
+  int count,
+  const PathTrie* trie
+) {
+  RedisModule_ReplyWithMap(ctx, count);
+  for(int i = 0; i < count; i++) {
+    const Vector* matches = pathTrieResults(trie, i);
+    RedisModule_ReplyWithStringBuffer(
+      ctx,
+      paths[i]->source,
+      paths[i]->sourceLen
+    );
+    if(matches->len) {
+      replyWithResp3Matches(ctx, doc, matches);
+    } else {
+      RedisModule_ReplyWithNull(ctx);
+    }
+  }
+}
+
+/*
+ * The paths are merged into a trie first, so the steps they share are
+ * evaluated once.
+ */
+static int replyWithPaths(
+  RedisModuleCtx* ctx,
+  RedisJsonValue* doc,
+  RedisModuleString** pathStrs,
+  int count,
+  bool resp3
+) {
+  CompiledPath** paths = RedisModule_Alloc(count * sizeof(CompiledPath*));
+  for(int i = 0; i < count; i++) {
+    paths[i] = pathCacheGet(pathStrs[i]);
+    if(!paths[i]) {
+      while(i--) pathCacheRelease(paths[i]);
+      RedisModule_Free(paths);
+      RedisModule_ReplyWithError(ctx, "ERR invalid path");
+      return REDISMODULE_ERR;
+    }
+  }
+
+  PathTrie trie;
+  pathTrieInit(&trie);
+  for(int i = 0; i < count; i++) pathTrieAdd(&trie, paths[i]);
+  pathTrieEval(&trie, doc);
+  if(resp3) {
+    replyWithPathsResp3(ctx, doc, paths, count, &trie);
+  } else {
+    replyWithPathsJson(ctx, doc, paths, count, &trie);
+  }
+
+  pathTrieFree(&trie);
+  for(int i = 0; i < count; i++) pathCacheRelease(paths[i]);
+  RedisModule_Free(paths);
+  return REDISMODULE_OK;
+}
+
+typedef enum {
+  SET_ALWAYS,
+  SET_NX,
+  SET_XX
+} SetCondition;
+
+/* Nodes the last step of a JSON.SET path was applied to. */
+static Vector parents;
+
+/*
+ * Replacing values of a tape document splices the parsed fragment into
+ * a copy of its words, without going through a tree.
+ */
+static int setTapeMatches(
+  RedisModuleCtx* ctx,
+  RedisJsonValue* doc,
+  const char* json,
+  size_t len,
+  SetCondition cond
+) {
+  if(cond == SET_NX) return RedisModule_ReplyWithNull(ctx);
+  JsonTape* value = parseTape(ctx, json, len);
+  if(!value) {
+    RedisModule_ReplyWithError(ctx, "ERR invalid json value");
+    return REDISMODULE_ERR;
+  }
+  matchesSorted(&results);
+  JsonTape* tape = tapeSplice(doc->tape, results.data, results.len, value);
+  tapeFree(value);
+  tapeFree(doc->tape);
+  doc->tape = tape;
+  descentIndexInvalidate(doc);
+  if(results.cap > 4096) vecDel(&results);
+  RedisModule_ReplicateVerbatim(ctx);
+  return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+/*
+ * Parses only the fragment, into the document's own arena, and moves
+ * it into every match in place, or with `merge` applies it to them as
+ * a merge patch. When nothing matches and the path ends in a key, the
+ * fragment becomes a new member of each object the key was looked up
+ * in. Replies null when nothing was written.
+ */
+static int setPath(
+  RedisModuleCtx* ctx,
+  RedisJsonValue* doc,
+  const CompiledPath* path,
+  const char* json,
+  size_t len,
+  SetCondition cond,
+  bool merge
+) {
+  if(doc->tape && !merge) {
+    evalPath(ctx, doc, path, &results);
+    if(results.len) return setTapeMatches(ctx, doc, json, len, cond);
+    if(cond == SET_XX) return RedisModule_ReplyWithNull(ctx);
+  }
+
+  DocEdit edit;
+  docEditBegin(doc, &edit);
+  JsonArena* arena = edit.doc->arena;
+  evalPathSplit(ctx, edit.doc, path, &parents, &results);
+  matchesOutermost(&results);
+  matchesUnique(&parents);
+
+  size_t keyLen = 0;
+  const char* key = results.len ? NULL : pathLastKey(path, &keyLen);
+  if(
+    (cond == SET_NX && results.len) ||
+    (cond == SET_XX && !results.len) ||
+    (!results.len && (!key || !parents.len))
+  ) {
+    docEditEnd(doc, &edit, false);
+    return RedisModule_ReplyWithNull(ctx);
+  }
+  if(key && !jsonValidKey(key, keyLen)) {
+    docEditEnd(doc, &edit, false);
+    RedisModule_ReplyWithError(ctx, "ERR invalid key in path");
+    return REDISMODULE_ERR;
+  }
+
+  JsonValue* value = parseJson(ctx, json, len, arena);
+  if(!value) {
+    docEditEnd(doc, &edit, false);
+    RedisModule_ReplyWithError(ctx, "ERR invalid json value");
+    return REDISMODULE_ERR;
+  }
+
+  /*
+   * A match inside another one is dropped above, since writing the
+   * outer one frees it. The parsed value goes to the last write,
+   * copies to the others.
+   */
+  void (*write)(JsonArena*, JsonValue*, JsonValue*) =
+    merge ? valueMerge : valueReplace;
+  size_t writes = 0;
+  if(results.len) {
+    JsonValue** targets = results.data;
+    for(size_t i = results.len; i-- > 0; writes++) {
+      write(arena, targets[i], i ? valueCopy(arena, value) : value);
+    }
+  } else {
+    JsonValue** objects = parents.data;
+    size_t count = 0;
+    for(size_t i = 0; i < parents.len; i++) {
+      if(objects[i]->type == OBJECT) objects[count++] = objects[i];
+    }
+    /* Merging null into nothing leaves nothing. */
+    if(merge && value->type == NIL) count = 0;
+    for(size_t i = count; i-- > 0; writes++) {
+      JsonValue* src = i ? valueCopy(arena, value) : value;
+      struct JsonObject* object = &objects[i]->value.object;
+      size_t pos = objectFind(object, key, keyLen);
+      if(pos != OBJECT_NONE) {
+        write(arena, object->elements[pos]->value, src);
+      } else {
+        JsonKeyVal* keyVal = jsonAlloc(arena, sizeof(JsonKeyVal));
+        keySet(arena, keyVal, key, keyLen);
+        if(merge) {
+          JsonValue* created = jsonAlloc(arena, sizeof(JsonValue));
+          created->type = NIL;
+          valueMerge(arena, created, src);
+          src = created;
+        }
+        keyVal->value = src;
+        objectAppend(arena, object, keyVal);
+      }
+    }
+    if(!count) JsonTypeFreeImpl(value, arena);
+  }
+  if(results.cap > 4096) vecDel(&results);
+  if(parents.cap > 4096) vecDel(&parents);
+
+  docEditEnd(doc, &edit, writes > 0);
+  if(!writes) return RedisModule_ReplyWithNull(ctx);
+  RedisModule_ReplicateVerbatim(ctx);
+  return RedisModule_ReplyWithSimpleString(ctx, "OK");
 }
 
+/*
+ * Overwrites an existing tree document by diffing it against the
+ * parsed payload, so unchanged nodes keep their allocations. Replicas
+ * get the changes as one JSON.PATCH unless that would not be shorter
+ * than the command itself, and nothing when nothing changed.
+ */
+static int setDiff(
+  RedisModuleCtx* ctx,
+  RedisModuleString* keyName,
+  RedisJsonValue* doc,
+  const char* json,
+  size_t len
+) {
+  JsonArena* scratch = arenaNew(len);
+  JsonValue* value = parseJson(ctx, json, len, scratch);
+  if(!value) {
+    arenaFree(scratch);
+    RedisModule_ReplyWithError(ctx, "ERR invalid json value");
+    return REDISMODULE_ERR;
+  }
+
+  JsonDiff diff;
+  jsonDiffInit(&diff, len);
+  size_t heapBytes = jsonHeapBytes();
+  jsonDiffApply(doc->arena, doc->rootJson, value, &diff);
+  if(!doc->arena) doc->heapBytes += jsonHeapBytes() - heapBytes;
+  arenaFree(scratch);
+  if(diff.changes) {
+    descentIndexInvalidate(doc);
+    docDefragCancel(doc);
+    docCompact(doc);
+    if(diff.incomplete) {
+      RedisModule_ReplicateVerbatim(ctx);
+    } else {
+      RedisModule_Replicate(ctx, "JSON.PATCH", "sb", keyName, diff.ops, diff.len);
+    }
+  }
+  jsonDiffFree(&diff);
+  return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+/*
+ * JSON.SET key path json [NX|XX]. A root path replaces the whole
+ * document, or with redisjson.set-diff rewrites an existing tree in
+ * place through setDiff; anything else is written in place by
+ * setPath.
+ */
 int JsonSetRedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-  if(argc != 4) {
+  if(argc != 4 && argc != 5) {
     RedisModule_WrongArity(ctx);
     return REDISMODULE_ERR;
   }
   RedisModule_AutoMemory(ctx);
-  
+
+  SetCondition cond = SET_ALWAYS;
+  if(argc == 5) {
+    const char* flag = RedisModule_StringPtrLen(argv[4], NULL);
+    if(!strcasecmp(flag, "nx")) {
+      cond = SET_NX;
+    } else if(!strcasecmp(flag, "xx")) {
+      cond = SET_XX;
+    } else {
+      RedisModule_ReplyWithError(ctx, "ERR syntax error");
+      return REDISMODULE_ERR;
+    }
+  }
+
   RedisModuleKey* key = RedisModule_OpenKey(
     ctx,
     argv[1],
@@ -53,27 +542,79 @@ int JsonSetRedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
     return REDISMODULE_ERR;
   }
 
-  JsonValue* val = parseJson(ctx, json);
+  CompiledPath* path = pathCacheGet(argv[2]);
+  if(!path) {
+    RedisModule_ReplyWithError(ctx, "ERR invalid path");
+    return REDISMODULE_ERR;
+  }
+  bool exists = keyType != REDISMODULE_KEYTYPE_EMPTY;
 
-  if(keyType == REDISMODULE_KEYTYPE_EMPTY) {
-    RedisModule_ModuleTypeSetValue(key, jsonType, val);
-  } else {
-    JsonValue* v1 = RedisModule_ModuleTypeGetValue(key);
-    *v1 = *val;
+  if(path->codeLen) {
+    int ret;
+    if(exists) {
+      RedisJsonValue* doc = RedisModule_ModuleTypeGetValue(key);
+      ret = setPath(ctx, doc, path, json, len, cond, false);
+    } else {
+      RedisModule_ReplyWithError(ctx, "ERR new objects must be created at the root");
+      ret = REDISMODULE_ERR;
+    }
+    pathCacheRelease(path);
+    return ret;
+  }
+  pathCacheRelease(path);
+
+  if((cond == SET_NX && exists) || (cond == SET_XX && !exists)) {
+    return RedisModule_ReplyWithNull(ctx);
+  }
+  if(exists && jsonConfig.setDiff && jsonConfig.storage == STORAGE_TREE) {
+    RedisJsonValue* doc = RedisModule_ModuleTypeGetValue(key);
+    if(!doc->tape) return setDiff(ctx, argv[1], doc, json, len);
+  }
+
+  RedisJsonValue* doc = parseDocument(ctx, json, len);
+  if(!doc) {
+    RedisModule_ReplyWithError(ctx, "ERR invalid json value");
+    return REDISMODULE_ERR;
   }
 
+  RedisModule_ModuleTypeSetValue(key, jsonType, doc);
+  RedisModule_ReplicateVerbatim(ctx);
+
   RedisModule_ReplyWithSimpleString(ctx, "OK");
 
   return REDISMODULE_OK;
 }
 
+/*
+ * JSON.GET key [FORMAT STRING|RESP3] path [path ...]
+ */
 int JsonGetRedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
   if(argc < 3) {
     RedisModule_WrongArity(ctx);
     return REDISMODULE_ERR;
   }
   RedisModule_AutoMemory(ctx);
-  
+
+  bool resp3 = false;
+  int first = 2;
+  if(
+    argc >= 4 &&
+    !strcasecmp(RedisModule_StringPtrLen(argv[2], NULL), "format")
+  ) {
+    const char* format = RedisModule_StringPtrLen(argv[3], NULL);
+    if(!strcasecmp(format, "resp3")) {
+      resp3 = true;
+    } else if(strcasecmp(format, "string")) {
+      RedisModule_ReplyWithError(ctx, "ERR syntax error");
+      return REDISMODULE_ERR;
+    }
+    first = 4;
+    if(argc == first) {
+      RedisModule_WrongArity(ctx);
+      return REDISMODULE_ERR;
+    }
+  }
+
   if(RedisModule_KeyExists(ctx, argv[1]) == 0) {
     RedisModule_ReplyWithError(ctx, "Key does not exist");
     return REDISMODULE_ERR;
@@ -92,11 +633,45 @@ int JsonGetRedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
     return REDISMODULE_ERR;
   }
 
-  RedisModuleString* path = argv[2];
-  JsonValue* v = RedisModule_ModuleTypeGetValue(key);
-  v = evalPath(ctx, v, path);
-  RedisModuleString* out = jsonToString(ctx, v);
-  RedisModule_ReplyWithString(ctx, out);
+  RedisJsonValue* doc = RedisModule_ModuleTypeGetValue(key);
+  if(argc - first > 1) {
+    return replyWithPaths(ctx, doc, argv + first, argc - first, resp3);
+  }
+  return replyWithPath(ctx, doc, argv[first], resp3);
+}
+
+/*
+ * JSON.MGET key [key ...] path: the path is compiled once and each
+ * document's matches streamed into one array, with null for keys that
+ * are missing or not JSON.
+ */
+int JsonMgetRedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  if(argc < 3) {
+    RedisModule_WrongArity(ctx);
+    return REDISMODULE_ERR;
+  }
+  RedisModule_AutoMemory(ctx);
+
+  CompiledPath* path = pathCacheGet(argv[argc - 1]);
+  if(!path) {
+    RedisModule_ReplyWithError(ctx, "ERR invalid path");
+    return REDISMODULE_ERR;
+  }
+
+  RedisModule_ReplyWithArray(ctx, argc - 2);
+  for(int i = 1; i < argc - 1; i++) {
+    RedisModuleKey* key = RedisModule_OpenKey(ctx, argv[i], REDISMODULE_READ);
+    if(
+      RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY ||
+      RedisModule_ModuleTypeGetType(key) != jsonType
+    ) {
+      RedisModule_ReplyWithNull(ctx);
+    } else {
+      replyWithMatches(ctx, RedisModule_ModuleTypeGetValue(key), path, false);
+    }
+    RedisModule_CloseKey(key);
+  }
+  pathCacheRelease(path);
   return REDISMODULE_OK;
 }
 
@@ -129,6 +704,609 @@ int JsonDelRedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
   return REDISMODULE_OK;
 }
 
+/*
+ * Opens an existing JSON key for writing. Replies with an error and
+ * returns NULL when the key is missing or holds another type.
+ */
+static RedisJsonValue* openForWrite(RedisModuleCtx* ctx, RedisModuleString* name) {
+  RedisModuleKey* key = RedisModule_OpenKey(
+    ctx,
+    name,
+    REDISMODULE_READ | REDISMODULE_WRITE
+  );
+  if(RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY) {
+    RedisModule_ReplyWithError(ctx, "ERR no such key");
+    return NULL;
+  }
+  if(RedisModule_ModuleTypeGetType(key) != jsonType) {
+    RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    return NULL;
+  }
+  return RedisModule_ModuleTypeGetValue(key);
+}
+
+/*
+ * JSON.MERGE key path patch: RFC 7396 merge of `patch` into every
+ * match of the path, the root included, on an existing document.
+ */
+int JsonMergeRedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  if(argc != 4) {
+    RedisModule_WrongArity(ctx);
+    return REDISMODULE_ERR;
+  }
+  RedisModule_AutoMemory(ctx);
+
+  RedisJsonValue* doc = openForWrite(ctx, argv[1]);
+  if(!doc) return REDISMODULE_ERR;
+  CompiledPath* path = pathCacheGet(argv[2]);
+  if(!path) {
+    RedisModule_ReplyWithError(ctx, "ERR invalid path");
+    return REDISMODULE_ERR;
+  }
+  size_t len;
+  const char* json = RedisModule_StringPtrLen(argv[3], &len);
+  int ret = setPath(ctx, doc, path, json, len, SET_ALWAYS, true);
+  pathCacheRelease(path);
+  return ret;
+}
+
+/*
+ * JSON.PATCH key patch: an RFC 6902 operation list applied in order
+ * under one key open, all or nothing, and replicated as one command.
+ */
+int JsonPatchRedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  if(argc != 3) {
+    RedisModule_WrongArity(ctx);
+    return REDISMODULE_ERR;
+  }
+  RedisModule_AutoMemory(ctx);
+
+  RedisJsonValue* doc = openForWrite(ctx, argv[1]);
+  if(!doc) return REDISMODULE_ERR;
+
+  DocEdit edit;
+  docEditBegin(doc, &edit);
+  size_t len;
+  const char* json = RedisModule_StringPtrLen(argv[2], &len);
+  JsonValue* patch = parseJson(ctx, json, len, edit.doc->arena);
+  if(!patch) {
+    docEditEnd(doc, &edit, false);
+    RedisModule_ReplyWithError(ctx, "ERR invalid json value");
+    return REDISMODULE_ERR;
+  }
+  bool empty = patch->type == ARRAY && !patch->value.array.size;
+  const char* err = jsonPatchApply(
+    edit.doc->arena,
+    &edit.doc->rootJson,
+    patch
+  );
+  docEditEnd(doc, &edit, !err && !empty);
+  if(err) {
+    RedisModule_ReplyWithError(ctx, err);
+    return REDISMODULE_ERR;
+  }
+  if(!empty) RedisModule_ReplicateVerbatim(ctx);
+  return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+/*
+ * Sums stay exact integers while they fit and become doubles
+ * otherwise, as number literals do in the parser.
+ */
+typedef struct {
+  JsonValueType type;
+  int64_t integer;
+  double number;
+} Number;
+
+static bool valueNumber(const JsonValue* value, Number* out) {
+  out->type = value->type;
+  out->integer = value->value.integer;
+  out->number = value->value.number;
+  return out->type == INTEGER || out->type == DOUBLE;
+}
+
+static bool nodeNumber(RedisJsonValue* doc, uintptr_t node, Number* out) {
+  if(!doc->tape) return valueNumber((JsonValue*)node, out);
+  out->type = tapeType(doc->tape, node);
+  if(out->type == INTEGER) out->integer = tapeInteger(doc->tape, node);
+  if(out->type == DOUBLE) out->number = tapeDouble(doc->tape, node);
+  return out->type == INTEGER || out->type == DOUBLE;
+}
+
+static bool numberAdd(const Number* a, const Number* b, Number* sum) {
+  if(
+    a->type == INTEGER && b->type == INTEGER &&
+    !__builtin_add_overflow(a->integer, b->integer, &sum->integer)
+  ) {
+    sum->type = INTEGER;
+    return true;
+  }
+  sum->type = DOUBLE;
+  sum->number = (a->type == INTEGER ? (double)a->integer : a->number) +
+    (b->type == INTEGER ? (double)b->integer : b->number);
+  return isfinite(sum->number);
+}
+
+static void setNodeNumber(RedisJsonValue* doc, uintptr_t node, const Number* n) {
+  if(doc->tape) {
+    JsonTape* tape = tapeUnshare(doc->tape);
+    if(tape != doc->tape) {
+      descentIndexInvalidate(doc);
+      doc->tape = tape;
+    }
+    if(n->type == INTEGER) {
+      tapeSetInteger(doc->tape, node, n->integer);
+    } else {
+      tapeSetDouble(doc->tape, node, n->number);
+    }
+    return;
+  }
+  docDefragCancel(doc);
+  JsonValue* value = (JsonValue*)node;
+  value->type = n->type;
+  if(n->type == INTEGER) {
+    value->value.integer = n->integer;
+  } else {
+    value->value.number = n->number;
+  }
+}
+
+/*
+ * JSON.NUMINCRBY key path number. Every numeric match is updated in
+ * place, tapes included, since both number forms take the same words;
+ * the shape of the document does not change, so its descent index is
+ * kept. Replies with the new values, null for matches that are not
+ * numbers, and writes nothing unless every sum is finite.
+ */
+int JsonNumIncrByRedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  if(argc != 4) {
+    RedisModule_WrongArity(ctx);
+    return REDISMODULE_ERR;
+  }
+  RedisModule_AutoMemory(ctx);
+
+  RedisJsonValue* doc = openForWrite(ctx, argv[1]);
+  if(!doc) return REDISMODULE_ERR;
+
+  size_t len;
+  const char* str = RedisModule_StringPtrLen(argv[3], &len);
+  JsonValue* parsed = parseJson(ctx, str, len, NULL);
+  Number by;
+  if(!parsed || !valueNumber(parsed, &by)) {
+    if(parsed) JsonTypeFreeImpl(parsed, NULL);
+    RedisModule_ReplyWithError(ctx, "ERR increment is not a number");
+    return REDISMODULE_ERR;
+  }
+  JsonTypeFreeImpl(parsed, NULL);
+
+  CompiledPath* path = pathCacheGet(argv[2]);
+  if(!path) {
+    RedisModule_ReplyWithError(ctx, "ERR invalid path");
+    return REDISMODULE_ERR;
+  }
+  evalPath(ctx, doc, path, &results);
+  pathCacheRelease(path);
+  if(!results.len) return RedisModule_ReplyWithNull(ctx);
+  matchesUnique(&results);
+
+  uintptr_t* nodes = results.data;
+  size_t numbers = 0;
+  for(size_t i = 0; i < results.len; i++) {
+    Number value, sum;
+    if(!nodeNumber(doc, nodes[i], &value)) continue;
+    if(!numberAdd(&value, &by, &sum)) {
+      RedisModule_ReplyWithError(ctx, "ERR result is not a finite number");
+      return REDISMODULE_ERR;
+    }
+    ++numbers;
+  }
+  if(!numbers) {
+    RedisModule_ReplyWithError(ctx, "ERR value is not a number");
+    return REDISMODULE_ERR;
+  }
+
+  bool wrap = results.len > 1;
+  char* buf = RedisModule_Alloc(2 + results.len * (NUMBER_BUF_SIZE + 1));
+  char* out = buf;
+  if(wrap) *out++ = '[';
+  for(size_t i = 0; i < results.len; i++) {
+    if(i) *out++ = ',';
+    Number value, sum;
+    if(!nodeNumber(doc, nodes[i], &value)) {
+      memcpy(out, "null", 4);
+      out += 4;
+      continue;
+    }
+    numberAdd(&value, &by, &sum);
+    setNodeNumber(doc, nodes[i], &sum);
+    out += sum.type == INTEGER ?
+      formatInteger(sum.integer, out) :
+      formatDouble(sum.number, out);
+  }
+  if(wrap) *out++ = ']';
+  if(results.cap > 4096) vecDel(&results);
+
+  RedisModule_ReplicateVerbatim(ctx);
+  RedisModule_ReplyWithStringBuffer(ctx, buf, out - buf);
+  RedisModule_Free(buf);
+  return REDISMODULE_OK;
+}
+
+/*
+ * The array commands edit a tree view of the document (see DocEdit)
+ * and leave its matches in `results`. Replies and returns false when
+ * nothing matched or no match is an array.
+ */
+static bool arrayMatches(
+  RedisModuleCtx* ctx,
+  DocEdit* edit,
+  const CompiledPath* path
+) {
+  evalPath(ctx, edit->doc, path, &results);
+  if(!results.len) {
+    RedisModule_ReplyWithNull(ctx);
+    return false;
+  }
+  JsonValue** matches = results.data;
+  for(size_t i = 0; i < results.len; i++) {
+    if(matches[i]->type == ARRAY) return true;
+  }
+  RedisModule_ReplyWithError(ctx, "ERR value is not an array");
+  return false;
+}
+
+/*
+ * The new length of each match, null for the ones that are not
+ * arrays; a single match replies with the integer alone.
+ */
+static void replyWithLengths(RedisModuleCtx* ctx) {
+  JsonValue** matches = results.data;
+  if(results.len > 1) RedisModule_ReplyWithArray(ctx, results.len);
+  for(size_t i = 0; i < results.len; i++) {
+    if(matches[i]->type == ARRAY) {
+      RedisModule_ReplyWithLongLong(ctx, matches[i]->value.array.size);
+    } else {
+      RedisModule_ReplyWithNull(ctx);
+    }
+  }
+  if(results.cap > 4096) vecDel(&results);
+}
+
+/*
+ * Inserts the JSON values in `argv` at `index` of every array match,
+ * counting from the end when negative; SIZE_MAX appends. Values are
+ * parsed once into the document and copied for all but one match.
+ * Nothing is written if any index is out of range.
+ */
+static int arrayInsertValues(
+  RedisModuleCtx* ctx,
+  RedisJsonValue* doc,
+  const CompiledPath* path,
+  long long index,
+  RedisModuleString** argv,
+  int count
+) {
+  DocEdit edit;
+  docEditBegin(doc, &edit);
+  if(!arrayMatches(ctx, &edit, path)) {
+    docEditEnd(doc, &edit, false);
+    return REDISMODULE_OK;
+  }
+  matchesUnique(&results);
+
+  JsonValue** matches = results.data;
+  size_t last = 0;
+  for(size_t i = 0; i < results.len; i++) {
+    if(matches[i]->type != ARRAY) continue;
+    long long size = matches[i]->value.array.size;
+    if(index != LLONG_MAX && (index < -size || index > size)) {
+      docEditEnd(doc, &edit, false);
+      RedisModule_ReplyWithError(ctx, "ERR index out of range");
+      return REDISMODULE_ERR;
+    }
+    last = i;
+  }
+
+  JsonArena* arena = edit.doc->arena;
+  JsonValue** values = RedisModule_Alloc(count * sizeof(JsonValue*));
+  for(int i = 0; i < count; i++) {
+    size_t len;
+    const char* json = RedisModule_StringPtrLen(argv[i], &len);
+    values[i] = parseJson(ctx, json, len, arena);
+    if(!values[i]) {
+      while(i-- > 0) JsonTypeFreeImpl(values[i], arena);
+      RedisModule_Free(values);
+      docEditEnd(doc, &edit, false);
+      RedisModule_ReplyWithError(ctx, "ERR invalid json value");
+      return REDISMODULE_ERR;
+    }
+  }
+
+  JsonValue** copies = RedisModule_Alloc(count * sizeof(JsonValue*));
+  for(size_t i = 0; i <= last; i++) {
+    if(matches[i]->type != ARRAY) continue;
+    JsonArray* array = &matches[i]->value.array;
+    long long pos = index == LLONG_MAX ? (long long)array->size : index;
+    if(pos < 0) pos += array->size;
+    JsonValue** src = values;
+    if(i != last) {
+      for(int j = 0; j < count; j++) copies[j] = valueCopy(arena, values[j]);
+      src = copies;
+    }
+    arrayInsert(arena, array, pos, src, count);
+  }
+  RedisModule_Free(copies);
+  RedisModule_Free(values);
+
+  replyWithLengths(ctx);
+  docEditEnd(doc, &edit, true);
+  RedisModule_ReplicateVerbatim(ctx);
+  return REDISMODULE_OK;
+}
+
+/*
+ * JSON.ARRAPPEND key path json [json ...]
+ */
+int JsonArrAppendRedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  if(argc < 4) {
+    RedisModule_WrongArity(ctx);
+    return REDISMODULE_ERR;
+  }
+  RedisModule_AutoMemory(ctx);
+
+  RedisJsonValue* doc = openForWrite(ctx, argv[1]);
+  if(!doc) return REDISMODULE_ERR;
+  CompiledPath* path = pathCacheGet(argv[2]);
+  if(!path) {
+    RedisModule_ReplyWithError(ctx, "ERR invalid path");
+    return REDISMODULE_ERR;
+  }
+  int ret = arrayInsertValues(ctx, doc, path, LLONG_MAX, argv + 3, argc - 3);
+  pathCacheRelease(path);
+  return ret;
+}
+
+/*
+ * JSON.ARRINSERT key path index json [json ...]
+ */
+int JsonArrInsertRedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  if(argc < 5) {
+    RedisModule_WrongArity(ctx);
+    return REDISMODULE_ERR;
+  }
+  RedisModule_AutoMemory(ctx);
+
+  long long index;
+  if(
+    RedisModule_StringToLongLong(argv[3], &index) != REDISMODULE_OK ||
+    index == LLONG_MAX
+  ) {
+    RedisModule_ReplyWithError(ctx, "ERR index is not an integer");
+    return REDISMODULE_ERR;
+  }
+  RedisJsonValue* doc = openForWrite(ctx, argv[1]);
+  if(!doc) return REDISMODULE_ERR;
+  CompiledPath* path = pathCacheGet(argv[2]);
+  if(!path) {
+    RedisModule_ReplyWithError(ctx, "ERR invalid path");
+    return REDISMODULE_ERR;
+  }
+  int ret = arrayInsertValues(ctx, doc, path, index, argv + 4, argc - 4);
+  pathCacheRelease(path);
+  return ret;
+}
+
+/*
+ * JSON.ARRPOP key path [index]: removes the element at `index`, the
+ * last one by default, clamped to the array. Replies with the removed
+ * value, or null for empty arrays and matches that are not arrays.
+ */
+int JsonArrPopRedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  if(argc != 3 && argc != 4) {
+    RedisModule_WrongArity(ctx);
+    return REDISMODULE_ERR;
+  }
+  RedisModule_AutoMemory(ctx);
+
+  long long index = -1;
+  if(argc == 4 && RedisModule_StringToLongLong(argv[3], &index) != REDISMODULE_OK) {
+    RedisModule_ReplyWithError(ctx, "ERR index is not an integer");
+    return REDISMODULE_ERR;
+  }
+  RedisJsonValue* doc = openForWrite(ctx, argv[1]);
+  if(!doc) return REDISMODULE_ERR;
+  CompiledPath* path = pathCacheGet(argv[2]);
+  if(!path) {
+    RedisModule_ReplyWithError(ctx, "ERR invalid path");
+    return REDISMODULE_ERR;
+  }
+
+  DocEdit edit;
+  docEditBegin(doc, &edit);
+  bool found = arrayMatches(ctx, &edit, path);
+  pathCacheRelease(path);
+  if(!found) {
+    docEditEnd(doc, &edit, false);
+    return REDISMODULE_OK;
+  }
+
+  /*
+   * A match inside another one is dropped, since popping from the
+   * outer array may take the inner one with it.
+   */
+  matchesOutermost(&results);
+  JsonArena* arena = edit.doc->arena;
+  JsonValue** matches = results.data;
+  bool changed = false;
+  if(results.len > 1) RedisModule_ReplyWithArray(ctx, results.len);
+  for(size_t i = 0; i < results.len; i++) {
+    JsonArray* array = &matches[i]->value.array;
+    if(matches[i]->type != ARRAY || !array->size) {
+      RedisModule_ReplyWithNull(ctx);
+      continue;
+    }
+    long long size = array->size;
+    long long pos = index < 0 ? index + size : index;
+    if(pos < 0) pos = 0;
+    if(pos >= size) pos = size - 1;
+    JsonValue* removed = arrayRemove(array, pos);
+    replyWithJson(ctx, removed);
+    JsonTypeFreeImpl(removed, arena);
+    changed = true;
+  }
+  if(results.cap > 4096) vecDel(&results);
+
+  docEditEnd(doc, &edit, changed);
+  if(changed) RedisModule_ReplicateVerbatim(ctx);
+  return REDISMODULE_OK;
+}
+
+/*
+ * JSON.ARRTRIM key path start stop: keeps the inclusive range, both
+ * ends counting from the end when negative; an empty range empties
+ * the array.
+ */
+int JsonArrTrimRedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  if(argc != 5) {
+    RedisModule_WrongArity(ctx);
+    return REDISMODULE_ERR;
+  }
+  RedisModule_AutoMemory(ctx);
+
+  long long start, stop;
+  if(
+    RedisModule_StringToLongLong(argv[3], &start) != REDISMODULE_OK ||
+    RedisModule_StringToLongLong(argv[4], &stop) != REDISMODULE_OK
+  ) {
+    RedisModule_ReplyWithError(ctx, "ERR index is not an integer");
+    return REDISMODULE_ERR;
+  }
+  RedisJsonValue* doc = openForWrite(ctx, argv[1]);
+  if(!doc) return REDISMODULE_ERR;
+  CompiledPath* path = pathCacheGet(argv[2]);
+  if(!path) {
+    RedisModule_ReplyWithError(ctx, "ERR invalid path");
+    return REDISMODULE_ERR;
+  }
+
+  DocEdit edit;
+  docEditBegin(doc, &edit);
+  bool found = arrayMatches(ctx, &edit, path);
+  pathCacheRelease(path);
+  if(!found) {
+    docEditEnd(doc, &edit, false);
+    return REDISMODULE_OK;
+  }
+
+  /*
+   * Trimming an outer match can free an inner one, so only the
+   * outermost matches are trimmed.
+   */
+  matchesOutermost(&results);
+  JsonValue** matches = results.data;
+  bool changed = false;
+  if(results.len > 1) RedisModule_ReplyWithArray(ctx, results.len);
+  for(size_t i = 0; i < results.len; i++) {
+    if(matches[i]->type != ARRAY) {
+      RedisModule_ReplyWithNull(ctx);
+      continue;
+    }
+    JsonArray* array = &matches[i]->value.array;
+    long long size = array->size;
+    long long from = start < 0 ? start + size : start;
+    long long to = stop < 0 ? stop + size : stop;
+    if(from < 0) from = 0;
+    if(to >= size) to = size - 1;
+    if(from > to) {
+      from = to = 0;
+    } else {
+      ++to;
+    }
+    RedisModule_ReplyWithLongLong(ctx, to - from);
+    if(from == 0 && to == size) continue;
+    arrayTrim(edit.doc->arena, array, from, to);
+    changed = true;
+  }
+  if(results.cap > 4096) vecDel(&results);
+  docEditEnd(doc, &edit, changed);
+  if(changed) RedisModule_ReplicateVerbatim(ctx);
+  return REDISMODULE_OK;
+}
+
+/*
+ * JSON.DEBUG MEMORY key [path]: without a path, what MEMORY USAGE
+ * reports for the document; with one, the bytes under each match,
+ * found by walking it.
+ */
+int JsonDebugRedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  if(argc < 2) {
+    RedisModule_WrongArity(ctx);
+    return REDISMODULE_ERR;
+  }
+  if(strcasecmp(RedisModule_StringPtrLen(argv[1], NULL), "memory")) {
+    RedisModule_ReplyWithError(ctx, "ERR unknown subcommand");
+    return REDISMODULE_ERR;
+  }
+  if(argc != 3 && argc != 4) {
+    RedisModule_WrongArity(ctx);
+    return REDISMODULE_ERR;
+  }
+  RedisModule_AutoMemory(ctx);
+
+  RedisModuleKey* key = RedisModule_OpenKey(ctx, argv[2], REDISMODULE_READ);
+  if(RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY) {
+    return RedisModule_ReplyWithNull(ctx);
+  }
+  if(RedisModule_ModuleTypeGetType(key) != jsonType) {
+    RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    return REDISMODULE_ERR;
+  }
+  RedisJsonValue* doc = RedisModule_ModuleTypeGetValue(key);
+  if(argc == 3) return RedisModule_ReplyWithLongLong(ctx, docMemory(doc));
+
+  CompiledPath* path = pathCacheGet(argv[3]);
+  if(!path) {
+    RedisModule_ReplyWithError(ctx, "ERR invalid path");
+    return REDISMODULE_ERR;
+  }
+  evalPath(ctx, doc, path, &results);
+  pathCacheRelease(path);
+  if(!results.len) return RedisModule_ReplyWithNull(ctx);
+  if(results.len > 1) RedisModule_ReplyWithArray(ctx, results.len);
+  for(size_t i = 0; i < results.len; i++) {
+    RedisModule_ReplyWithLongLong(
+      ctx,
+      doc->tape ?
+        tapeMemory(doc->tape, ((size_t*)results.data)[i]) :
+        valueMemory(((JsonValue**)results.data)[i], doc->arena)
+    );
+  }
+  if(results.cap > 4096) vecDel(&results);
+  return REDISMODULE_OK;
+}
+
+void JsonInfo(RedisModuleInfoCtx* ctx, int forCrashReport) {
+  RedisModule_InfoAddSection(ctx, "pathcache");
+  RedisModule_InfoAddFieldULongLong(ctx, "hits", pathCacheStats.hits);
+  RedisModule_InfoAddFieldULongLong(ctx, "misses", pathCacheStats.misses);
+  RedisModule_InfoAddFieldULongLong(
+    ctx,
+    "evictions",
+    pathCacheStats.evictions
+  );
+  RedisModule_InfoAddFieldULongLong(ctx, "entries", pathCacheStats.entries);
+
+  RedisModule_InfoAddSection(ctx, "descentindex");
+  RedisModule_InfoAddFieldULongLong(ctx, "builds", descentIndexStats.builds);
+  RedisModule_InfoAddFieldULongLong(
+    ctx,
+    "overflows",
+    descentIndexStats.overflows
+  );
+  RedisModule_InfoAddFieldULongLong(ctx, "bytes", descentIndexStats.bytes);
+}
+
 int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
   if (RedisModule_Init(ctx, "redisjson", 0, REDISMODULE_APIVER_1) ==
           REDISMODULE_ERR)
@@ -138,8 +1316,13 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
     .version = REDISMODULE_TYPE_METHOD_VERSION,
     .rdb_load = JsonTypeRdbLoad,
     .rdb_save = JsonTypeRdbSave,
-    .aof_rewrite = NULL,
-    .free = JsonTypeFree
+    .aof_rewrite = JsonTypeAofRewrite,
+    .free = JsonTypeFree,
+    .mem_usage2 = JsonTypeMemUsage,
+    .free_effort2 = JsonTypeFreeEffort,
+    .unlink2 = JsonTypeUnlink,
+    .copy2 = JsonTypeCopy,
+    .defrag = JsonTypeDefrag
   };
 
   jsonType = RedisModule_CreateDataType(
@@ -151,6 +1334,17 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
   if(jsonType == NULL)
     return REDISMODULE_ERR;
 
+  if(registerJsonConfigs(ctx) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+  if(RedisModule_RegisterInfoFunc(ctx, JsonInfo) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+  RedisModule_Log(
+    ctx,
+    "notice",
+    "structural parser kernel: %s",
+    structuralKernelName()
+  );
+
   if(RedisModule_CreateCommand(
     ctx,
     "json.set",
@@ -165,6 +1359,13 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
     "readonly", 1, 1, 1) == REDISMODULE_ERR) {
     return REDISMODULE_ERR;
   }
+  if(RedisModule_CreateCommand(
+    ctx,
+    "json.mget",
+    JsonMgetRedisCommand,
+    "readonly", 1, -2, 1) == REDISMODULE_ERR) {
+    return REDISMODULE_ERR;
+  }
   if(RedisModule_CreateCommand(
     ctx,
     "json.del",
@@ -172,6 +1373,62 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
     "write", 1, 1, 1) == REDISMODULE_ERR) {
     return REDISMODULE_ERR;
   }
+  if(RedisModule_CreateCommand(
+    ctx,
+    "json.numincrby",
+    JsonNumIncrByRedisCommand,
+    "write deny-oom", 1, 1, 1) == REDISMODULE_ERR) {
+    return REDISMODULE_ERR;
+  }
+  if(RedisModule_CreateCommand(
+    ctx,
+    "json.arrappend",
+    JsonArrAppendRedisCommand,
+    "write deny-oom", 1, 1, 1) == REDISMODULE_ERR) {
+    return REDISMODULE_ERR;
+  }
+  if(RedisModule_CreateCommand(
+    ctx,
+    "json.arrinsert",
+    JsonArrInsertRedisCommand,
+    "write deny-oom", 1, 1, 1) == REDISMODULE_ERR) {
+    return REDISMODULE_ERR;
+  }
+  if(RedisModule_CreateCommand(
+    ctx,
+    "json.arrpop",
+    JsonArrPopRedisCommand,
+    "write", 1, 1, 1) == REDISMODULE_ERR) {
+    return REDISMODULE_ERR;
+  }
+  if(RedisModule_CreateCommand(
+    ctx,
+    "json.arrtrim",
+    JsonArrTrimRedisCommand,
+    "write", 1, 1, 1) == REDISMODULE_ERR) {
+    return REDISMODULE_ERR;
+  }
+  if(RedisModule_CreateCommand(
+    ctx,
+    "json.merge",
+    JsonMergeRedisCommand,
+    "write deny-oom", 1, 1, 1) == REDISMODULE_ERR) {
+    return REDISMODULE_ERR;
+  }
+  if(RedisModule_CreateCommand(
+    ctx,
+    "json.patch",
+    JsonPatchRedisCommand,
+    "write deny-oom", 1, 1, 1) == REDISMODULE_ERR) {
+    return REDISMODULE_ERR;
+  }
+  if(RedisModule_CreateCommand(
+    ctx,
+    "json.debug",
+    JsonDebugRedisCommand,
+    "readonly", 2, 2, 1) == REDISMODULE_ERR) {
+    return REDISMODULE_ERR;
+  }
 
   return REDISMODULE_OK;
 }
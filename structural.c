@@ -0,0 +1,259 @@
+#include "structural.h"
+#include "redismodule.h"
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define STRUCTURAL_X86 1
+#endif
+
+#define BLOCK_SIZE 64
+
+typedef struct {
+  uint64_t backslash;
+  uint64_t quote;
+  uint64_t op;
+  uint64_t space;
+} BlockMasks;
+
+typedef void (*ClassifyFn)(const uint8_t* block, BlockMasks* masks);
+
+static void classifyScalar(const uint8_t* block, BlockMasks* masks) {
+  uint64_t backslash = 0, quote = 0, op = 0, space = 0;
+  for(int i = 0; i < BLOCK_SIZE; i++) {
+    uint64_t bit = 1ULL << i;
+    switch(block[i]) {
+      case '\\': backslash |= bit; break;
+      case '"': quote |= bit; break;
+      case '{': case '}': case '[': case ']': case ':': case ',':
+        op |= bit;
+        break;
+      case ' ': case '\t': case '\n': case '\r':
+        space |= bit;
+        break;
+      default: break;
+    }
+  }
+  masks->backslash = backslash;
+  masks->quote = quote;
+  masks->op = op;
+  masks->space = space;
+}
+
+#ifdef STRUCTURAL_X86
+
+/*
+ * '{' / '[' and '}' / ']' differ only in bit 0x20, so or-ing it in
+ * folds the four brackets into two compares.
+ */
+static inline uint64_t sse2Mask(const __m128i* v, int which) {
+  uint64_t out = 0;
+  for(int i = 0; i < 4; i++) {
+    __m128i m;
+    switch(which) {
+      case 0:
+        m = _mm_cmpeq_epi8(v[i], _mm_set1_epi8('\\'));
+        break;
+      case 1:
+        m = _mm_cmpeq_epi8(v[i], _mm_set1_epi8('"'));
+        break;
+      case 2: {
+        __m128i folded = _mm_or_si128(v[i], _mm_set1_epi8(0x20));
+        m = _mm_or_si128(
+          _mm_or_si128(
+            _mm_cmpeq_epi8(folded, _mm_set1_epi8('{')),
+            _mm_cmpeq_epi8(folded, _mm_set1_epi8('}'))
+          ),
+          _mm_or_si128(
+            _mm_cmpeq_epi8(v[i], _mm_set1_epi8(':')),
+            _mm_cmpeq_epi8(v[i], _mm_set1_epi8(','))
+          )
+        );
+        break;
+      }
+      default:
+        m = _mm_or_si128(
+          _mm_or_si128(
+            _mm_cmpeq_epi8(v[i], _mm_set1_epi8(' ')),
+            _mm_cmpeq_epi8(v[i], _mm_set1_epi8('\t'))
+          ),
+          _mm_or_si128(
+            _mm_cmpeq_epi8(v[i], _mm_set1_epi8('\n')),
+            _mm_cmpeq_epi8(v[i], _mm_set1_epi8('\r'))
+          )
+        );
+        break;
+    }
+    out |= (uint64_t)(uint32_t)_mm_movemask_epi8(m) << (i * 16);
+  }
+  return out;
+}
+
+static void classifySse2(const uint8_t* block, BlockMasks* masks) {
+  __m128i v[4];
+  for(int i = 0; i < 4; i++) {
+    v[i] = _mm_loadu_si128((const __m128i*)(block + i * 16));
+  }
+  masks->backslash = sse2Mask(v, 0);
+  masks->quote = sse2Mask(v, 1);
+  masks->op = sse2Mask(v, 2);
+  masks->space = sse2Mask(v, 3);
+}
+
+__attribute__((target("avx2")))
+static void classifyAvx2(const uint8_t* block, BlockMasks* masks) {
+  __m256i lo = _mm256_loadu_si256((const __m256i*)block);
+  __m256i hi = _mm256_loadu_si256((const __m256i*)(block + 32));
+  __m256i v[2] = { lo, hi };
+  uint64_t backslash = 0, quote = 0, op = 0, space = 0;
+  for(int i = 0; i < 2; i++) {
+    __m256i folded = _mm256_or_si256(v[i], _mm256_set1_epi8(0x20));
+    __m256i b = _mm256_cmpeq_epi8(v[i], _mm256_set1_epi8('\\'));
+    __m256i q = _mm256_cmpeq_epi8(v[i], _mm256_set1_epi8('"'));
+    __m256i o = _mm256_or_si256(
+      _mm256_or_si256(
+        _mm256_cmpeq_epi8(folded, _mm256_set1_epi8('{')),
+        _mm256_cmpeq_epi8(folded, _mm256_set1_epi8('}'))
+      ),
+      _mm256_or_si256(
+        _mm256_cmpeq_epi8(v[i], _mm256_set1_epi8(':')),
+        _mm256_cmpeq_epi8(v[i], _mm256_set1_epi8(','))
+      )
+    );
+    __m256i s = _mm256_or_si256(
+      _mm256_or_si256(
+        _mm256_cmpeq_epi8(v[i], _mm256_set1_epi8(' ')),
+        _mm256_cmpeq_epi8(v[i], _mm256_set1_epi8('\t'))
+      ),
+      _mm256_or_si256(
+        _mm256_cmpeq_epi8(v[i], _mm256_set1_epi8('\n')),
+        _mm256_cmpeq_epi8(v[i], _mm256_set1_epi8('\r'))
+      )
+    );
+    int shift = i * 32;
+    backslash |= (uint64_t)(uint32_t)_mm256_movemask_epi8(b) << shift;
+    quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8(q) << shift;
+    op |= (uint64_t)(uint32_t)_mm256_movemask_epi8(o) << shift;
+    space |= (uint64_t)(uint32_t)_mm256_movemask_epi8(s) << shift;
+  }
+  masks->backslash = backslash;
+  masks->quote = quote;
+  masks->op = op;
+  masks->space = space;
+}
+
+#endif
+
+static ClassifyFn classifyBlock;
+static const char* kernelName;
+
+static void selectKernel(void) {
+#ifdef STRUCTURAL_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    classifyBlock = classifyAvx2;
+    kernelName = "avx2";
+    return;
+  }
+  classifyBlock = classifySse2;
+  kernelName = "sse2";
+  return;
+#endif
+  classifyBlock = classifyScalar;
+  kernelName = "scalar";
+}
+
+const char* structuralKernelName(void) {
+  if(!classifyBlock) selectKernel();
+  return kernelName;
+}
+
+/*
+ * Bits of the block that are escaped by an odd run of backslashes,
+ * carrying a run that crosses the block boundary in `nextIsEscaped`.
+ */
+static inline uint64_t findEscaped(uint64_t backslash, uint64_t* nextIsEscaped) {
+  const uint64_t evenBits = 0x5555555555555555ULL;
+  backslash &= ~*nextIsEscaped;
+  uint64_t followsEscape = (backslash << 1) | *nextIsEscaped;
+  uint64_t oddStarts = backslash & ~evenBits & ~followsEscape;
+  uint64_t evenSequences;
+  *nextIsEscaped = __builtin_add_overflow(oddStarts, backslash, &evenSequences);
+  uint64_t invertMask = evenSequences << 1;
+  return (evenBits ^ invertMask) & followsEscape;
+}
+
+static inline uint64_t prefixXor(uint64_t bits) {
+  bits ^= bits << 1;
+  bits ^= bits << 2;
+  bits ^= bits << 4;
+  bits ^= bits << 8;
+  bits ^= bits << 16;
+  bits ^= bits << 32;
+  return bits;
+}
+
+static void reserve(StructuralIndex* index, size_t extra) {
+  if(index->len + extra <= index->cap) return;
+  size_t cap = index->cap ? index->cap : 256;
+  while(cap < index->len + extra) cap *= 2;
+  index->indexes = RedisModule_Realloc(index->indexes, cap * sizeof(uint32_t));
+  index->cap = cap;
+}
+
+StructuralStatus buildStructuralIndex(
+  const char* json,
+  size_t len,
+  StructuralIndex* index
+) {
+  if(len >= UINT32_MAX) return STRUCTURAL_TOO_LARGE;
+  if(!classifyBlock) selectKernel();
+
+  index->len = 0;
+  reserve(index, 1);
+
+  uint64_t prevEscaped = 0;
+  uint64_t prevInString = 0;
+  uint64_t prevScalar = 0;
+  for(size_t base = 0; base < len; base += BLOCK_SIZE) {
+    uint8_t tail[BLOCK_SIZE];
+    const uint8_t* block = (const uint8_t*)json + base;
+    if(len - base < BLOCK_SIZE) {
+      memset(tail, ' ', BLOCK_SIZE);
+      memcpy(tail, block, len - base);
+      block = tail;
+    }
+
+    BlockMasks masks;
+    classifyBlock(block, &masks);
+
+    uint64_t escaped = findEscaped(masks.backslash, &prevEscaped);
+    uint64_t quote = masks.quote & ~escaped;
+    uint64_t inString = prefixXor(quote) ^ prevInString;
+    prevInString = (uint64_t)((int64_t)inString >> 63);
+
+    uint64_t scalar = ~(masks.op | masks.space | quote);
+    uint64_t scalarStart = scalar & ~((scalar << 1) | prevScalar);
+    prevScalar = scalar >> 63;
+
+    uint64_t structurals = ((masks.op | scalarStart) & ~inString) | quote;
+
+    reserve(index, BLOCK_SIZE + 1);
+    uint32_t* out = index->indexes + index->len;
+    while(structurals) {
+      *out++ = (uint32_t)(base + __builtin_ctzll(structurals));
+      structurals &= structurals - 1;
+    }
+    index->len = out - index->indexes;
+  }
+  index->indexes[index->len] = (uint32_t)len;
+
+  return prevInString ? STRUCTURAL_UNCLOSED_STRING : STRUCTURAL_OK;
+}
+
+void freeStructuralIndex(StructuralIndex* index) {
+  if(index->indexes) RedisModule_Free(index->indexes);
+  index->indexes = NULL;
+  index->len = 0;
+  index->cap = 0;
+}
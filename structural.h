@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Stage 1 of the structural parser: the positions of every quote,
+ * every `{}[]:,` outside of strings and the first byte of every
+ * bare scalar (numbers, true, false, null), in input order.
+ * `indexes[len]` always holds the input length as a sentinel.
+ */
+typedef struct {
+  uint32_t* indexes;
+  size_t len;
+  size_t cap;
+} StructuralIndex;
+
+typedef enum {
+  STRUCTURAL_OK = 0,
+  STRUCTURAL_UNCLOSED_STRING,
+  STRUCTURAL_TOO_LARGE
+} StructuralStatus;
+
+StructuralStatus buildStructuralIndex(
+  const char* json,
+  size_t len,
+  StructuralIndex* index
+);
+
+void freeStructuralIndex(StructuralIndex* index);
+
+const char* structuralKernelName(void);
@@ -0,0 +1,779 @@
+#include "tape.h"
+#include "redismodule.h"
+#include "number.h"
+#include "jsonToValue.h"
+#include "config.h"
+#include <string.h>
+
+static inline uint64_t tapeWord(char tag, uint64_t payload) {
+  return ((uint64_t)(uint8_t)tag << 56) | payload;
+}
+
+static inline void reserveWords(TapeBuilder* b, size_t extra) {
+  if(b->len + extra <= b->cap) return;
+  size_t cap = b->cap ? b->cap : 64;
+  while(cap < b->len + extra) cap *= 2;
+  b->words = RedisModule_Realloc(b->words, cap * sizeof(uint64_t));
+  b->cap = cap;
+}
+
+static inline void reserveStrings(TapeBuilder* b, size_t extra) {
+  if(b->stringsLen + extra <= b->stringsCap) return;
+  size_t cap = b->stringsCap ? b->stringsCap : 256;
+  while(cap < b->stringsLen + extra) cap *= 2;
+  b->strings = RedisModule_Realloc(b->strings, cap);
+  b->stringsCap = cap;
+}
+
+void tapeBuilderInit(TapeBuilder* b, size_t wordsHint, size_t stringsHint) {
+  memset(b, 0, sizeof(TapeBuilder));
+  reserveWords(b, wordsHint);
+  reserveStrings(b, stringsHint);
+}
+
+size_t tapeOpen(TapeBuilder* b, char tag) {
+  reserveWords(b, 1);
+  b->words[b->len] = tapeWord(tag, 0);
+  return b->len++;
+}
+
+void tapeClose(TapeBuilder* b, size_t at, size_t count) {
+  uint64_t saturated = count < TAPE_COUNT_MAX ? count : TAPE_COUNT_MAX;
+  char tag = (char)(b->words[at] >> 56);
+  b->words[at] = tapeWord(tag, (saturated << 32) | (uint32_t)b->len);
+}
+
+void tapeAppendString(TapeBuilder* b, char tag, const char* str, size_t len) {
+  uint32_t len32 = (uint32_t)len;
+  reserveStrings(b, sizeof(len32) + len);
+  reserveWords(b, 1);
+  b->words[b->len++] = tapeWord(tag, b->stringsLen);
+  memcpy(b->strings + b->stringsLen, &len32, sizeof(len32));
+  memcpy(b->strings + b->stringsLen + sizeof(len32), str, len);
+  b->stringsLen += sizeof(len32) + len;
+}
+
+void tapeAppendInteger(TapeBuilder* b, int64_t value) {
+  reserveWords(b, 2);
+  b->words[b->len++] = tapeWord('l', 0);
+  memcpy(&b->words[b->len++], &value, sizeof(value));
+}
+
+void tapeAppendDouble(TapeBuilder* b, double value) {
+  reserveWords(b, 2);
+  b->words[b->len++] = tapeWord('d', 0);
+  memcpy(&b->words[b->len++], &value, sizeof(value));
+}
+
+void tapeAppendAtom(TapeBuilder* b, char tag) {
+  reserveWords(b, 1);
+  b->words[b->len++] = tapeWord(tag, 0);
+}
+
+/*
+ * Indexes every object at or above the threshold, in tape order so
+ * lookups can binary search them.
+ */
+static void buildObjectIndexes(JsonTape* tape) {
+  size_t threshold = jsonConfig.objectIndexThreshold;
+  if(!threshold) return;
+  size_t cap = 0;
+  for(size_t at = 0; at < tape->len;) {
+    char tag = tapeTag(tape, at);
+    if(tag == '{' && tapeSize(tape, at) >= threshold) {
+      ObjectIndex* index = objectIndexNew(NULL, tapeSize(tape, at));
+      size_t end = tapeNext(tape, at);
+      for(size_t i = at + 1; i < end; i = tapeNext(tape, i + 1)) {
+        size_t len;
+        const char* key = tapeString(tape, i, &len);
+        objectIndexAdd(index, hashKey(key, len), i);
+      }
+      if(tape->objectIndexCount == cap) {
+        cap = cap ? cap * 2 : 4;
+        tape->objectIndexes = RedisModule_Realloc(
+          tape->objectIndexes,
+          cap * sizeof(TapeObjectIndex)
+        );
+      }
+      tape->objectIndexes[tape->objectIndexCount].at = at;
+      tape->objectIndexes[tape->objectIndexCount++].index = index;
+    }
+    at = tag == '{' || tag == '[' ? at + 1 : tapeNext(tape, at);
+  }
+}
+
+static void finishTape(JsonTape* tape) {
+  tape->refs = 1;
+  buildObjectIndexes(tape);
+  tape->bytes = RedisModule_MallocSize(tape);
+  if(tape->objectIndexes) {
+    tape->bytes += RedisModule_MallocSize(tape->objectIndexes);
+  }
+  for(size_t i = 0; i < tape->objectIndexCount; i++) {
+    tape->bytes += RedisModule_MallocSize(tape->objectIndexes[i].index);
+  }
+}
+
+static ObjectIndex* findObjectIndex(const JsonTape* tape, size_t at) {
+  size_t lo = 0, hi = tape->objectIndexCount;
+  while(lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if(tape->objectIndexes[mid].at < at) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if(lo < tape->objectIndexCount && tape->objectIndexes[lo].at == at) {
+    return tape->objectIndexes[lo].index;
+  }
+  return NULL;
+}
+
+JsonTape* tapeBuilderFinish(TapeBuilder* b) {
+  size_t wordsSize = b->len * sizeof(uint64_t);
+  JsonTape* tape = RedisModule_Alloc(
+    sizeof(JsonTape) + wordsSize + b->stringsLen
+  );
+  tape->len = b->len;
+  tape->stringsLen = b->stringsLen;
+  tape->strings = (char*)(tape->words + b->len);
+  tape->objectIndexes = NULL;
+  tape->objectIndexCount = 0;
+  memcpy(tape->words, b->words, wordsSize);
+  if(b->stringsLen) memcpy(tape->strings, b->strings, b->stringsLen);
+  RedisModule_Free(b->words);
+  RedisModule_Free(b->strings);
+  memset(b, 0, sizeof(TapeBuilder));
+  finishTape(tape);
+  return tape;
+}
+
+static inline bool isSpace(char ch) {
+  return ch == ' ' || ch == '\n' || ch == '\t' || ch == '\r';
+}
+
+static void appendScalarToken(TapeBuilder* b, const char* p, const char* end) {
+  while(isSpace(end[-1])) --end;
+  switch(*p) {
+    case 't': case 'f': case 'n':
+      tapeAppendAtom(b, *p);
+      break;
+    default: {
+      int64_t integer;
+      double number;
+      if(parseNumber(p, end - p, &integer, &number) == NUMBER_INTEGER) {
+        tapeAppendInteger(b, integer);
+      } else {
+        tapeAppendDouble(b, number);
+      }
+      break;
+    }
+  }
+}
+
+/*
+ * Every entry of the index yields at most one word except a number,
+ * which takes two but is always followed by a `,`, a close or the end
+ * of input, so `count + 1` words is an upper bound. Strings trade
+ * their quotes for a four byte length, so the input length is only
+ * a close estimate of the string bytes.
+ */
+JsonTape* tapeFromIndex(
+  const char* json,
+  const uint32_t* indexes,
+  size_t count
+) {
+  TapeBuilder b;
+  tapeBuilderInit(&b, count + 1, indexes[count]);
+
+  size_t open[JSON_MAX_DEPTH];
+  size_t counts[JSON_MAX_DEPTH];
+  size_t depth = 0;
+  bool expectKey = false;
+  for(size_t pos = 0; pos < count; pos++) {
+    size_t at = indexes[pos];
+    char ch = json[at];
+    switch(ch) {
+      case '{': case '[':
+        if(depth) ++counts[depth - 1];
+        open[depth] = tapeOpen(&b, ch);
+        counts[depth++] = 0;
+        expectKey = ch == '{';
+        break;
+      case '}': case ']':
+        --depth;
+        tapeClose(&b, open[depth], counts[depth]);
+        break;
+      case ',':
+        expectKey = (char)(b.words[open[depth - 1]] >> 56) == '{';
+        break;
+      case ':':
+        break;
+      case '"':
+        if(!expectKey && depth) ++counts[depth - 1];
+        tapeAppendString(
+          &b,
+          expectKey ? 'k' : '"',
+          json + at + 1,
+          indexes[pos + 1] - at - 1
+        );
+        expectKey = false;
+        ++pos;
+        break;
+      default:
+        if(depth) ++counts[depth - 1];
+        appendScalarToken(&b, json + at, json + indexes[pos + 1]);
+        break;
+    }
+  }
+  return tapeBuilderFinish(&b);
+}
+
+static void appendValue(TapeBuilder* b, JsonValue* value) {
+  switch(value->type) {
+    case OBJECT: {
+      struct JsonObject* object = &value->value.object;
+      size_t at = tapeOpen(b, '{');
+      for(size_t i = 0; i < object->size; i++) {
+        JsonKeyVal* keyVal = object->elements[i];
+        tapeAppendString(b, 'k', keyData(keyVal), keyVal->keyLen);
+        appendValue(b, object->elements[i]->value);
+      }
+      tapeClose(b, at, object->size);
+      break;
+    }
+    case ARRAY: {
+      JsonArray* array = &value->value.array;
+      size_t at = tapeOpen(b, '[');
+      for(size_t i = 0; i < array->size; i++) {
+        appendValue(b, array->array[i]);
+      }
+      tapeClose(b, at, array->size);
+      break;
+    }
+    case STRING:
+      tapeAppendString(
+        b,
+        '"',
+        value->value.string.data,
+        value->value.string.size
+      );
+      break;
+    case INTEGER:
+      tapeAppendInteger(b, value->value.integer);
+      break;
+    case DOUBLE:
+      tapeAppendDouble(b, value->value.number);
+      break;
+    case BOOLEAN:
+      tapeAppendAtom(b, value->value.boolean ? 't' : 'f');
+      break;
+    case NIL:
+      tapeAppendAtom(b, 'n');
+      break;
+  }
+}
+
+JsonTape* tapeFromValue(JsonValue* value) {
+  TapeBuilder b;
+  tapeBuilderInit(&b, 0, 0);
+  appendValue(&b, value);
+  return tapeBuilderFinish(&b);
+}
+
+JsonValue* tapeToValue(const JsonTape* tape, size_t at, JsonArena* arena) {
+  JsonValue* value;
+  switch(tapeTag(tape, at)) {
+    case '{': {
+      value = allocObject(arena, tapeSize(tape, at));
+      size_t end = tapeNext(tape, at);
+      size_t pos = 0;
+      for(size_t i = at + 1; i < end; i = tapeNext(tape, i + 1)) {
+        size_t len;
+        const char* key = tapeString(tape, i, &len);
+        JsonKeyVal* keyVal = jsonAlloc(arena, sizeof(JsonKeyVal));
+        keySet(arena, keyVal, key, len);
+        keyVal->value = tapeToValue(tape, i + 1, arena);
+        value->value.object.elements[pos++] = keyVal;
+      }
+      objectReindex(arena, &value->value.object);
+      return value;
+    }
+    case '[': {
+      size_t size = tapeSize(tape, at);
+      value = jsonAlloc(arena, sizeof(JsonValue));
+      value->type = ARRAY;
+      value->value.array.size = size;
+      value->value.array.cap = size;
+      if(size) {
+        value->value.array.array = jsonAlloc(arena, size * sizeof(JsonValue*));
+      }
+      size_t end = tapeNext(tape, at);
+      size_t pos = 0;
+      for(size_t i = at + 1; i < end; i = tapeNext(tape, i)) {
+        value->value.array.array[pos++] = tapeToValue(tape, i, arena);
+      }
+      return value;
+    }
+    default:
+      break;
+  }
+  value = jsonAlloc(arena, sizeof(JsonValue));
+  value->type = tapeType(tape, at);
+  switch(value->type) {
+    case STRING: {
+      size_t len;
+      const char* str = tapeString(tape, at, &len);
+      value->value.string.data = jsonStrndup(arena, str, len);
+      value->value.string.size = len;
+      break;
+    }
+    case INTEGER:
+      value->value.integer = tapeInteger(tape, at);
+      break;
+    case DOUBLE:
+      value->value.number = tapeDouble(tape, at);
+      break;
+    case BOOLEAN:
+      value->value.boolean = tapeTag(tape, at) == 't';
+      break;
+    default:
+      break;
+  }
+  return value;
+}
+
+/*
+ * Replaced values in tape order. `shrink[i]` is the number of words
+ * the first i + 1 of them take out, each putting `grow` back.
+ */
+typedef struct {
+  size_t* starts;
+  size_t* shrink;
+  size_t count;
+  size_t grow;
+} Splice;
+
+/*
+ * Where word `at` of the old tape lands: shifted by every replacement
+ * starting before it.
+ */
+static size_t splicedPosition(const Splice* splice, size_t at) {
+  size_t lo = 0, hi = splice->count;
+  while(lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if(splice->starts[mid] < at) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return at + lo * splice->grow - (lo ? splice->shrink[lo - 1] : 0);
+}
+
+static inline size_t stringSize(const JsonTape* tape, size_t at) {
+  uint32_t len;
+  memcpy(&len, tape->strings + tapePayload(tape, at), sizeof(len));
+  return sizeof(len) + len;
+}
+
+static inline size_t wordWidth(const JsonTape* tape, size_t at) {
+  char tag = tapeTag(tape, at);
+  return tag == 'l' || tag == 'd' ? 2 : 1;
+}
+
+/*
+ * Copies words [from, to) of `src` to `out` at `pos`, moving strings
+ * to the end of what `out` holds so far. Container ends are mapped
+ * through `splice`, or shifted to `pos` when it is NULL.
+ */
+static size_t copyWords(
+  JsonTape* out,
+  size_t pos,
+  const JsonTape* src,
+  size_t from,
+  size_t to,
+  const Splice* splice
+) {
+  size_t base = pos;
+  for(size_t i = from; i < to; i++) {
+    char tag = tapeTag(src, i);
+    uint64_t word = src->words[i];
+    switch(tag) {
+      case '{': case '[': {
+        size_t end = (uint32_t)word;
+        end = splice ? splicedPosition(splice, end) : end - from + base;
+        word = (word & ~(uint64_t)UINT32_MAX) | (uint32_t)end;
+        break;
+      }
+      case 'k': case '"': {
+        size_t size = stringSize(src, i);
+        memcpy(
+          out->strings + out->stringsLen,
+          src->strings + tapePayload(src, i),
+          size
+        );
+        word = tapeWord(tag, out->stringsLen);
+        out->stringsLen += size;
+        break;
+      }
+      case 'l': case 'd':
+        out->words[pos++] = word;
+        word = src->words[++i];
+        break;
+    }
+    out->words[pos++] = word;
+  }
+  return pos;
+}
+
+JsonTape* tapeSplice(
+  const JsonTape* tape,
+  const size_t* at,
+  size_t count,
+  const JsonTape* value
+) {
+  Splice splice;
+  splice.starts = RedisModule_Alloc(2 * count * sizeof(size_t));
+  splice.shrink = splice.starts + count;
+  splice.count = 0;
+  splice.grow = value->len;
+  size_t words = tape->len, strings = tape->stringsLen;
+  for(size_t i = 0, end = 0; i < count; i++) {
+    if(splice.count && at[i] < end) continue;
+    end = tapeNext(tape, at[i]);
+    for(size_t j = at[i]; j < end; j += wordWidth(tape, j)) {
+      char tag = tapeTag(tape, j);
+      if(tag == 'k' || tag == '"') strings -= stringSize(tape, j);
+    }
+    size_t removed = end - at[i];
+    splice.starts[splice.count] = at[i];
+    splice.shrink[splice.count] = removed +
+      (splice.count ? splice.shrink[splice.count - 1] : 0);
+    splice.count++;
+    words = words - removed + value->len;
+    strings += value->stringsLen;
+  }
+
+  JsonTape* out = RedisModule_Alloc(
+    sizeof(JsonTape) + words * sizeof(uint64_t) + strings
+  );
+  out->len = words;
+  out->stringsLen = 0;
+  out->strings = (char*)(out->words + words);
+  out->objectIndexes = NULL;
+  out->objectIndexCount = 0;
+
+  size_t pos = 0, from = 0;
+  for(size_t i = 0; i < splice.count; i++) {
+    pos = copyWords(out, pos, tape, from, splice.starts[i], &splice);
+    pos = copyWords(out, pos, value, 0, value->len, NULL);
+    from = tapeNext(tape, splice.starts[i]);
+  }
+  copyWords(out, pos, tape, from, tape->len, &splice);
+  RedisModule_Free(splice.starts);
+  finishTape(out);
+  return out;
+}
+
+JsonTape* tapeShare(JsonTape* tape) {
+  __atomic_add_fetch(&tape->refs, 1, __ATOMIC_RELAXED);
+  return tape;
+}
+
+JsonTape* tapeUnshare(JsonTape* tape) {
+  if(__atomic_load_n(&tape->refs, __ATOMIC_ACQUIRE) == 1) return tape;
+  size_t size = sizeof(JsonTape) + tape->len * sizeof(uint64_t) + tape->stringsLen;
+  JsonTape* copy = RedisModule_Alloc(size);
+  memcpy(copy, tape, size);
+  copy->refs = 1;
+  copy->strings = (char*)(copy->words + copy->len);
+  if(tape->objectIndexCount) {
+    copy->objectIndexes = RedisModule_Alloc(
+      tape->objectIndexCount * sizeof(TapeObjectIndex)
+    );
+    for(size_t i = 0; i < tape->objectIndexCount; i++) {
+      ObjectIndex* index = tape->objectIndexes[i].index;
+      size_t bytes = objectIndexBytes(index);
+      copy->objectIndexes[i].at = tape->objectIndexes[i].at;
+      copy->objectIndexes[i].index = memcpy(jsonAlloc(NULL, bytes), index, bytes);
+    }
+  }
+  tapeFree(tape);
+  return copy;
+}
+
+void tapeFree(JsonTape* tape) {
+  if(__atomic_sub_fetch(&tape->refs, 1, __ATOMIC_ACQ_REL)) return;
+  for(size_t i = 0; i < tape->objectIndexCount; i++) {
+    objectIndexFree(NULL, tape->objectIndexes[i].index);
+  }
+  if(tape->objectIndexes) RedisModule_Free(tape->objectIndexes);
+  RedisModule_Free(tape);
+}
+
+JsonValueType tapeType(const JsonTape* tape, size_t at) {
+  switch(tapeTag(tape, at)) {
+    case '{': return OBJECT;
+    case '[': return ARRAY;
+    case 'l': return INTEGER;
+    case 'd': return DOUBLE;
+    case 't': case 'f': return BOOLEAN;
+    case 'n': return NIL;
+    default: return STRING;
+  }
+}
+
+/*
+ * Counts the members when the stored count saturated.
+ */
+size_t tapeSize(const JsonTape* tape, size_t at) {
+  size_t count = (tapePayload(tape, at) >> 32) & TAPE_COUNT_MAX;
+  if(count < TAPE_COUNT_MAX) return count;
+  bool object = tapeTag(tape, at) == '{';
+  size_t end = tapeNext(tape, at);
+  count = 0;
+  for(size_t i = at + 1; i < end; i = tapeNext(tape, i)) {
+    if(object) ++i;
+    ++count;
+  }
+  return count;
+}
+
+const char* tapeString(const JsonTape* tape, size_t at, size_t* len) {
+  const char* p = tape->strings + tapePayload(tape, at);
+  uint32_t len32;
+  memcpy(&len32, p, sizeof(len32));
+  *len = len32;
+  return p + sizeof(len32);
+}
+
+int64_t tapeInteger(const JsonTape* tape, size_t at) {
+  int64_t value;
+  memcpy(&value, &tape->words[at + 1], sizeof(value));
+  return value;
+}
+
+double tapeDouble(const JsonTape* tape, size_t at) {
+  double value;
+  memcpy(&value, &tape->words[at + 1], sizeof(value));
+  return value;
+}
+
+void tapeSetInteger(JsonTape* tape, size_t at, int64_t value) {
+  tape->words[at] = tapeWord('l', 0);
+  memcpy(&tape->words[at + 1], &value, sizeof(value));
+}
+
+void tapeSetDouble(JsonTape* tape, size_t at, double value) {
+  tape->words[at] = tapeWord('d', 0);
+  memcpy(&tape->words[at + 1], &value, sizeof(value));
+}
+
+size_t tapeFindKey(
+  const JsonTape* tape,
+  size_t at,
+  const char* key,
+  size_t keyLen
+) {
+  if(tapeTag(tape, at) != '{') return TAPE_NONE;
+  ObjectIndex* index = tape->objectIndexCount ? findObjectIndex(tape, at) : NULL;
+  if(index) {
+    uint32_t hash = hashKey(key, keyLen);
+    uint32_t slot = hash & index->mask;
+    size_t i;
+    while((i = objectIndexNext(index, hash, &slot)) != SIZE_MAX) {
+      size_t len;
+      const char* str = tapeString(tape, i, &len);
+      if(len == keyLen && !memcmp(str, key, len)) return i + 1;
+    }
+    return TAPE_NONE;
+  }
+  size_t end = tapeNext(tape, at);
+  for(size_t i = at + 1; i < end; i = tapeNext(tape, i + 1)) {
+    size_t len;
+    const char* str = tapeString(tape, i, &len);
+    if(len == keyLen && !memcmp(str, key, len)) return i + 1;
+  }
+  return TAPE_NONE;
+}
+
+size_t tapeArrayAt(const JsonTape* tape, size_t at, size_t index) {
+  if(tapeTag(tape, at) != '[') return TAPE_NONE;
+  size_t end = tapeNext(tape, at);
+  size_t i = at + 1;
+  while(i < end && index--) i = tapeNext(tape, i);
+  return i < end ? i : TAPE_NONE;
+}
+
+/*
+ * Upper bound of the serialized size in one linear pass over the
+ * words, charging every value for a separator.
+ */
+size_t tapeSerializedSize(const JsonTape* tape, size_t at) {
+  size_t end = tapeNext(tape, at);
+  size_t size = 0;
+  size_t i = at;
+  while(i < end) {
+    size_t len;
+    switch(tapeTag(tape, i)) {
+      case '{': case '[':
+        size += 3;
+        ++i;
+        continue;
+      case 'k':
+        tapeString(tape, i, &len);
+        size += len + 3;
+        break;
+      case '"':
+        tapeString(tape, i, &len);
+        size += len + 3;
+        break;
+      case 'l':
+        size += integerLength(tapeInteger(tape, i)) + 1;
+        break;
+      case 'd':
+        size += NUMBER_BUF_SIZE + 1;
+        break;
+      case 'f':
+        size += 6;
+        break;
+      default:
+        size += 5;
+        break;
+    }
+    i = tapeNext(tape, i);
+  }
+  return size;
+}
+
+static char* tapeValueToString(const JsonTape* tape, size_t at, char* out) {
+  size_t len;
+  const char* str;
+  switch(tapeTag(tape, at)) {
+    case '{': {
+      size_t end = tapeNext(tape, at);
+      *out++ = '{';
+      for(size_t i = at + 1; i < end; i = tapeNext(tape, i + 1)) {
+        if(i > at + 1) *out++ = ',';
+        str = tapeString(tape, i, &len);
+        *out++ = '"';
+        memcpy(out, str, len);
+        out += len;
+        *out++ = '"';
+        *out++ = ':';
+        out = tapeValueToString(tape, i + 1, out);
+      }
+      *out++ = '}';
+      return out;
+    }
+    case '[': {
+      size_t end = tapeNext(tape, at);
+      *out++ = '[';
+      for(size_t i = at + 1; i < end; i = tapeNext(tape, i)) {
+        if(i > at + 1) *out++ = ',';
+        out = tapeValueToString(tape, i, out);
+      }
+      *out++ = ']';
+      return out;
+    }
+    case '"':
+      str = tapeString(tape, at, &len);
+      *out++ = '"';
+      memcpy(out, str, len);
+      out += len;
+      *out++ = '"';
+      return out;
+    case 'l':
+      return out + formatInteger(tapeInteger(tape, at), out);
+    case 'd':
+      return out + formatDouble(tapeDouble(tape, at), out);
+    case 't':
+      memcpy(out, "true", 4);
+      return out + 4;
+    case 'f':
+      memcpy(out, "false", 5);
+      return out + 5;
+    default:
+      memcpy(out, "null", 4);
+      return out + 4;
+  }
+}
+
+char* tapeWrite(const JsonTape* tape, size_t at, char* out) {
+  return tapeValueToString(tape, at, out);
+}
+
+size_t tapeMemory(const JsonTape* tape, size_t at) {
+  size_t end = tapeNext(tape, at);
+  size_t bytes = (end - at) * sizeof(uint64_t);
+  for(size_t i = at; i < end; i += wordWidth(tape, i)) {
+    char tag = tapeTag(tape, i);
+    if(tag == 'k' || tag == '"') bytes += stringSize(tape, i);
+  }
+  return bytes;
+}
+
+void tapeReplyWithResp3(RedisModuleCtx* ctx, const JsonTape* tape, size_t at) {
+  size_t len;
+  const char* str;
+  switch(tapeTag(tape, at)) {
+    case '{': {
+      size_t end = tapeNext(tape, at);
+      RedisModule_ReplyWithMap(ctx, tapeSize(tape, at));
+      for(size_t i = at + 1; i < end; i = tapeNext(tape, i + 1)) {
+        str = tapeString(tape, i, &len);
+        replyWithJsonString(ctx, str, len);
+        tapeReplyWithResp3(ctx, tape, i + 1);
+      }
+      break;
+    }
+    case '[': {
+      size_t end = tapeNext(tape, at);
+      RedisModule_ReplyWithArray(ctx, tapeSize(tape, at));
+      for(size_t i = at + 1; i < end; i = tapeNext(tape, i)) {
+        tapeReplyWithResp3(ctx, tape, i);
+      }
+      break;
+    }
+    case '"':
+      str = tapeString(tape, at, &len);
+      replyWithJsonString(ctx, str, len);
+      break;
+    case 'l':
+      RedisModule_ReplyWithLongLong(ctx, tapeInteger(tape, at));
+      break;
+    case 'd':
+      RedisModule_ReplyWithDouble(ctx, tapeDouble(tape, at));
+      break;
+    case 't': case 'f':
+      RedisModule_ReplyWithBool(ctx, tapeTag(tape, at) == 't');
+      break;
+    default:
+      RedisModule_ReplyWithNull(ctx);
+  }
+}
+
+char* tapeToBuffer(
+  const JsonTape* tape,
+  const size_t* at,
+  size_t count,
+  bool wrap,
+  size_t* len
+) {
+  size_t size = 2;
+  for(size_t i = 0; i < count; i++) {
+    size += tapeSerializedSize(tape, at[i]) + 1;
+  }
+  char* buf = RedisModule_Alloc(size);
+  char* out = buf;
+  if(wrap) *out++ = '[';
+  for(size_t i = 0; i < count; i++) {
+    if(i) *out++ = ',';
+    out = tapeValueToString(tape, at[i], out);
+  }
+  if(wrap) *out++ = ']';
+  *len = out - buf;
+  return buf;
+}
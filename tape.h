@@ -0,0 +1,193 @@
+#pragma once
+
+#include "redismodule.h"
+#include "value.h"
+#include "objectIndex.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Flat, read-optimized form of a document: one allocation holding an
+ * array of tagged 64-bit words followed by the string bytes. The top
+ * byte of a word is its tag, the low 56 bits its payload:
+ *
+ *   '{' '['  low 32 bits: index of the first word after the container,
+ *            bits 32-55: element count (saturates at TAPE_COUNT_MAX)
+ *   'k' '"'  key / string, offset of a uint32 length and the raw
+ *            (still escaped) bytes in `strings`
+ *   'l' 'd'  int64 / double, stored in the next word
+ *   't' 'f' 'n'
+ *
+ * Objects are their key words each followed by the value, so values
+ * are always reached by skipping, never by following pointers.
+ */
+#define TAPE_COUNT_MAX 0xffffff
+#define TAPE_NONE SIZE_MAX
+
+/*
+ * Key index of one wide object, positions being key word indexes.
+ */
+typedef struct {
+  size_t at;
+  ObjectIndex* index;
+} TapeObjectIndex;
+
+/*
+ * `bytes` is everything the tape holds, indexes included, as
+ * allocated. A tape never changes once built apart from numbers
+ * overwritten in place, so documents can share one: `refs` counts
+ * them.
+ */
+typedef struct JsonTape {
+  size_t refs;
+  size_t len;
+  size_t stringsLen;
+  size_t bytes;
+  char* strings;
+  TapeObjectIndex* objectIndexes;
+  size_t objectIndexCount;
+  uint64_t words[];
+} JsonTape;
+
+static inline char tapeTag(const JsonTape* tape, size_t at) {
+  return (char)(tape->words[at] >> 56);
+}
+
+static inline uint64_t tapePayload(const JsonTape* tape, size_t at) {
+  return tape->words[at] & 0x00ffffffffffffffULL;
+}
+
+/*
+ * Index of the word following the value that starts at `at`.
+ */
+static inline size_t tapeNext(const JsonTape* tape, size_t at) {
+  switch(tapeTag(tape, at)) {
+    case '{': case '[':
+      return (uint32_t)tape->words[at];
+    case 'l': case 'd':
+      return at + 2;
+    default:
+      return at + 1;
+  }
+}
+
+/*
+ * Growable tape used while a document is being built; finished into
+ * a single JsonTape allocation.
+ */
+typedef struct {
+  uint64_t* words;
+  size_t len;
+  size_t cap;
+  char* strings;
+  size_t stringsLen;
+  size_t stringsCap;
+} TapeBuilder;
+
+void tapeBuilderInit(TapeBuilder* b, size_t wordsHint, size_t stringsHint);
+size_t tapeOpen(TapeBuilder* b, char tag);
+void tapeClose(TapeBuilder* b, size_t at, size_t count);
+void tapeAppendString(TapeBuilder* b, char tag, const char* str, size_t len);
+void tapeAppendInteger(TapeBuilder* b, int64_t value);
+void tapeAppendDouble(TapeBuilder* b, double value);
+void tapeAppendAtom(TapeBuilder* b, char tag);
+JsonTape* tapeBuilderFinish(TapeBuilder* b);
+
+/*
+ * Builds the tape straight from a validated stage 1 index.
+ */
+JsonTape* tapeFromIndex(
+  const char* json,
+  const uint32_t* indexes,
+  size_t count
+);
+
+JsonTape* tapeFromValue(JsonValue* value);
+
+/*
+ * Decodes the value at `at` into a tree allocated from `arena`, or the
+ * heap when NULL.
+ */
+JsonValue* tapeToValue(const JsonTape* tape, size_t at, JsonArena* arena);
+
+/*
+ * Returns a new tape with each value starting at the sorted word
+ * indexes `at` replaced by `value`; a value nested in an earlier one
+ * goes with it. Strings are copied over so nothing is left behind.
+ */
+JsonTape* tapeSplice(
+  const JsonTape* tape,
+  const size_t* at,
+  size_t count,
+  const JsonTape* value
+);
+
+/*
+ * tapeShare adds a reference. tapeFree drops one and frees the tape
+ * with the last; it is atomic because a document may be freed on the
+ * lazyfree thread while a copy is still in use. tapeUnshare is called
+ * before writing to a tape in place and returns a private copy of a
+ * shared one, dropping the caller's reference, or the tape itself.
+ */
+JsonTape* tapeShare(JsonTape* tape);
+JsonTape* tapeUnshare(JsonTape* tape);
+void tapeFree(JsonTape* tape);
+
+JsonValueType tapeType(const JsonTape* tape, size_t at);
+size_t tapeSize(const JsonTape* tape, size_t at);
+const char* tapeString(const JsonTape* tape, size_t at, size_t* len);
+int64_t tapeInteger(const JsonTape* tape, size_t at);
+double tapeDouble(const JsonTape* tape, size_t at);
+
+/*
+ * Overwrite the number at `at`, which has to be one already: both
+ * forms are two words, so nothing else moves. The tape must not be
+ * shared.
+ */
+void tapeSetInteger(JsonTape* tape, size_t at, int64_t value);
+void tapeSetDouble(JsonTape* tape, size_t at, double value);
+
+/*
+ * Both return TAPE_NONE when there is no such member.
+ */
+size_t tapeFindKey(
+  const JsonTape* tape,
+  size_t at,
+  const char* key,
+  size_t keyLen
+);
+size_t tapeArrayAt(const JsonTape* tape, size_t at, size_t index);
+
+/*
+ * Bytes the value at `at` takes on the tape: its words and its
+ * strings with their length prefixes.
+ */
+size_t tapeMemory(const JsonTape* tape, size_t at);
+
+/*
+ * Upper bound of the serialized size of the value at `at`, and the
+ * serializer itself, which returns the end of what it wrote.
+ */
+size_t tapeSerializedSize(const JsonTape* tape, size_t at);
+char* tapeWrite(const JsonTape* tape, size_t at, char* out);
+
+/*
+ * Replies with the value at `at` as native RESP3 types, the same way
+ * replyWithResp3 does for trees.
+ */
+void tapeReplyWithResp3(RedisModuleCtx* ctx, const JsonTape* tape, size_t at);
+
+/*
+ * Serializes the values at `at` into one buffer, as a JSON array when
+ * `wrap` is set. Free with RedisModule_Free.
+ */
+char* tapeToBuffer(
+  const JsonTape* tape,
+  const size_t* at,
+  size_t count,
+  bool wrap,
+  size_t* len
+);
+
+void JsonTapeRdbSaveImpl(RedisModuleIO* rdb, const JsonTape* tape);
+JsonTape* JsonTapeRdbLoadImpl(RedisModuleIO* rdb);
@@ -1,10 +1,547 @@
 #include "value.h"
+#include "tape.h"
+#include "descentIndex.h"
+#include "defrag.h"
+#include "config.h"
 #include "redismodule.h"
+#include <string.h>
 
-JsonValue* allocObject(size_t size) {
-  JsonValue* value = RedisModule_Calloc(1, sizeof(JsonValue));
-  value->value.object.elements = RedisModule_Calloc(size, sizeof(JsonKeyVal*));
+static _Thread_local size_t heapBytes;
+
+size_t jsonHeapBytes(void) {
+  return heapBytes;
+}
+
+void* jsonAlloc(JsonArena* arena, size_t size) {
+  if(arena) return arenaAlloc(arena, size);
+  void* ptr = RedisModule_Calloc(1, size);
+  heapBytes += RedisModule_MallocSize(ptr);
+  return ptr;
+}
+
+void* jsonRealloc(JsonArena* arena, void* ptr, size_t oldSize, size_t newSize) {
+  if(!arena) {
+    if(ptr) heapBytes -= RedisModule_MallocSize(ptr);
+    ptr = RedisModule_Realloc(ptr, newSize);
+    heapBytes += RedisModule_MallocSize(ptr);
+    return ptr;
+  }
+  void* grown = arenaAlloc(arena, newSize);
+  if(ptr) {
+    memcpy(grown, ptr, oldSize < newSize ? oldSize : newSize);
+    arenaRelease(arena, oldSize);
+  }
+  return grown;
+}
+
+void jsonFree(JsonArena* arena, void* ptr, size_t size) {
+  if(!ptr) return;
+  if(arena) {
+    arenaRelease(arena, size);
+  } else {
+    heapBytes -= RedisModule_MallocSize(ptr);
+    RedisModule_Free(ptr);
+  }
+}
+
+static void* heapAlloc(size_t size) {
+  void* ptr = RedisModule_Alloc(size);
+  heapBytes += RedisModule_MallocSize(ptr);
+  return ptr;
+}
+
+char* jsonStrndup(JsonArena* arena, const char* str, size_t len) {
+  char* copy = arena ? arenaAlloc(arena, len + 1) : heapAlloc(len + 1);
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+  return copy;
+}
+
+void keySet(JsonArena* arena, JsonKeyVal* keyVal, const char* key, size_t len) {
+  keyVal->keyLen = len;
+  keyVal->hash = hashKey(key, len);
+  if(len <= KEY_INLINE_SIZE) {
+    memcpy(keyVal->key.inl, key, len);
+  } else {
+    keyVal->key.ptr = arena ? arenaAlloc(arena, len) : heapAlloc(len);
+    memcpy(keyVal->key.ptr, key, len);
+  }
+}
+
+void keyFree(JsonArena* arena, JsonKeyVal* keyVal) {
+  if(keyVal->keyLen > KEY_INLINE_SIZE) {
+    jsonFree(arena, keyVal->key.ptr, keyVal->keyLen);
+  }
+}
+
+JsonValue* allocObject(JsonArena* arena, size_t size) {
+  JsonValue* value = jsonAlloc(arena, sizeof(JsonValue));
+  if(size) {
+    value->value.object.elements = jsonAlloc(arena, size * sizeof(JsonKeyVal*));
+  }
   value->value.object.size = size;
+  value->value.object.cap = size;
   value->type = OBJECT;
   return value;
 }
+
+/*
+ * Drops the key index and builds a new one when the object is at or
+ * above the threshold. Parsing and RDB loading call this once per
+ * object after its members are in place.
+ */
+void objectReindex(JsonArena* arena, struct JsonObject* object) {
+  objectIndexFree(arena, object->index);
+  object->index = NULL;
+  size_t threshold = jsonConfig.objectIndexThreshold;
+  if(!threshold || object->size < threshold) return;
+
+  object->index = objectIndexNew(arena, object->size);
+  for(size_t i = 0; i < object->size; i++) {
+    objectIndexAdd(object->index, object->elements[i]->hash, i);
+  }
+}
+
+static inline bool keyMatches(
+  const JsonKeyVal* keyVal,
+  const char* key,
+  size_t keyLen,
+  uint32_t hash
+) {
+  return keyVal->hash == hash &&
+    keyVal->keyLen == keyLen &&
+    !memcmp(keyData(keyVal), key, keyLen);
+}
+
+size_t objectFind(struct JsonObject* object, const char* key, size_t keyLen) {
+  return objectFindHashed(object, key, keyLen, hashKey(key, keyLen));
+}
+
+size_t objectFindHashed(
+  struct JsonObject* object,
+  const char* key,
+  size_t keyLen,
+  uint32_t hash
+) {
+  if(object->index) {
+    uint32_t slot = hash & object->index->mask;
+    size_t pos;
+    while((pos = objectIndexNext(object->index, hash, &slot)) != SIZE_MAX) {
+      if(keyMatches(object->elements[pos], key, keyLen, hash)) return pos;
+    }
+    return OBJECT_NONE;
+  }
+  for(size_t i = 0; i < object->size; i++) {
+    if(keyMatches(object->elements[i], key, keyLen, hash)) return i;
+  }
+  return OBJECT_NONE;
+}
+
+void objectAppend(JsonArena* arena, struct JsonObject* object, JsonKeyVal* keyVal) {
+  if(object->size == object->cap) {
+    size_t cap = object->cap ? object->cap * 2 : 4;
+    object->elements = jsonRealloc(
+      arena,
+      object->elements,
+      object->cap * sizeof(JsonKeyVal*),
+      cap * sizeof(JsonKeyVal*)
+    );
+    object->cap = cap;
+  }
+  size_t pos = object->size++;
+  object->elements[pos] = keyVal;
+  if(object->index && objectIndexFits(object->index, object->size)) {
+    objectIndexAdd(object->index, keyVal->hash, pos);
+  } else {
+    objectReindex(arena, object);
+  }
+}
+
+void objectInsert(
+  JsonArena* arena,
+  struct JsonObject* object,
+  size_t pos,
+  JsonKeyVal* keyVal
+) {
+  objectAppend(arena, object, keyVal);
+  if(pos == object->size - 1) return;
+  memmove(
+    object->elements + pos + 1,
+    object->elements + pos,
+    (object->size - pos - 1) * sizeof(JsonKeyVal*)
+  );
+  object->elements[pos] = keyVal;
+  if(object->index) objectReindex(arena, object);
+}
+
+/*
+ * Removes the member pointer only, keeping the order of the rest;
+ * the caller owns the removed JsonKeyVal.
+ */
+void objectRemove(JsonArena* arena, struct JsonObject* object, size_t pos) {
+  memmove(
+    object->elements + pos,
+    object->elements + pos + 1,
+    (object->size - pos - 1) * sizeof(JsonKeyVal*)
+  );
+  --object->size;
+  if(object->index) objectReindex(arena, object);
+}
+
+void arrayInsert(
+  JsonArena* arena,
+  JsonArray* array,
+  size_t pos,
+  JsonValue** values,
+  size_t count
+) {
+  if(array->size + count > array->cap) {
+    size_t cap = array->cap ? array->cap * 2 : 4;
+    while(cap < array->size + count) cap *= 2;
+    array->array = jsonRealloc(
+      arena,
+      array->array,
+      array->cap * sizeof(JsonValue*),
+      cap * sizeof(JsonValue*)
+    );
+    array->cap = cap;
+  }
+  memmove(
+    array->array + pos + count,
+    array->array + pos,
+    (array->size - pos) * sizeof(JsonValue*)
+  );
+  memcpy(array->array + pos, values, count * sizeof(JsonValue*));
+  array->size += count;
+}
+
+JsonValue* arrayRemove(JsonArray* array, size_t pos) {
+  JsonValue* removed = array->array[pos];
+  memmove(
+    array->array + pos,
+    array->array + pos + 1,
+    (array->size - pos - 1) * sizeof(JsonValue*)
+  );
+  --array->size;
+  return removed;
+}
+
+void arrayTrim(JsonArena* arena, JsonArray* array, size_t start, size_t end) {
+  for(size_t i = 0; i < array->size; i++) {
+    if(i < start || i >= end) JsonTypeFreeImpl(array->array[i], arena);
+  }
+  size_t size = end > start ? end - start : 0;
+  memmove(array->array, array->array + start, size * sizeof(JsonValue*));
+  array->size = size;
+}
+
+RedisJsonValue* docNew(bool useArena, size_t sizeHint) {
+  RedisJsonValue* doc = RedisModule_Calloc(1, sizeof(RedisJsonValue));
+  if(useArena) doc->arena = arenaNew(sizeHint);
+  return doc;
+}
+
+void docFree(RedisJsonValue* doc) {
+  descentIndexInvalidate(doc);
+  if(doc->tape) {
+    tapeFree(doc->tape);
+  } else if(doc->arena) {
+    arenaFree(doc->arena);
+  } else if(doc->rootJson) {
+    JsonTypeFreeImpl(doc->rootJson, NULL);
+  }
+  RedisModule_Free(doc);
+}
+
+void docUnlink(RedisJsonValue* doc) {
+  descentIndexInvalidate(doc);
+  docDefragCancel(doc);
+}
+
+size_t docFreeEffort(const RedisJsonValue* doc) {
+  if(doc->tape) return 1 + doc->tape->objectIndexCount;
+  if(doc->arena) return 1 + doc->arena->chunks;
+  return 1 + doc->heapBytes / sizeof(JsonValue);
+}
+
+RedisJsonValue* docCopy(const RedisJsonValue* doc) {
+  if(doc->tape) {
+    RedisJsonValue* copy = docNew(false, 0);
+    copy->tape = tapeShare(doc->tape);
+    return copy;
+  }
+  RedisJsonValue* copy = docNew(doc->arena, doc->arena ? arenaLive(doc->arena) : 0);
+  size_t heapBytes = jsonHeapBytes();
+  copy->rootJson = valueCopy(copy->arena, doc->rootJson);
+  if(!copy->arena) copy->heapBytes = jsonHeapBytes() - heapBytes;
+  return copy;
+}
+
+size_t docMemory(const RedisJsonValue* doc) {
+  size_t bytes = RedisModule_MallocSize((void*)doc);
+  if(doc->tape) {
+    bytes += doc->tape->bytes;
+  } else if(doc->arena) {
+    bytes += RedisModule_MallocSize(doc->arena) + doc->arena->reserved;
+  } else {
+    bytes += doc->heapBytes;
+  }
+  if(doc->descentIndex) bytes += doc->descentIndex->bytes;
+  return bytes;
+}
+
+static size_t allocSize(JsonArena* arena, const void* ptr, size_t size) {
+  return arena ? size : RedisModule_MallocSize((void*)ptr);
+}
+
+size_t valueMemory(const JsonValue* value, JsonArena* arena) {
+  size_t bytes = allocSize(arena, value, sizeof(JsonValue));
+  switch(value->type) {
+    case OBJECT: {
+      const struct JsonObject* object = &value->value.object;
+      if(object->elements) {
+        bytes += allocSize(
+          arena,
+          object->elements,
+          object->cap * sizeof(JsonKeyVal*)
+        );
+      }
+      if(object->index) {
+        bytes += allocSize(arena, object->index, objectIndexBytes(object->index));
+      }
+      for(size_t i = 0; i < object->size; i++) {
+        const JsonKeyVal* member = object->elements[i];
+        bytes += allocSize(arena, member, sizeof(JsonKeyVal));
+        if(member->keyLen > KEY_INLINE_SIZE) {
+          bytes += allocSize(arena, member->key.ptr, member->keyLen);
+        }
+        bytes += valueMemory(member->value, arena);
+      }
+      break;
+    }
+    case ARRAY: {
+      const JsonArray* array = &value->value.array;
+      if(array->array) {
+        bytes += allocSize(arena, array->array, array->cap * sizeof(JsonValue*));
+      }
+      for(size_t i = 0; i < array->size; i++) {
+        bytes += valueMemory(array->array[i], arena);
+      }
+      break;
+    }
+    case STRING:
+      bytes += allocSize(
+        arena,
+        value->value.string.data,
+        value->value.string.size + 1
+      );
+      break;
+    default:
+      break;
+  }
+  return bytes;
+}
+
+JsonValue* valueCopy(JsonArena* arena, const JsonValue* value) {
+  JsonValue* copy;
+  switch(value->type) {
+    case OBJECT: {
+      const struct JsonObject* object = &value->value.object;
+      copy = allocObject(arena, object->size);
+      for(size_t i = 0; i < object->size; i++) {
+        const JsonKeyVal* member = object->elements[i];
+        JsonKeyVal* keyVal = jsonAlloc(arena, sizeof(JsonKeyVal));
+        keySet(arena, keyVal, keyData(member), member->keyLen);
+        keyVal->value = valueCopy(arena, member->value);
+        copy->value.object.elements[i] = keyVal;
+      }
+      objectReindex(arena, &copy->value.object);
+      return copy;
+    }
+    case ARRAY: {
+      const JsonArray* array = &value->value.array;
+      copy = jsonAlloc(arena, sizeof(JsonValue));
+      copy->type = ARRAY;
+      copy->value.array.size = array->size;
+      copy->value.array.cap = array->size;
+      if(array->size) {
+        copy->value.array.array = jsonAlloc(arena, array->size * sizeof(JsonValue*));
+      }
+      for(size_t i = 0; i < array->size; i++) {
+        copy->value.array.array[i] = valueCopy(arena, array->array[i]);
+      }
+      return copy;
+    }
+    case STRING:
+      copy = jsonAlloc(arena, sizeof(JsonValue));
+      *copy = *value;
+      copy->value.string.data = jsonStrndup(
+        arena,
+        value->value.string.data,
+        value->value.string.size
+      );
+      return copy;
+    default:
+      copy = jsonAlloc(arena, sizeof(JsonValue));
+      *copy = *value;
+      return copy;
+  }
+}
+
+bool valueEquals(const JsonValue* a, const JsonValue* b) {
+  if(a->type != b->type) {
+    if(a->type == INTEGER && b->type == DOUBLE) {
+      return (double)a->value.integer == b->value.number;
+    }
+    if(a->type == DOUBLE && b->type == INTEGER) {
+      return a->value.number == (double)b->value.integer;
+    }
+    return false;
+  }
+  switch(a->type) {
+    case OBJECT: {
+      const struct JsonObject* x = &a->value.object;
+      struct JsonObject y = b->value.object;
+      if(x->size != y.size) return false;
+      for(size_t i = 0; i < x->size; i++) {
+        const JsonKeyVal* member = x->elements[i];
+        size_t pos = objectFindHashed(
+          &y,
+          keyData(member),
+          member->keyLen,
+          member->hash
+        );
+        if(pos == OBJECT_NONE) return false;
+        if(!valueEquals(member->value, y.elements[pos]->value)) return false;
+      }
+      return true;
+    }
+    case ARRAY: {
+      const JsonArray* x = &a->value.array;
+      const JsonArray* y = &b->value.array;
+      if(x->size != y->size) return false;
+      for(size_t i = 0; i < x->size; i++) {
+        if(!valueEquals(x->array[i], y->array[i])) return false;
+      }
+      return true;
+    }
+    case STRING:
+      return a->value.string.size == b->value.string.size &&
+        !memcmp(a->value.string.data, b->value.string.data, a->value.string.size);
+    case INTEGER:
+      return a->value.integer == b->value.integer;
+    case DOUBLE:
+      return a->value.number == b->value.number;
+    case BOOLEAN:
+      return a->value.boolean == b->value.boolean;
+    default:
+      return true;
+  }
+}
+
+/*
+ * The contents are swapped so that freeing `src` releases both the
+ * old contents of `target` and the node `src` itself.
+ */
+void valueReplace(JsonArena* arena, JsonValue* target, JsonValue* src) {
+  JsonValue old = *target;
+  *target = *src;
+  *src = old;
+  JsonTypeFreeImpl(src, arena);
+}
+
+static void freeMember(JsonArena* arena, JsonKeyVal* keyVal) {
+  keyFree(arena, keyVal);
+  if(keyVal->value) JsonTypeFreeImpl(keyVal->value, arena);
+  jsonFree(arena, keyVal, sizeof(JsonKeyVal));
+}
+
+/*
+ * Patch members are moved into the target as they are, except that
+ * a new object member is merged into an empty object first so the
+ * nulls inside it are dropped as well.
+ */
+void valueMerge(JsonArena* arena, JsonValue* target, JsonValue* patch) {
+  if(patch->type != OBJECT) {
+    valueReplace(arena, target, patch);
+    return;
+  }
+  if(target->type != OBJECT) valueReplace(arena, target, allocObject(arena, 0));
+
+  struct JsonObject* object = &target->value.object;
+  struct JsonObject* members = &patch->value.object;
+  for(size_t i = 0; i < members->size; i++) {
+    JsonKeyVal* member = members->elements[i];
+    size_t pos = objectFindHashed(
+      object,
+      keyData(member),
+      member->keyLen,
+      member->hash
+    );
+    if(member->value->type == NIL) {
+      if(pos != OBJECT_NONE) {
+        JsonKeyVal* removed = object->elements[pos];
+        objectRemove(arena, object, pos);
+        freeMember(arena, removed);
+      }
+      freeMember(arena, member);
+    } else if(pos != OBJECT_NONE) {
+      valueMerge(arena, object->elements[pos]->value, member->value);
+      member->value = NULL;
+      freeMember(arena, member);
+    } else {
+      if(member->value->type == OBJECT) {
+        JsonValue* value = allocObject(arena, 0);
+        valueMerge(arena, value, member->value);
+        member->value = value;
+      }
+      objectAppend(arena, object, member);
+    }
+  }
+  jsonFree(arena, members->elements, members->cap * sizeof(JsonKeyVal*));
+  objectIndexFree(arena, members->index);
+  jsonFree(arena, patch, sizeof(JsonValue));
+}
+
+void docCompact(RedisJsonValue* doc) {
+  JsonArena* arena = doc->arena;
+  if(!arena || arena->wasted <= arena->reserved / 2) return;
+  descentIndexInvalidate(doc);
+  doc->arena = arenaNew(arenaLive(arena));
+  doc->rootJson = valueCopy(doc->arena, doc->rootJson);
+  arenaFree(arena);
+}
+
+void docEditBegin(RedisJsonValue* doc, DocEdit* edit) {
+  if(!doc->tape) {
+    edit->doc = doc;
+    edit->heapBytes = jsonHeapBytes();
+    return;
+  }
+  memset(&edit->view, 0, sizeof(RedisJsonValue));
+  edit->view.arena = arenaNew(
+    doc->tape->len * (sizeof(JsonValue) + sizeof(JsonKeyVal)) / 2 +
+    doc->tape->stringsLen
+  );
+  edit->view.rootJson = tapeToValue(doc->tape, 0, edit->view.arena);
+  edit->doc = &edit->view;
+}
+
+void docEditEnd(RedisJsonValue* doc, DocEdit* edit, bool changed) {
+  if(edit->doc == &edit->view) {
+    if(changed) {
+      JsonTape* tape = tapeFromValue(edit->view.rootJson);
+      tapeFree(doc->tape);
+      doc->tape = tape;
+    }
+    descentIndexInvalidate(&edit->view);
+    arenaFree(edit->view.arena);
+  } else if(!doc->arena) {
+    doc->heapBytes += jsonHeapBytes() - edit->heapBytes;
+  }
+  if(changed) {
+    descentIndexInvalidate(doc);
+    docDefragCancel(doc);
+    docCompact(doc);
+  }
+}
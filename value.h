@@ -1,33 +1,69 @@
 #pragma once
 
 #include "redismodule.h"
+#include "arena.h"
+#include "objectIndex.h"
 #include <stdint.h>
 #include <stdbool.h>
 
+/*
+ * Deepest nesting the parser accepts.
+ */
+#define JSON_MAX_DEPTH 1024
+
 typedef enum {
   OBJECT,
   ARRAY,
   INTEGER,
   DOUBLE,
   STRING,
-  BOOLEAN
+  BOOLEAN,
+  NIL
 } JsonValueType;
 
 struct JsonValue;
 
+/*
+ * Keys of up to KEY_INLINE_SIZE bytes are stored in the entry itself,
+ * longer ones in a separate allocation. Either way they are not NUL
+ * terminated; use keyData and keyLen.
+ */
+#define KEY_INLINE_SIZE 16
+
 typedef struct {
-  const char* key;
   struct JsonValue* value;
+  uint32_t keyLen;
+  uint32_t hash;
+  union {
+    char* ptr;
+    char inl[KEY_INLINE_SIZE];
+  } key;
 } JsonKeyVal;
 
+static inline const char* keyData(const JsonKeyVal* keyVal) {
+  return keyVal->keyLen <= KEY_INLINE_SIZE ? keyVal->key.inl : keyVal->key.ptr;
+}
+
+/*
+ * `cap` is the number of slots allocated for `elements`, grown the
+ * same way as an array's. `index` is only set on objects with at
+ * least redisjson.object-index-threshold members.
+ */
 struct JsonObject {
   JsonKeyVal** elements;
   size_t size;
+  size_t cap;
+  ObjectIndex* index;
 };
 
+/*
+ * `cap` is the number of slots allocated for `array`, so appends grow
+ * it geometrically instead of one element at a time.
+ */
 typedef struct {
   struct JsonValue** array;
   size_t size;
+  size_t cap;
 } JsonArray;
 
 typedef struct {
@@ -47,13 +83,181 @@ typedef struct JsonValue {
   JsonValueType type;
 } JsonValue;
 
+struct JsonTape;
+
+/*
+ * The value stored in the keyspace. When `arena` is set every node,
+ * key and string of the document was bump allocated from it,
+ * otherwise each one is its own heap allocation and `heapBytes` is
+ * what they add up to. Documents kept in tape storage have `tape` set
+ * instead of `rootJson`. `descentIndex` is built by the first `..key`
+ * query and dropped on every write.
+ */
 typedef struct {
   JsonValue* rootJson;
+  JsonArena* arena;
+  size_t heapBytes;
+  struct JsonTape* tape;
+  struct DescentIndex* descentIndex;
 } RedisJsonValue;
 
-JsonValue* allocNumber(long long num);
-JsonValue* allocObject(size_t size);
+/*
+ * Allocation helpers that every part of a document goes through.
+ * With a NULL arena they map to the module heap and keep a running
+ * total of the bytes the allocator handed out, which jsonHeapBytes
+ * returns. A write reads it before and after to learn what it cost
+ * the document; the total is per thread because documents can also
+ * be freed off the main thread.
+ */
+void* jsonAlloc(JsonArena* arena, size_t size);
+void* jsonRealloc(JsonArena* arena, void* ptr, size_t oldSize, size_t newSize);
+void jsonFree(JsonArena* arena, void* ptr, size_t size);
+char* jsonStrndup(JsonArena* arena, const char* str, size_t len);
+size_t jsonHeapBytes(void);
+
+JsonValue* allocObject(JsonArena* arena, size_t size);
+
+#define OBJECT_NONE SIZE_MAX
+
+/*
+ * Member access that keeps the key index in step with the members.
+ * objectFind returns OBJECT_NONE when the key is missing.
+ */
+size_t objectFind(struct JsonObject* object, const char* key, size_t keyLen);
+size_t objectFindHashed(
+  struct JsonObject* object,
+  const char* key,
+  size_t keyLen,
+  uint32_t hash
+);
+void objectAppend(JsonArena* arena, struct JsonObject* object, JsonKeyVal* keyVal);
+void objectInsert(
+  JsonArena* arena,
+  struct JsonObject* object,
+  size_t pos,
+  JsonKeyVal* keyVal
+);
+void objectRemove(JsonArena* arena, struct JsonObject* object, size_t pos);
+void objectReindex(JsonArena* arena, struct JsonObject* object);
+
+/*
+ * Copies the key into the entry (or its own allocation when it does
+ * not fit) and records its length and hash. keyFree releases what
+ * keySet allocated.
+ */
+void keySet(JsonArena* arena, JsonKeyVal* keyVal, const char* key, size_t len);
+void keyFree(JsonArena* arena, JsonKeyVal* keyVal);
+
+/*
+ * Element edits that keep `cap` in step. arrayInsert takes ownership
+ * of the values; arrayRemove hands the removed element to the caller
+ * and arrayTrim frees everything outside [start, end).
+ */
+void arrayInsert(
+  JsonArena* arena,
+  JsonArray* array,
+  size_t pos,
+  JsonValue** values,
+  size_t count
+);
+JsonValue* arrayRemove(JsonArray* array, size_t pos);
+void arrayTrim(JsonArena* arena, JsonArray* array, size_t start, size_t end);
+
+RedisJsonValue* docNew(bool useArena, size_t sizeHint);
+void docFree(RedisJsonValue* doc);
+
+/*
+ * Lazy free support. docUnlink drops what the document shares with
+ * the rest of the module while it is still on the main thread, so
+ * docFree touches nothing but the document and can run on another
+ * thread. docFreeEffort is roughly the number of allocations docFree
+ * gives back, estimated for heap trees from their byte count.
+ */
+void docUnlink(RedisJsonValue* doc);
+size_t docFreeEffort(const RedisJsonValue* doc);
+
+/*
+ * A new document with the same contents. A tree is copied in one
+ * pass, an arena tree into a single chunk sized to what the original
+ * still uses. A tape is shared with the original until either one
+ * writes to it.
+ */
+RedisJsonValue* docCopy(const RedisJsonValue* doc);
+
+/*
+ * Copies an arena tree into a fresh arena sized to what it still uses
+ * once more than half of what the old one reserved is wasted, so a
+ * document that is written to over and over does not keep growing.
+ * The copy costs at most what was wasted since the last one. Run after
+ * every write that changes an arena tree; pointers into the old tree
+ * are no longer valid afterwards.
+ */
+void docCompact(RedisJsonValue* doc);
+
+/*
+ * Bytes held by the document, from totals that are kept as it
+ * changes: what the arena reserved, what the tape was built with, or
+ * `heapBytes`, plus the descent index. A tape shared by copies is
+ * counted in full for each of them.
+ */
+size_t docMemory(const RedisJsonValue* doc);
+
+/*
+ * Bytes held by one subtree, found by walking it: allocator sizes for
+ * heap nodes, requested sizes inside an arena.
+ */
+size_t valueMemory(const JsonValue* value, JsonArena* arena);
+
+JsonValue* valueCopy(JsonArena* arena, const JsonValue* value);
+
+/*
+ * Structural equality: members in any order, numbers by value whether
+ * stored as integers or doubles, strings in their escaped form.
+ */
+bool valueEquals(const JsonValue* a, const JsonValue* b);
+
+/*
+ * Moves the contents of `src` into `target` in place, so pointers to
+ * `target` stay valid, and frees the old contents and `src`.
+ */
+void valueReplace(JsonArena* arena, JsonValue* target, JsonValue* src);
+
+/*
+ * Applies `patch` to `target` as an RFC 7396 merge patch, taking
+ * ownership of it: members of an object patch are merged one by one
+ * into the target object, null members delete, and any other patch
+ * replaces the target. Untouched members are left where they are.
+ */
+void valueMerge(JsonArena* arena, JsonValue* target, JsonValue* patch);
+
+/*
+ * Every write edits a tree. For a tree document that is the document
+ * itself; a tape document is decoded into a scratch tree and encoded
+ * again by docEditEnd when `changed` is set, so a write to a tape
+ * costs a copy of the document but never a parse. Either way
+ * docEditEnd drops what was derived from the old contents. Edit
+ * `edit.doc->rootJson` from `edit.doc->arena`.
+ */
+typedef struct {
+  RedisJsonValue* doc;
+  RedisJsonValue view;
+  size_t heapBytes;
+} DocEdit;
+
+void docEditBegin(RedisJsonValue* doc, DocEdit* edit);
+void docEditEnd(RedisJsonValue* doc, DocEdit* edit, bool changed);
 
 void JsonTypeRdbSaveImpl(RedisModuleIO* rdb, JsonValue* value);
-void JsonTypeRdbLoadImpl(RedisModuleIO* rdb, JsonValue* value);
-void JsonTypeFreeImpl(JsonValue* value);
+void JsonTypeRdbLoadImpl(RedisModuleIO* rdb, JsonValue* value, JsonArena* arena);
+void JsonTypeFreeImpl(JsonValue* value, JsonArena* arena);
+
+/*
+ * Emits the commands that rebuild the document: one JSON.SET, or
+ * for documents over redisjson.aof-chunk-size an empty root followed
+ * by JSON.PATCH commands of about that size each.
+ */
+void JsonTypeAofRewriteImpl(
+  RedisModuleIO* aof,
+  RedisModuleString* key,
+  const RedisJsonValue* doc
+);